@@ -35,8 +35,14 @@ LOCAL_LDFLAGS :=  -g
 
 ifeq ($(TARGET_USES_HWC2), false)
 LOCAL_SRC_FILES := \
+        common/BufferMapper.cpp \
+        common/BufferRegistry.cpp \
+        common/EventLoop.cpp \
+        common/PixelCodec.cpp \
+        common/ProtocolRecorder.cpp \
         common/RemoteDisplay.cpp \
         common/RemoteDisplayMgr.cpp \
+        common/ShmRing.cpp \
         hwc1/Hwc1Device.cpp \
         hwc1/Hwc1Display.cpp \
 
@@ -70,10 +76,16 @@ LOCAL_CPPFLAGS += \
 endif
 
 LOCAL_SRC_FILES := \
+        common/BufferRegistry.cpp \
+        common/EventLoop.cpp \
+        common/PixelCodec.cpp \
+        common/ProtocolRecorder.cpp \
         common/RemoteDisplay.cpp \
         common/RemoteDisplayMgr.cpp \
+        common/ShmRing.cpp \
         common/LocalDisplay.cpp \
         common/BufferMapper.cpp \
+        common/SyncTimeline.cpp \
         hwc2/Hwc2Device.cpp \
         hwc2/Hwc2Display.cpp \
         hwc2/Hwc2Layer.cpp \
@@ -122,4 +134,64 @@ LOCAL_MODULE_TAGS := optional
 LOCAL_MODULE_RELATIVE_PATH := hw
 include $(BUILD_SHARED_LIBRARY)
 
+#####################tests#########################
+include $(CLEAR_VARS)
+
+LOCAL_CFLAGS := -DLOG_TAG=\"hwc_vhal_tests\"
+LOCAL_CPPFLAGS := -g -std=c++11 -Wall -Werror -Wno-unused-parameter
+LOCAL_SRC_FILES := \
+        common/BufferMapper.cpp \
+        common/BufferRegistry.cpp \
+        common/EventLoop.cpp \
+        common/PixelCodec.cpp \
+        common/ProtocolRecorder.cpp \
+        common/RemoteDisplay.cpp \
+        common/ShmRing.cpp \
+        tests/BufferRegistryTest.cpp \
+        tests/EventLoopTest.cpp \
+        tests/PixelCodecTest.cpp \
+        tests/RemoteDisplayTest.cpp \
+        tests/ShmRingTest.cpp \
+
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/common
+LOCAL_SHARED_LIBRARIES := liblog libcutils libhardware
+LOCAL_MODULE := hwc_vhal_tests
+LOCAL_MODULE_TAGS := tests
+include $(BUILD_NATIVE_TEST)
+
+#####################tools#########################
+include $(CLEAR_VARS)
+
+LOCAL_CPPFLAGS := -g -std=c++11 -Wall -Werror -Wno-unused-parameter
+LOCAL_SRC_FILES := tools/hwc_replay/hwc_replay.cpp
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/common $(LOCAL_PATH)/tools/common
+LOCAL_MODULE := hwc_replay
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_CPPFLAGS := -g -std=c++11 -Wall -Werror -Wno-unused-parameter
+LOCAL_SRC_FILES := \
+        common/PixelCodec.cpp \
+        tools/hwc_mock_remote/hwc_mock_remote.cpp \
+
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/common $(LOCAL_PATH)/tools/common
+LOCAL_MODULE := hwc_mock_remote
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_CPPFLAGS := -g -std=c++11 -Wall -Werror -Wno-unused-parameter
+LOCAL_SRC_FILES := \
+        common/EventLoop.cpp \
+        tools/hwc_loop_bench/hwc_loop_bench.cpp \
+
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/common $(LOCAL_PATH)/tools/common
+LOCAL_STATIC_LIBRARIES := liblog
+LOCAL_MODULE := hwc_loop_bench
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_HOST_EXECUTABLE)
+
 endif
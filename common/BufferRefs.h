@@ -0,0 +1,116 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+
+#ifndef __BUFFER_REFS_H__
+#define __BUFFER_REFS_H__
+
+#include <stddef.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "RemoteDisplay.h"
+
+// Buffers a layer or client target holds references to on its remotes, the
+// most recently set last. Past the limit the least recent one is dropped,
+// remote keeps it idle for a while in case it comes back.
+class BufferRefs {
+ public:
+  explicit BufferRefs(size_t limit) : mLimit(limit) {}
+  ~BufferRefs() {
+    for (auto& refs : mRemotes) {
+      _release(refs);
+    }
+  }
+  BufferRefs(const BufferRefs&) = delete;
+  BufferRefs& operator=(const BufferRefs&) = delete;
+
+  // holds references on remote too, starting with current. Buffers set
+  // before may be freed already, remote never sees them.
+  void addRemote(RemoteDisplay* remote, buffer_handle_t current) {
+    if (!remote || _find(remote) != mRemotes.end())
+      return;
+
+    mRemotes.emplace_back();
+    mRemotes.back().remote = remote;
+    _use(mRemotes.back(), current);
+  }
+
+  // references on remote are dropped with release, otherwise forgotten as
+  // remote is going away
+  void removeRemote(RemoteDisplay* remote, bool release = false) {
+    auto it = _find(remote);
+    if (it == mRemotes.end())
+      return;
+    if (release) {
+      _release(*it);
+    }
+    mRemotes.erase(it);
+  }
+
+  void use(buffer_handle_t buffer) {
+    for (auto& refs : mRemotes) {
+      _use(refs, buffer);
+    }
+  }
+
+ private:
+  struct Refs {
+    RemoteDisplay* remote = nullptr;
+    std::vector<buffer_handle_t> buffers;
+  };
+
+  std::vector<Refs>::iterator _find(RemoteDisplay* remote) {
+    return std::find_if(mRemotes.begin(), mRemotes.end(),
+                        [remote](const Refs& r) { return r.remote == remote; });
+  }
+
+  void _use(Refs& refs, buffer_handle_t buffer) {
+    if (!buffer)
+      return;
+
+    auto& buffers = refs.buffers;
+    auto it = std::find(buffers.begin(), buffers.end(), buffer);
+    if (it != buffers.end()) {
+      buffers.erase(it);
+      buffers.push_back(buffer);
+      return;
+    }
+    buffers.push_back(buffer);
+    refs.remote->createBuffer(buffer);
+    if (buffers.size() > mLimit) {
+      refs.remote->removeBuffer(buffers.front());
+      buffers.erase(buffers.begin());
+    }
+  }
+
+  void _release(Refs& refs) {
+    for (auto buffer : refs.buffers) {
+      refs.remote->removeBuffer(buffer);
+    }
+    refs.buffers.clear();
+  }
+
+ private:
+  size_t mLimit;
+  std::vector<Refs> mRemotes;
+};
+
+#endif  // __BUFFER_REFS_H__
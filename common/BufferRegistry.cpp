@@ -0,0 +1,246 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "BufferRegistry.h"
+
+static uint64_t makeId(uint32_t slot, uint32_t generation) {
+  return ((uint64_t)generation << 32) | slot;
+}
+
+BufferRegistry::~BufferRegistry() {
+  clear();
+}
+
+bool BufferRegistry::_identify(buffer_handle_t buffer,
+                               Identity* identity) const {
+  if (!buffer || buffer->numFds <= 0)
+    return false;
+
+  struct stat st;
+  if (fstat(buffer->data[0], &st) < 0)
+    return false;
+  *identity = Identity(st.st_dev, st.st_ino);
+  return true;
+}
+
+uint64_t BufferRegistry::_id(const Handle& handle) const {
+  return makeId(handle.slot, mSlots[handle.slot].generation);
+}
+
+uint64_t BufferRegistry::find(buffer_handle_t buffer) const {
+  auto it = mIndex.find(buffer);
+  if (it == mIndex.end())
+    return 0;
+  return _id(it->second);
+}
+
+uint32_t BufferRegistry::refs(buffer_handle_t buffer) const {
+  auto it = mIndex.find(buffer);
+  return it == mIndex.end() ? 0 : it->second.refs;
+}
+
+uint32_t BufferRegistry::_allocSlot() {
+  uint32_t slot;
+  if (!mFreeSlots.empty()) {
+    slot = mFreeSlots.back();
+    mFreeSlots.pop_back();
+  } else {
+    slot = mSlots.size();
+    mSlots.emplace_back();
+  }
+  return slot;
+}
+
+BufferRegistry::Index::iterator BufferRegistry::_add(buffer_handle_t buffer,
+                                                     bool* isNew,
+                                                     uint64_t* freedId) {
+  Identity identity;
+  bool identified = _identify(buffer, &identity);
+
+  if (isNew) {
+    *isNew = false;
+  }
+  if (freedId) {
+    *freedId = 0;
+  }
+
+  auto it = mIndex.find(buffer);
+  if (it != mIndex.end()) {
+    const Slot& known = mSlots[it->second.slot];
+    if (!identified || known.fd < 0 || known.identity == identity)
+      return it;
+
+    // the handle was freed without remove and its address reused
+    _erase(it, freedId);
+  }
+
+  uint32_t slot;
+  auto alias = identified ? mIdentities.find(identity) : mIdentities.end();
+  if (alias != mIdentities.end()) {
+    slot = alias->second;
+  } else {
+    slot = _allocSlot();
+    mSlots[slot].buffer = buffer;
+    if (identified) {
+      mSlots[slot].fd = fcntl(buffer->data[0], F_DUPFD_CLOEXEC, 0);
+      mSlots[slot].identity = identity;
+      if (mSlots[slot].fd >= 0) {
+        mIdentities[identity] = slot;
+      }
+    }
+    if (isNew) {
+      *isNew = true;
+    }
+  }
+  mSlots[slot].handles++;
+
+  Handle handle;
+  handle.slot = slot;
+  handle.idle = mIdle.insert(mIdle.end(), buffer);
+  return mIndex.emplace(buffer, handle).first;
+}
+
+uint64_t BufferRegistry::acquire(buffer_handle_t buffer,
+                                 bool* isNew,
+                                 uint64_t* freedId) {
+  auto it = _add(buffer, isNew, freedId);
+  Handle& handle = it->second;
+  if (handle.refs++ == 0) {
+    mIdle.erase(handle.idle);
+  }
+  return _id(handle);
+}
+
+void BufferRegistry::release(buffer_handle_t buffer, uint32_t seq) {
+  auto it = mIndex.find(buffer);
+  if (it == mIndex.end() || it->second.refs == 0)
+    return;
+
+  Handle& handle = it->second;
+  // a buffer stays on screen while referenced, not just in the frames
+  // sending it
+  if ((int32_t)(seq - handle.lastUse) > 0) {
+    handle.lastUse = seq;
+  }
+  if (--handle.refs == 0) {
+    handle.idle = mIdle.insert(mIdle.end(), buffer);
+  }
+}
+
+uint64_t BufferRegistry::use(buffer_handle_t buffer,
+                             uint32_t seq,
+                             bool* isNew,
+                             uint64_t* freedId) {
+  auto it = _add(buffer, isNew, freedId);
+  Handle& handle = it->second;
+  handle.lastUse = seq;
+  if (handle.refs == 0) {
+    mIdle.splice(mIdle.end(), mIdle, handle.idle);
+  }
+  return _id(handle);
+}
+
+bool BufferRegistry::evictIdle(size_t keep,
+                               uint32_t before,
+                               uint64_t* freedId) {
+  *freedId = 0;
+  if (mIdle.size() <= keep)
+    return false;
+
+  auto it = mIndex.find(mIdle.front());
+  // a frame remote shows or hasn't acked yet may show it
+  if ((int32_t)(it->second.lastUse - before) >= 0)
+    return false;
+
+  _erase(it, freedId);
+  return true;
+}
+
+void BufferRegistry::setCreateSeq(uint64_t id, uint32_t seq) {
+  uint32_t slot = slotOf(id);
+  if (slot < mSlots.size() && mSlots[slot].generation == generationOf(id)) {
+    mSlots[slot].createSeq = seq;
+  }
+}
+
+uint32_t BufferRegistry::createSeq(uint64_t id) const {
+  uint32_t slot = slotOf(id);
+  if (slot >= mSlots.size() || mSlots[slot].generation != generationOf(id))
+    return 0;
+  return mSlots[slot].createSeq;
+}
+
+void BufferRegistry::_erase(Index::iterator it, uint64_t* freedId) {
+  uint32_t slot = it->second.slot;
+  if (it->second.refs == 0) {
+    mIdle.erase(it->second.idle);
+  }
+  mIndex.erase(it);
+  _releaseHandle(slot, freedId);
+}
+
+void BufferRegistry::_releaseHandle(uint32_t slot, uint64_t* freedId) {
+  Slot& s = mSlots[slot];
+  if (--s.handles > 0)
+    return;
+
+  if (freedId) {
+    *freedId = makeId(slot, s.generation);
+  }
+  if (s.fd >= 0) {
+    mIdentities.erase(s.identity);
+    close(s.fd);
+    s.fd = -1;
+  }
+  // a new buffer in this slot must not be taken for the old one
+  s.buffer = nullptr;
+  s.createSeq = 0;
+  if (++s.generation == 0) {
+    s.generation = 1;
+  }
+  mFreeSlots.push_back(slot);
+}
+
+uint64_t BufferRegistry::remove(buffer_handle_t buffer) {
+  auto it = mIndex.find(buffer);
+  if (it == mIndex.end())
+    return 0;
+
+  uint64_t freedId = 0;
+  _erase(it, &freedId);
+  return freedId;
+}
+
+void BufferRegistry::clear() {
+  for (auto& slot : mSlots) {
+    if (slot.fd >= 0) {
+      close(slot.fd);
+    }
+  }
+  mSlots.clear();
+  mFreeSlots.clear();
+  mIndex.clear();
+  mIdentities.clear();
+  mIdle.clear();
+}
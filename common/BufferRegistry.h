@@ -0,0 +1,121 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+
+#ifndef __BUFFER_REGISTRY_H__
+#define __BUFFER_REGISTRY_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <list>
+#include <map>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <cutils/native_handle.h>
+
+// Buffer ids told to one remote: a dense slot index in the low 32 bits and
+// the slot generation in the high 32 bits, never 0.
+// A slot stands for one dma-buf, every handle gralloc imports for it gets
+// the same id so the remote imports it only once.
+// Layers and client targets hold references to their handles. A handle
+// nobody refers to stays on remote as idle until it is evicted, least
+// recently used first, so a buffer coming back soon isn't imported again.
+class BufferRegistry {
+ public:
+  ~BufferRegistry();
+
+  static uint32_t slotOf(uint64_t id) { return (uint32_t)id; }
+  static uint32_t generationOf(uint64_t id) { return (uint32_t)(id >> 32); }
+
+  // id of buffer, 0 if it isn't registered
+  uint64_t find(buffer_handle_t buffer) const;
+  // takes a reference to buffer and returns its id, registering it when
+  // unknown. isNew tells the slot is new to remote rather than an alias of
+  // a buffer it has already. freedId is set when a stale buffer at the same
+  // handle address lost its slot.
+  uint64_t acquire(buffer_handle_t buffer,
+                   bool* isNew = nullptr,
+                   uint64_t* freedId = nullptr);
+  // drops a reference, buffer turns idle with the last one. Frames up to
+  // seq may still show it.
+  void release(buffer_handle_t buffer, uint32_t seq);
+  // marks buffer used by frame seq and returns its id, an unknown buffer is
+  // registered idle
+  uint64_t use(buffer_handle_t buffer,
+               uint32_t seq,
+               bool* isNew = nullptr,
+               uint64_t* freedId = nullptr);
+  // forgets the least recently used idle buffer if more than keep are idle
+  // and the last frame which may show it is before seq. Returns false when
+  // nothing is evicted, freedId is 0 when other handles still use its slot.
+  bool evictIdle(size_t keep, uint32_t before, uint64_t* freedId);
+  // control message seq that created the buffer id on remote, 0 if unknown
+  void setCreateSeq(uint64_t id, uint32_t seq);
+  uint32_t createSeq(uint64_t id) const;
+  // drops buffer whatever its references, returns the id when its slot was
+  // freed and remote has to forget it, 0 otherwise
+  uint64_t remove(buffer_handle_t buffer);
+  void clear();
+  size_t size() const { return mIndex.size(); }
+  size_t idle() const { return mIdle.size(); }
+  uint32_t refs(buffer_handle_t buffer) const;
+
+ private:
+  // st_dev/st_ino of the first fd, the dma-buf for gralloc handles
+  typedef std::pair<uint64_t, uint64_t> Identity;
+
+  struct Slot {
+    buffer_handle_t buffer = nullptr;
+    uint32_t generation = 1;
+    uint32_t handles = 0;
+    uint32_t createSeq = 0;
+    // keeps the dma-buf and so its inode number from being reused while
+    // the slot refers to it
+    int fd = -1;
+    Identity identity;
+  };
+
+  struct Handle {
+    uint32_t slot = 0;
+    uint32_t refs = 0;
+    uint32_t lastUse = 0;
+    // position in mIdle while refs is 0
+    std::list<buffer_handle_t>::iterator idle;
+  };
+  typedef std::unordered_map<buffer_handle_t, Handle> Index;
+
+  bool _identify(buffer_handle_t buffer, Identity* identity) const;
+  uint32_t _allocSlot();
+  Index::iterator _add(buffer_handle_t buffer, bool* isNew, uint64_t* freedId);
+  void _erase(Index::iterator it, uint64_t* freedId);
+  void _releaseHandle(uint32_t slot, uint64_t* freedId);
+  uint64_t _id(const Handle& handle) const;
+
+ private:
+  std::vector<Slot> mSlots;
+  std::vector<uint32_t> mFreeSlots;
+  Index mIndex;
+  std::map<Identity, uint32_t> mIdentities;
+  // unreferenced handles, least recently used first
+  std::list<buffer_handle_t> mIdle;
+};
+
+#endif  // __BUFFER_REGISTRY_H__
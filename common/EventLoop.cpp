@@ -0,0 +1,408 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+
+#include <errno.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+#include <cutils/log.h>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "EventLoop.h"
+
+class EpollEventLoop : public EventLoop {
+ public:
+  ~EpollEventLoop() {
+    if (mFd >= 0) {
+      close(mFd);
+    }
+  }
+
+  int init() {
+    mFd = epoll_create1(EPOLL_CLOEXEC);
+    if (mFd < 0) {
+      ALOGE("epoll_create:%s", strerror(errno));
+      return -1;
+    }
+    return 0;
+  }
+
+  const char* name() const override { return "epoll"; }
+  int add(int fd, uint32_t events) override {
+    return _ctl(EPOLL_CTL_ADD, fd, events);
+  }
+  int mod(int fd, uint32_t events) override {
+    return _ctl(EPOLL_CTL_MOD, fd, events);
+  }
+  int del(int fd) override { return _ctl(EPOLL_CTL_DEL, fd, 0); }
+
+  int wait(Event* events, int maxEvents, int timeoutMs) override {
+    mEvents.resize(maxEvents);
+    int n = epoll_wait(mFd, mEvents.data(), maxEvents, timeoutMs);
+    for (int i = 0; i < n; i++) {
+      events[i].fd = mEvents[i].data.fd;
+      events[i].events = mEvents[i].events;
+    }
+    return n;
+  }
+
+ private:
+  int _ctl(int op, int fd, uint32_t events) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(mFd, op, fd, &ev) < 0) {
+      ALOGE("epoll_ctl %d fd %d:%s", op, fd, strerror(errno));
+      return -1;
+    }
+    return 0;
+  }
+
+ private:
+  int mFd = -1;
+  std::vector<struct epoll_event> mEvents;
+};
+
+#if defined(__NR_io_uring_setup) && defined(IORING_POLL_ADD_MULTI) && \
+    defined(IORING_FEAT_RSRC_TAGS)
+#define HAVE_IO_URING 1
+
+static int uringEnter(int fd,
+                      unsigned toSubmit,
+                      unsigned minComplete,
+                      unsigned flags,
+                      const void* arg,
+                      size_t argSize) {
+  return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, arg,
+                 argSize);
+}
+
+class UringEventLoop : public EventLoop {
+ public:
+  ~UringEventLoop() {
+    if (mSqes) {
+      munmap(mSqes, mSqesSize);
+    }
+    if (mCqMap && mCqMap != mSqMap) {
+      munmap(mCqMap, mCqMapSize);
+    }
+    if (mSqMap) {
+      munmap(mSqMap, mSqMapSize);
+    }
+    if (mFd >= 0) {
+      close(mFd);
+    }
+  }
+
+  int init() {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    mFd = syscall(__NR_io_uring_setup, kEntries, &params);
+    if (mFd < 0) {
+      ALOGW("io_uring_setup:%s", strerror(errno));
+      return -1;
+    }
+    // multishot poll came with the same kernel (5.13) as resource tags
+    if (!(params.features & IORING_FEAT_RSRC_TAGS) ||
+        !(params.features & IORING_FEAT_EXT_ARG)) {
+      ALOGW("io_uring lacks multishot poll");
+      return -1;
+    }
+
+    mSqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    mCqMapSize =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) {
+      mSqMapSize = mCqMapSize = std::max(mSqMapSize, mCqMapSize);
+    }
+    mSqMap = _map(mSqMapSize, IORING_OFF_SQ_RING);
+    mCqMap = single ? mSqMap : _map(mCqMapSize, IORING_OFF_CQ_RING);
+    mSqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    mSqes = (struct io_uring_sqe*)_map(mSqesSize, IORING_OFF_SQES);
+    if (!mSqMap || !mCqMap || !mSqes) {
+      return -1;
+    }
+
+    uint8_t* sq = (uint8_t*)mSqMap;
+    mSqHead = (unsigned*)(sq + params.sq_off.head);
+    mSqTail = (unsigned*)(sq + params.sq_off.tail);
+    mSqMask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    mSqArray = (unsigned*)(sq + params.sq_off.array);
+    mSqEntries = params.sq_entries;
+    mSqTailLocal = *mSqTail;
+
+    uint8_t* cq = (uint8_t*)mCqMap;
+    mCqHead = (unsigned*)(cq + params.cq_off.head);
+    mCqTail = (unsigned*)(cq + params.cq_off.tail);
+    mCqMask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    mCqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return 0;
+  }
+
+  const char* name() const override { return "io_uring"; }
+
+  int add(int fd, uint32_t events) override {
+    std::unique_lock<std::mutex> lk(mMutex);
+    if (mWatches.count(fd)) {
+      ALOGE("io_uring fd %d already added", fd);
+      return -1;
+    }
+    Watch& watch = mWatches[fd];
+    watch.gen = ++mGen;
+    watch.events = events;
+    if (_armLocked(fd, watch) < 0) {
+      mWatches.erase(fd);
+      return -1;
+    }
+    return 0;
+  }
+
+  int mod(int fd, uint32_t events) override {
+    std::unique_lock<std::mutex> lk(mMutex);
+    auto it = mWatches.find(fd);
+    if (it == mWatches.end()) {
+      ALOGE("io_uring mod unknown fd %d", fd);
+      return -1;
+    }
+    it->second.events = events;
+    struct io_uring_sqe* sqe = _getSqeLocked();
+    if (!sqe)
+      return -1;
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = _userData(fd, it->second);
+    sqe->poll32_events = events;
+    sqe->len = IORING_POLL_UPDATE_EVENTS | IORING_POLL_ADD_MULTI;
+    sqe->user_data = kControlData;
+    _pushLocked();
+    return 0;
+  }
+
+  int del(int fd) override {
+    std::unique_lock<std::mutex> lk(mMutex);
+    auto it = mWatches.find(fd);
+    if (it == mWatches.end()) {
+      ALOGE("io_uring del unknown fd %d", fd);
+      return -1;
+    }
+    uint64_t data = _userData(fd, it->second);
+    mWatches.erase(it);
+    struct io_uring_sqe* sqe = _getSqeLocked();
+    if (!sqe)
+      return -1;
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = data;
+    sqe->user_data = kControlData;
+    _pushLocked();
+    return 0;
+  }
+
+  int wait(Event* events, int maxEvents, int timeoutMs) override {
+    unsigned pending;
+    {
+      std::unique_lock<std::mutex> lk(mMutex);
+      mLoopThread = std::this_thread::get_id();
+      pending = _unsubmittedLocked();
+    }
+
+    // completions left from the last call need no syscall, unless changes
+    // are queued, those go out without waiting
+    bool ready = *mCqHead != __atomic_load_n(mCqTail, __ATOMIC_ACQUIRE);
+    if (!ready || pending) {
+      unsigned minComplete = (ready || timeoutMs == 0) ? 0 : 1;
+      unsigned flags = IORING_ENTER_GETEVENTS;
+      struct __kernel_timespec ts;
+      struct io_uring_getevents_arg arg;
+      const void* argp = nullptr;
+      size_t argSize = 0;
+      if (minComplete && timeoutMs > 0) {
+        ts.tv_sec = timeoutMs / 1000;
+        ts.tv_nsec = (timeoutMs % 1000) * 1000000LL;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        flags |= IORING_ENTER_EXT_ARG;
+        argp = &arg;
+        argSize = sizeof(arg);
+      }
+      // the kernel doesn't wait when it submits less than asked, which
+      // another thread may have done meanwhile, then nothing is returned
+      if (uringEnter(mFd, pending, minComplete, flags, argp, argSize) < 0 &&
+          errno != ETIME && errno != EBUSY) {
+        return -1;
+      }
+    }
+    return _reap(events, maxEvents);
+  }
+
+ private:
+  struct Watch {
+    uint32_t gen;
+    uint32_t events;
+  };
+  // changes queued by one wait, more are flushed early
+  static const unsigned kEntries = 256;
+  // completions of poll updates and removals
+  static const uint64_t kControlData = ~0ULL;
+
+  void* _map(size_t size, off_t offset) {
+    void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, mFd, offset);
+    if (addr == MAP_FAILED) {
+      ALOGE("io_uring mmap:%s", strerror(errno));
+      return nullptr;
+    }
+    return addr;
+  }
+
+  // the generation tells completions of a reused fd number apart
+  static uint64_t _userData(int fd, const Watch& watch) {
+    return ((uint64_t)watch.gen << 32) | (uint32_t)fd;
+  }
+
+  unsigned _unsubmittedLocked() const {
+    return mSqTailLocal - __atomic_load_n(mSqHead, __ATOMIC_ACQUIRE);
+  }
+
+  struct io_uring_sqe* _getSqeLocked() {
+    if (_unsubmittedLocked() >= mSqEntries) {
+      uringEnter(mFd, _unsubmittedLocked(), 0, 0, nullptr, 0);
+      if (_unsubmittedLocked() >= mSqEntries) {
+        ALOGE("io_uring submission queue full");
+        return nullptr;
+      }
+    }
+    unsigned index = mSqTailLocal & mSqMask;
+    struct io_uring_sqe* sqe = &mSqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    mSqArray[index] = index;
+    return sqe;
+  }
+
+  // the loop thread submits with its next wait, others right away as the
+  // loop thread may be blocked already
+  void _pushLocked() {
+    __atomic_store_n(mSqTail, ++mSqTailLocal, __ATOMIC_RELEASE);
+    if (std::this_thread::get_id() != mLoopThread) {
+      uringEnter(mFd, _unsubmittedLocked(), 0, 0, nullptr, 0);
+    }
+  }
+
+  int _armLocked(int fd, const Watch& watch) {
+    struct io_uring_sqe* sqe = _getSqeLocked();
+    if (!sqe)
+      return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = watch.events;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = _userData(fd, watch);
+    _pushLocked();
+    return 0;
+  }
+
+  int _reap(Event* events, int maxEvents) {
+    std::unique_lock<std::mutex> lk(mMutex);
+    unsigned head = *mCqHead;
+    unsigned tail = __atomic_load_n(mCqTail, __ATOMIC_ACQUIRE);
+    int n = 0;
+    for (; head != tail && n < maxEvents; head++) {
+      const struct io_uring_cqe& cqe = mCqes[head & mCqMask];
+      if (cqe.user_data == kControlData) {
+        // a poll which ended meanwhile is armed again below
+        if (cqe.res < 0 && cqe.res != -ENOENT && cqe.res != -EALREADY) {
+          ALOGE("io_uring poll update:%s", strerror(-cqe.res));
+        }
+        continue;
+      }
+      int fd = (int)(uint32_t)cqe.user_data;
+      auto it = mWatches.find(fd);
+      if (it == mWatches.end() || it->second.gen != cqe.user_data >> 32)
+        continue;
+      if (cqe.res < 0) {
+        ALOGE("io_uring poll fd %d:%s", fd, strerror(-cqe.res));
+        events[n].fd = fd;
+        events[n++].events = EPOLLERR;
+        continue;
+      }
+      if (!(cqe.flags & IORING_CQE_F_MORE)) {
+        // the kernel may end a multishot poll, e.g. on completion overflow
+        _armLocked(fd, it->second);
+      }
+      events[n].fd = fd;
+      events[n++].events = cqe.res;
+    }
+    __atomic_store_n(mCqHead, head, __ATOMIC_RELEASE);
+    return n;
+  }
+
+ private:
+  int mFd = -1;
+  void* mSqMap = nullptr;
+  void* mCqMap = nullptr;
+  size_t mSqMapSize = 0;
+  size_t mCqMapSize = 0;
+  struct io_uring_sqe* mSqes = nullptr;
+  size_t mSqesSize = 0;
+
+  unsigned* mSqHead = nullptr;
+  unsigned* mSqTail = nullptr;
+  unsigned* mSqArray = nullptr;
+  unsigned mSqMask = 0;
+  unsigned mSqEntries = 0;
+  unsigned mSqTailLocal = 0;
+  unsigned* mCqHead = nullptr;
+  unsigned* mCqTail = nullptr;
+  unsigned mCqMask = 0;
+  struct io_uring_cqe* mCqes = nullptr;
+
+  std::mutex mMutex;
+  std::map<int, Watch> mWatches;
+  uint32_t mGen = 0;
+  std::thread::id mLoopThread;
+};
+#endif
+
+std::unique_ptr<EventLoop> EventLoop::create(const char* backend) {
+  if (backend && !strcmp(backend, "io_uring")) {
+#ifdef HAVE_IO_URING
+    std::unique_ptr<UringEventLoop> loop(new UringEventLoop());
+    if (loop->init() == 0)
+      return std::unique_ptr<EventLoop>(loop.release());
+#endif
+    ALOGW("io_uring unavailable, falling back to epoll");
+  }
+  std::unique_ptr<EpollEventLoop> loop(new EpollEventLoop());
+  if (loop->init() < 0)
+    return nullptr;
+  return std::unique_ptr<EventLoop>(loop.release());
+}
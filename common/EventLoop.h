@@ -0,0 +1,52 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+
+#ifndef __EVENT_LOOP_H__
+#define __EVENT_LOOP_H__
+
+#include <stdint.h>
+#include <memory>
+
+// Readiness of the fds served by the socket thread, events are EPOLL* bits.
+// The epoll backend costs one epoll_ctl per change. The io_uring backend
+// keeps a multishot poll on every fd and submits all changes made on the
+// loop thread together with the next wait, in one io_uring_enter. Changes
+// from other threads are submitted right away.
+class EventLoop {
+ public:
+  struct Event {
+    int fd;
+    uint32_t events;
+  };
+
+  // "epoll" or "io_uring", falls back to epoll if io_uring is unavailable
+  static std::unique_ptr<EventLoop> create(const char* backend);
+
+  virtual ~EventLoop() {}
+
+  virtual const char* name() const = 0;
+  virtual int add(int fd, uint32_t events) = 0;
+  virtual int mod(int fd, uint32_t events) = 0;
+  virtual int del(int fd) = 0;
+  // number of events, waits forever for a negative timeout
+  virtual int wait(Event* events, int maxEvents, int timeoutMs) = 0;
+};
+
+#endif  // __EVENT_LOOP_H__
@@ -34,18 +34,27 @@ struct IRemoteDevice {
   virtual int removeRemoteDisplay(RemoteDisplay* rd) = 0;
   virtual int getMaxRemoteDisplayCount() = 0;
   virtual int getRemoteDisplayCount() = 0;
+  virtual int refreshRemoteDisplay(RemoteDisplay* rd) = 0;
 };
 
 struct DisplayStatusListener {
   virtual ~DisplayStatusListener(){};
   virtual int onConnect(int fd) = 0;
   virtual int onDisconnect(int fd) = 0;
+  virtual int onSendPending(int fd, bool pending) = 0;
+  // channelFd, a shm ring or send queue eventfd or a frame channel socket
+  // of display fd, needs polling for input, onSendPending reports when it
+  // needs output
+  virtual int onChannelCreated(int fd, int channelFd) = 0;
 };
 
 struct DisplayEventListener {
   virtual ~DisplayEventListener(){};
   virtual int onBufferDisplayed(const buffer_info_t& info) = 0;
   virtual int onPresented(std::vector<layer_buffer_info_t>& layerBuffer, int& fence) = 0;
+  virtual int onBackpressure(bool congested) = 0;
+  // remote acked frame frameSeq and every frame committed before it
+  virtual int onFrameDone(uint32_t frameSeq) = 0;
 };
 
 #endif  //__IREMOTE_DEVICE_H__
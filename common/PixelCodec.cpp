@@ -0,0 +1,128 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+#include <string.h>
+
+#include "PixelCodec.h"
+
+uint32_t PixelCodec::encode(const uint8_t* pixels,
+                            uint32_t stride,
+                            const rect_t& rect,
+                            std::vector<uint8_t>& out) {
+  size_t width = rect.right - rect.left;
+  size_t height = rect.bottom - rect.top;
+  size_t n = width * height;
+
+  // gather the rows first, runs may continue on the next row
+  mScratch.resize(n);
+  for (size_t y = 0; y < height; y++) {
+    memcpy(&mScratch[y * width],
+           pixels + ((rect.top + y) * stride + rect.left) * 4, width * 4);
+  }
+  const uint32_t* px = mScratch.data();
+
+  size_t start = out.size();
+  out.reserve(start + n * 4);
+  size_t i = 0;
+  while (i < n) {
+    size_t run = 1;
+    while (i + run < n && run < 129 && px[i + run] == px[i]) {
+      run++;
+    }
+    if (run >= 2) {
+      out.push_back(126 + run);
+      const uint8_t* p = (const uint8_t*)&px[i];
+      out.insert(out.end(), p, p + 4);
+      i += run;
+      continue;
+    }
+
+    // literals until the next run of 2 or more
+    size_t count = 1;
+    while (i + count < n && count < 128 &&
+           !(i + count + 1 < n && px[i + count + 1] == px[i + count])) {
+      count++;
+    }
+    out.push_back(count - 1);
+    const uint8_t* p = (const uint8_t*)&px[i];
+    out.insert(out.end(), p, p + count * 4);
+    i += count;
+  }
+
+  if (out.size() - start <= n * 4)
+    return PIXEL_CODEC_RLE32;
+
+  out.resize(start);
+  const uint8_t* p = (const uint8_t*)px;
+  out.insert(out.end(), p, p + n * 4);
+  return PIXEL_CODEC_RAW;
+}
+
+int PixelCodec::decode(uint32_t codec,
+                       const uint8_t* data,
+                       size_t size,
+                       uint8_t* pixels,
+                       uint32_t stride,
+                       const rect_t& rect) {
+  size_t width = rect.right - rect.left;
+  size_t height = rect.bottom - rect.top;
+  size_t n = width * height;
+
+  mScratch.resize(n);
+  uint32_t* px = mScratch.data();
+  if (codec == PIXEL_CODEC_RAW) {
+    if (size != n * 4)
+      return -1;
+    memcpy(px, data, size);
+  } else if (codec == PIXEL_CODEC_RLE32) {
+    size_t i = 0;
+    const uint8_t* end = data + size;
+    while (data < end) {
+      uint8_t c = *data++;
+      if (c >= 128) {
+        size_t run = c - 126;
+        uint32_t v;
+        if (end - data < 4 || i + run > n)
+          return -1;
+        memcpy(&v, data, 4);
+        data += 4;
+        for (size_t k = 0; k < run; k++) {
+          px[i++] = v;
+        }
+      } else {
+        size_t count = c + 1;
+        if ((size_t)(end - data) < count * 4 || i + count > n)
+          return -1;
+        memcpy(&px[i], data, count * 4);
+        data += count * 4;
+        i += count;
+      }
+    }
+    if (i != n)
+      return -1;
+  } else {
+    return -1;
+  }
+
+  for (size_t y = 0; y < height; y++) {
+    memcpy(pixels + ((rect.top + y) * stride + rect.left) * 4,
+           &px[y * width], width * 4);
+  }
+  return 0;
+}
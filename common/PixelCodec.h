@@ -0,0 +1,54 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+#ifndef __PIXEL_CODEC_H__
+#define __PIXEL_CODEC_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "display_protocol.h"
+
+// Codecs of DD_EVENT_DISPLAY_PIXELS for 4 bytes pixels. PIXEL_CODEC_RLE32
+// is PackBits over the pixels of a rect taken row after row: a control byte
+// c < 128 is followed by c + 1 literal pixels, c >= 128 by one pixel
+// repeated c - 126 times. Shared with the host tools.
+class PixelCodec {
+ public:
+  // appends the pixels of rect to out, RLE32 unless raw is smaller, and
+  // returns the codec used. stride is in pixels.
+  uint32_t encode(const uint8_t* pixels,
+                  uint32_t stride,
+                  const rect_t& rect,
+                  std::vector<uint8_t>& out);
+  // writes size bytes of codec data into rect of pixels, -1 if malformed
+  int decode(uint32_t codec,
+             const uint8_t* data,
+             size_t size,
+             uint8_t* pixels,
+             uint32_t stride,
+             const rect_t& rect);
+
+ private:
+  // pixels of the rect being coded
+  std::vector<uint32_t> mScratch;
+};
+
+#endif  // __PIXEL_CODEC_H__
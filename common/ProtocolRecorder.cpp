@@ -0,0 +1,123 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <cutils/log.h>
+
+#include "ProtocolRecorder.h"
+
+static int64_t nowNs(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+ProtocolRecorder::~ProtocolRecorder() {
+  if (mFile) {
+    fclose(mFile);
+    mFile = nullptr;
+  }
+}
+
+int ProtocolRecorder::open(const char* path) {
+  std::unique_lock<std::mutex> lk(mMutex);
+
+  if (mFile)
+    return 0;
+
+  mFile = fopen(path, "wbe");
+  if (!mFile) {
+    ALOGE("Failed to open capture %s: %s", path, strerror(errno));
+    return -1;
+  }
+
+  capture_header_t header;
+  memset(&header, 0, sizeof(header));
+  header.magic = CAPTURE_MAGIC;
+  header.version = CAPTURE_VERSION;
+  header.startTime = nowNs(CLOCK_REALTIME);
+  if (fwrite(&header, sizeof(header), 1, mFile) != 1) {
+    ALOGE("Failed to write capture %s", path);
+    fclose(mFile);
+    mFile = nullptr;
+    return -1;
+  }
+  mStartTime = nowNs(CLOCK_MONOTONIC);
+  ALOGI("Recording remote display protocol to %s", path);
+  return 0;
+}
+
+void ProtocolRecorder::record(uint32_t direction,
+                              uint32_t channel,
+                              const struct iovec* iov,
+                              size_t iovcnt,
+                              const int* fds,
+                              size_t numFds) {
+  capture_record_t rec;
+  memset(&rec, 0, sizeof(rec));
+  rec.direction = direction;
+  rec.channel = channel;
+  rec.numFds = fds ? numFds : 0;
+  for (size_t i = 0; i < iovcnt; i++) {
+    rec.size += iov[i].iov_len;
+  }
+
+  std::unique_lock<std::mutex> lk(mMutex);
+  if (!mFile)
+    return;
+
+  // the timestamp is taken in order with the writes, records stay sorted
+  rec.timestamp = nowNs(CLOCK_MONOTONIC) - mStartTime;
+  bool ok = fwrite(&rec, sizeof(rec), 1, mFile) == 1;
+  for (size_t i = 0; ok && i < rec.numFds; i++) {
+    capture_fd_t info;
+    memset(&info, 0, sizeof(info));
+    struct stat st;
+    if (fstat(fds[i], &st) == 0) {
+      info.mode = st.st_mode & S_IFMT;
+      info.ino = st.st_ino;
+      info.size = st.st_size;
+    }
+    if (!info.size) {
+      // dma-bufs report their size by seeking to the end
+      off_t end = lseek(fds[i], 0, SEEK_END);
+      if (end > 0) {
+        info.size = end;
+        lseek(fds[i], 0, SEEK_SET);
+      }
+    }
+    ok = fwrite(&info, sizeof(info), 1, mFile) == 1;
+  }
+  for (size_t i = 0; ok && i < iovcnt; i++) {
+    if (iov[i].iov_len) {
+      ok = fwrite(iov[i].iov_base, iov[i].iov_len, 1, mFile) == 1;
+    }
+  }
+
+  if (!ok) {
+    // a truncated record ends the capture, readers stop there
+    ALOGE("Failed to write capture record, recording stopped");
+    fclose(mFile);
+    mFile = nullptr;
+  }
+}
@@ -0,0 +1,52 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+#ifndef __PROTOCOL_RECORDER_H__
+#define __PROTOCOL_RECORDER_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/uio.h>
+#include <mutex>
+
+#include "protocol_capture.h"
+
+// Writes the messages of a remote display connection to a capture file,
+// see protocol_capture.h. Safe to call from the send and receive threads.
+class ProtocolRecorder {
+ public:
+  ProtocolRecorder() {}
+  ~ProtocolRecorder();
+
+  int open(const char* path);
+  bool recording() const { return mFile != nullptr; }
+  void record(uint32_t direction,
+              uint32_t channel,
+              const struct iovec* iov,
+              size_t iovcnt,
+              const int* fds,
+              size_t numFds);
+
+ private:
+  std::mutex mMutex;
+  FILE* mFile = nullptr;
+  int64_t mStartTime = 0;
+};
+
+#endif  // __PROTOCOL_RECORDER_H__
@@ -26,16 +26,27 @@ Date: 2021.06.09
 
 //#define LOG_NDEBUG 0
 
+#include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <cutils/properties.h>
 #include <cutils/log.h>
 #include <unistd.h>
 
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 
+#include <algorithm>
+#include <chrono>
+
+#include "BufferMapper.h"
 #include "RemoteDisplay.h"
 
 //#define DEBUG_LAYER
@@ -45,436 +56,2284 @@ Date: 2021.06.09
 #define LAYER_TRACE(...)
 #endif
 
-RemoteDisplay::RemoteDisplay(int fd) : mSocketFd(fd) {}
+RemoteDisplay::RemoteDisplay(int fd) : mSocketFd(fd) {
+  mControl.fd = fd;
+
+  struct sockaddr_storage addr;
+  socklen_t addrLen = sizeof(addr);
+  if (getsockname(fd, (struct sockaddr*)&addr, &addrLen) == 0 &&
+      (addr.ss_family == AF_INET || addr.ss_family == AF_INET6)) {
+    mPixelTransport = true;
+  }
+  int type = 0;
+  socklen_t typeLen = sizeof(type);
+  if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &typeLen) == 0 &&
+      type == SOCK_SEQPACKET) {
+    mPacketSocket = true;
+  }
+
+  char value[PROPERTY_VALUE_MAX];
+  if (property_get("hwc_vhal.send_high_water", value, nullptr)) {
+    mSendHighWater = strtoul(value, nullptr, 0);
+  }
+  if (property_get("hwc_vhal.shm_ring_size", value, nullptr)) {
+    mRingSize = strtoul(value, nullptr, 0);
+  }
+  if (property_get("hwc_vhal.max_frames_in_flight", value, nullptr)) {
+    mMaxFramesInFlight = strtoul(value, nullptr, 0);
+  }
+  if (property_get("hwc_vhal.request_timeout_ms", value, nullptr)) {
+    mRequestTimeoutMs = atoi(value);
+  }
+  if (property_get("hwc_vhal.idle_buffers", value, nullptr)) {
+    mIdleBuffers = strtoul(value, nullptr, 0);
+  }
+  if (property_get("hwc_vhal.send_queue", value, nullptr)) {
+    mSendQueueEnabled = atoi(value) != 0;
+  }
+  if (property_get("hwc_vhal.frame_channel", value, nullptr)) {
+    mFrameChannelEnabled = atoi(value) != 0;
+  }
+  if (property_get("hwc_vhal.latency_report", value, nullptr)) {
+    mLatencyReport = strtoul(value, nullptr, 0);
+  }
+  if (property_get("hwc_vhal.record_dir", value, nullptr) && value[0]) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/hwc-%d-%ld.cap", value, fd,
+             (long)time(nullptr));
+    mRecorder.open(path);
+  }
+  // lets a fleet turn a fast path off without updating remotes
+  if (property_get("hwc_vhal.disable_caps", value, nullptr)) {
+    mDisabledCaps = strtoull(value, nullptr, 0);
+  }
+}
 RemoteDisplay::~RemoteDisplay() {
+  if (mPixelWorker.joinable()) {
+    {
+      std::unique_lock<std::mutex> lk(mPixelMutex);
+      mPixelStop = true;
+    }
+    mPixelCond.notify_all();
+    mPixelWorker.join();
+  }
+  if (mPixelPending && mPixelFrame.fence >= 0) {
+    close(mPixelFrame.fence);
+  }
+  SendItem item;
+  while (mSendQueue && mSendQueue->pop(&item)) {
+    for (size_t i = 0; i < item.numFds; i++) {
+      close(item.fds[i]);
+    }
+  }
+  if (mSendEventFd >= 0) {
+    close(mSendEventFd);
+  }
+  for (auto ch : {&mControl, &mFrameChannel}) {
+    for (auto& pending : ch->queue) {
+      for (auto fd : pending.fds) {
+        close(fd);
+      }
+    }
+  }
+  if (mFrameChannel.fd >= 0) {
+    close(mFrameChannel.fd);
+  }
+  for (auto& recvFd : mRecvFds) {
+    close(recvFd.fd);
+  }
   if (mSocketFd >= 0) {
     ALOGD("Close socket %d", mSocketFd);
     close(mSocketFd);
   }
 }
 
-int RemoteDisplay::_send(const void* buf, size_t n) {
-  ALOGV("RemoteDisplay(%d)::%s size=%zd", mSocketFd, __func__, n);
-
-  if (mDisconnected)
-    return -1;
+void RemoteDisplay::_disconnect() {
+  // both the send and the receive path may find the connection broken
+  if (mDisconnected.exchange(true))
+    return;
 
-  if (!buf || n <= 0)
-    return 0;
+  {
+    // wake a composition waiting for a credit that never comes now
+    std::unique_lock<std::mutex> lk(mInflightMutex);
+    mCreditCond.notify_all();
+  }
+  _failRequests(-ENOTCONN);
 
-  ssize_t len;
-  len = send(mSocketFd, buf, n, 0);
-  if (len <= 0) {
-    mDisconnected = true;
-    if (mStatusListener) {
-      mStatusListener->onDisconnect(mSocketFd);
-    }
-    return -1;
+  if (mStatusListener) {
+    mStatusListener->onDisconnect(mSocketFd);
   }
-  return 0;
 }
-int RemoteDisplay::_recv(void* buf, size_t n) {
-  ALOGV("RemoteDisplay(%d)::%s size=%zd", mSocketFd, __func__, n);
-
-  if (mDisconnected)
-    return -1;
-
-  if (!buf || n <= 0)
-    return 0;
 
-  ssize_t len;
-  len = recv(mSocketFd, buf, n, 0);
-  if (len <= 0) {
-    mDisconnected = true;
-    if (mStatusListener) {
-      mStatusListener->onDisconnect(mSocketFd);
-    }
-    return -1;
+void RemoteDisplay::_attachFds(struct msghdr* hdr,
+                               const int* fds,
+                               size_t numFds) {
+  size_t fdlen = numFds * sizeof(int);
+  if (mCmsgBuf.size() < CMSG_SPACE(fdlen)) {
+    mCmsgBuf.resize(CMSG_SPACE(fdlen));
   }
-  return 0;
+  memset(mCmsgBuf.data(), 0, CMSG_SPACE(fdlen));
+  hdr->msg_control = mCmsgBuf.data();
+  hdr->msg_controllen = CMSG_SPACE(fdlen);
+
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(hdr);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(fdlen);
+  memcpy(CMSG_DATA(cmsg), fds, fdlen);
 }
 
-int RemoteDisplay::_sendFds(int* pfd, size_t fdlen) {
-  ALOGV("RemoteDisplay(%d)::%s", mSocketFd, __func__);
+int RemoteDisplay::_sendMsg(const Message& msg, uint32_t* seq) {
+  std::unique_lock<std::mutex> lk(mSendMutex);
+  int ret = _sendMsgLocked(mControl, msg);
+  if (seq) {
+    *seq = mControl.seq;
+  }
+  return ret;
+}
 
+int RemoteDisplay::_sendMsgLocked(Channel& ch, const Message& msg) {
   if (mDisconnected)
     return -1;
 
-  int count = 0;
-  int i = 0;
-  struct msghdr msg;
-  struct cmsghdr* p_cmsg;
-  struct iovec vec;
-  char cmsgbuf[CMSG_SPACE(fdlen * sizeof(int))];
-  int* p_fds = NULL;
-  int sdata[4] = {
-      0x88,
-  };
+  size_t total = msg.size();
+  ALOGV("RemoteDisplay(%d)::%s size=%zd fds=%zd", mSocketFd, __func__, total,
+        msg.numFds);
+
+  if (total == 0)
+    return 0;
+  ch.seq++;
+  if (mRecorder.recording()) {
+    mRecorder.record(CAPTURE_DIR_SENT,
+                     &ch == &mFrameChannel ? CAPTURE_CHANNEL_FRAME
+                                           : CAPTURE_CHANNEL_CONTROL,
+                     msg.iov, msg.iovcnt, msg.fds, msg.numFds);
+  }
+  if (mSendQueue)
+    return _pushMsg(ch, msg);
 
-  msg.msg_control = cmsgbuf;
-  msg.msg_controllen = sizeof(cmsgbuf);
-  p_cmsg = CMSG_FIRSTHDR(&msg);
-  p_cmsg->cmsg_level = SOL_SOCKET;
-  p_cmsg->cmsg_type = SCM_RIGHTS;
-  p_cmsg->cmsg_len = CMSG_LEN(fdlen * sizeof(int));
-  p_fds = (int*)CMSG_DATA(p_cmsg);
+  std::unique_lock<std::mutex> lk(mFlushMutex);
+  return _writeMsg(ch, msg);
+}
 
-  for (i = 0; i < (int)fdlen; i++) {
-    p_fds[i] = pfd[i];
+int RemoteDisplay::_writeMsg(Channel& ch, const Message& msg) {
+  // keep ordering with requests still waiting for the socket
+  if (!ch.queue.empty()) {
+    return _queueMsg(ch, msg, 0);
   }
 
-  msg.msg_name = NULL;
-  msg.msg_namelen = 0;
-  msg.msg_iov = &vec;
-  msg.msg_iovlen = 1;
-  msg.msg_flags = 0;
+  struct msghdr hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.msg_iov = const_cast<struct iovec*>(msg.iov);
+  hdr.msg_iovlen = msg.iovcnt;
+  if (msg.fds && msg.numFds > 0) {
+    _attachFds(&hdr, msg.fds, msg.numFds);
+  }
 
-  vec.iov_base = sdata;
-  vec.iov_len = 16;
-  count = sendmsg(mSocketFd, &msg, 0);
-  if (count <= 0) {
-    mDisconnected = true;
-    if (mStatusListener) {
-      mStatusListener->onDisconnect(mSocketFd);
+  ssize_t len = sendmsg(ch.fd, &hdr, MSG_NOSIGNAL | MSG_DONTWAIT);
+  if (len < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      ALOGE("RemoteDisplay(%d) send failed: %s", mSocketFd, strerror(errno));
+      _disconnect();
+      _closeFds(msg);
+      return -1;
     }
-    return -1;
+    len = 0;
+  }
+  if ((size_t)len < msg.size()) {
+    return _queueMsg(ch, msg, len);
+  }
+  _closeFds(msg);
+  return 0;
+}
+
+void RemoteDisplay::_closeFds(const Message& msg) {
+  for (size_t i = 0; msg.ownedFds && i < msg.numFds; i++) {
+    close(msg.fds[i]);
   }
+}
 
+int RemoteDisplay::_copyMsg(const Message& msg,
+                            size_t sent,
+                            PendingMsg* pending) {
+  // fds travel with the first byte, they are gone once anything was sent
+  bool fdsSent = sent > 0;
+
+  for (size_t i = 0; i < msg.iovcnt; i++) {
+    const uint8_t* base = (const uint8_t*)msg.iov[i].iov_base;
+    size_t len = msg.iov[i].iov_len;
+    if (sent >= len) {
+      sent -= len;
+      continue;
+    }
+    pending->data.insert(pending->data.end(), base + sent, base + len);
+    sent = 0;
+  }
+  for (size_t i = 0; msg.fds && i < msg.numFds; i++) {
+    if (fdsSent) {
+      if (msg.ownedFds) {
+        close(msg.fds[i]);
+      }
+      continue;
+    }
+    int fd = _ownFd(msg, i);
+    if (fd < 0) {
+      for (auto f : pending->fds) {
+        close(f);
+      }
+      _disconnect();
+      return -1;
+    }
+    pending->fds.push_back(fd);
+  }
   return 0;
 }
 
-int RemoteDisplay::getConfigs() {
-  ALOGV("RemoteDisplay(%d)::%s", mSocketFd, __func__);
+int RemoteDisplay::_ownFd(const Message& msg, size_t i) {
+  if (msg.ownedFds)
+    return msg.fds[i];
 
-  char value[PROPERTY_VALUE_MAX];
-  property_get("sys.container.id", value, "0");
+  int fd = msg.frameFences ? _takeFence(msg.fds[i]) : -1;
+  if (fd < 0) {
+    fd = fcntl(msg.fds[i], F_DUPFD_CLOEXEC, 0);
+  }
+  if (fd < 0) {
+    ALOGE("RemoteDisplay(%d) failed to dup fd for send queue: %s", mSocketFd,
+          strerror(errno));
+  }
+  return fd;
+}
 
-  display_event_t req;
+int RemoteDisplay::_takeFence(int fence) {
+  for (auto& fd : mFrameFences) {
+    if (fd >= 0 && fd == fence) {
+      fd = -1;
+      return fence;
+    }
+  }
+  return -1;
+}
 
-  memset(&req, 0, sizeof(req));
-  req.type = DD_EVENT_DISPINFO_REQ;
-  req.size = sizeof(req);
-  req.id = atoi(value);
-  if (_send(&req, sizeof(req)) < 0) {
-    ALOGE("%s:%d: Can't send display info request\n", __func__, __LINE__);
+int RemoteDisplay::_queueMsg(Channel& ch, const Message& msg, size_t sent) {
+  PendingMsg pending;
+  if (_copyMsg(msg, sent, &pending) < 0)
     return -1;
+
+  ch.queueBytes += pending.data.size();
+  ch.queue.push_back(std::move(pending));
+  if (!ch.writeWait && mStatusListener) {
+    ch.writeWait = true;
+    mStatusListener->onSendPending(ch.fd, true);
   }
+  _updateBackpressure();
   return 0;
 }
 
-int RemoteDisplay::createBuffer(buffer_handle_t buffer) {
-  ALOGV("RemoteDisplay(%d)::%s", mSocketFd, __func__);
-
-  buffer_info_event_t ev;
-
-  memset(&ev, 0, sizeof(ev));
-  ev.event.type = DD_EVENT_CREATE_BUFFER;
-  ev.info.bufferId = (int64_t)buffer;
-  ev.event.size = sizeof(ev) + sizeof(native_handle_t) +
-                  (buffer->numFds + buffer->numInts) * 4;
+int RemoteDisplay::setupSendQueue() {
+  if (!mSendQueueEnabled || mSendQueue)
+    return 0;
 
-  if (_send(&(ev.event), sizeof(ev.event)) < 0) {
-    ALOGE("RemoteDisplay(%d) failed to send create buffer event", mSocketFd);
+  mSendEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (mSendEventFd < 0) {
+    ALOGE("RemoteDisplay(%d) failed to create send eventfd: %s", mSocketFd,
+          strerror(errno));
     return -1;
   }
-  if (_send(&(ev.info), sizeof(ev.info)) < 0) {
-    ALOGE("RemoteDisplay(%d) failed to send create buffer event info",
-          mSocketFd);
-    return -1;
+  mSendArena.resize(kSendArenaSize);
+  mSendQueue.reset(new SpscQueue<SendItem>(kSendQueueSize));
+  if (mStatusListener) {
+    mStatusListener->onChannelCreated(mSocketFd, mSendEventFd);
   }
-  if (_send(buffer, sizeof(native_handle_t) +
-                        (buffer->numFds + buffer->numInts) * 4) < 0) {
-    ALOGE("RemoteDisplay(%d) failed to send create buffer event", mSocketFd);
-    return -1;
+  return 0;
+}
+
+int RemoteDisplay::_pushMsg(Channel& ch, const Message& msg) {
+  // the bytes of a request stay in one piece, a too short end of the arena
+  // is skipped
+  size_t size = msg.size();
+  size_t offset = mSendArenaHead;
+  size_t room = kSendArenaSize - (offset & (kSendArenaSize - 1));
+  if (size > room) {
+    offset += room;
   }
-  if (buffer->numFds > 0) {
-    if (_sendFds((int*)(buffer->data), buffer->numFds) < 0) {
-      ALOGE("RemoteDisplay(%d) failed to send create buffer event", mSocketFd);
+  size_t used = offset + size - mSendArenaTail.load(std::memory_order_acquire);
+  if (used > kSendArenaSize || msg.numFds > kSendItemFds ||
+      mSendQueue->full()) {
+    // the socket thread is behind, or it's the caller and would never get
+    // to empty the queue. Holding mFlushMutex makes this thread the
+    // consumer, it writes the queue and the request out itself.
+    std::unique_lock<std::mutex> lk(mFlushMutex);
+    if (_drainSendQueue() < 0)
+      return -1;
+    return _writeMsg(ch, msg);
+  }
+
+  SendItem item;
+  item.ch = &ch;
+  item.offset = offset;
+  item.size = size;
+  uint8_t* dst = &mSendArena[offset & (kSendArenaSize - 1)];
+  for (size_t i = 0; i < msg.iovcnt; i++) {
+    memcpy(dst, msg.iov[i].iov_base, msg.iov[i].iov_len);
+    dst += msg.iov[i].iov_len;
+  }
+  for (size_t i = 0; msg.fds && i < msg.numFds; i++) {
+    int fd = _ownFd(msg, i);
+    if (fd < 0) {
+      for (size_t j = 0; j < item.numFds; j++) {
+        close(item.fds[j]);
+      }
+      _disconnect();
       return -1;
     }
+    item.fds[item.numFds++] = fd;
+  }
+  mSendArenaHead = offset + size;
+  mSendQueueBytes += size;
+  mSendQueue->push(std::move(item));
+  _updateBackpressure();
+
+  uint64_t count = 1;
+  if (write(mSendEventFd, &count, sizeof(count)) < 0) {
+    ALOGE("RemoteDisplay(%d) failed to signal send queue: %s", mSocketFd,
+          strerror(errno));
   }
   return 0;
 }
 
-int RemoteDisplay::removeBuffer(buffer_handle_t buffer) {
-  ALOGV("RemoteDisplay(%d)::%s", mSocketFd, __func__);
-
-  buffer_info_event_t ev;
+int RemoteDisplay::_onSendEvent() {
+  uint64_t count;
+  if (read(mSendEventFd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    ALOGE("RemoteDisplay(%d) failed to read send eventfd: %s", mSocketFd,
+          strerror(errno));
+  }
 
-  memset(&ev, 0, sizeof(ev));
-  ev.event.type = DD_EVENT_REMOVE_BUFFER;
-  ev.info.bufferId = (int64_t)buffer;
-  ev.event.size = sizeof(ev);
+  std::unique_lock<std::mutex> lk(mFlushMutex);
+  return _drainSendQueue();
+}
 
-  if (_send(&(ev.event), sizeof(ev.event)) < 0) {
-    ALOGE("RemoteDisplay(%d) failed to send remove buffer event", mSocketFd);
-    return -1;
+int RemoteDisplay::_drainSendQueue() {
+  SendItem item;
+  while (mSendQueue->pop(&item)) {
+    // sent from the arena, only what the socket doesn't take is copied to
+    // the channel queue
+    Message msg;
+    msg.add(&mSendArena[item.offset & (kSendArenaSize - 1)], item.size);
+    msg.fds = item.fds;
+    msg.numFds = item.numFds;
+    msg.ownedFds = true;
+    if (!mDisconnected) {
+      _writeMsg(*item.ch, msg);
+    } else {
+      _closeFds(msg);
+    }
+    mSendQueueBytes -= item.size;
+    mSendArenaTail.store(item.offset + item.size, std::memory_order_release);
   }
-  if (_send(&(ev.info), sizeof(ev.info)) < 0) {
-    ALOGE("RemoteDisplay(%d) failed to send remove buffer event info",
-          mSocketFd);
+  _updateBackpressure();
+  if (mDisconnected)
     return -1;
+
+  for (auto ch : {&mControl, &mFrameChannel}) {
+    if (!ch->queue.empty() && _flushQueue(*ch) < 0)
+      return -1;
   }
   return 0;
 }
 
-int RemoteDisplay::displayBuffer(buffer_handle_t buffer) {
-  ALOGV("RemoteDisplay(%d)::%s", mSocketFd, __func__);
+int RemoteDisplay::_flushQueue(Channel& ch) {
+  while (!ch.queue.empty()) {
+    PendingMsg& pending = ch.queue.front();
 
-  buffer_info_event_t ev;
+    struct iovec iov;
+    iov.iov_base = pending.data.data() + pending.offset;
+    iov.iov_len = pending.data.size() - pending.offset;
 
-  memset(&ev, 0, sizeof(ev));
-  ev.event.type = DD_EVENT_DISPLAY_REQ;
-  ev.event.size = sizeof(ev);
-  ev.info.bufferId = (int64_t)buffer;
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    if (!pending.fds.empty()) {
+      _attachFds(&hdr, pending.fds.data(), pending.fds.size());
+    }
 
-  if (_send(&ev, sizeof(ev)) < 0) {
-    ALOGE("RemoteDisplay(%d) failed to send display buffer request", mSocketFd);
-    return -1;
+    ssize_t len = sendmsg(ch.fd, &hdr, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (len < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        break;
+      ALOGE("RemoteDisplay(%d) send failed: %s", mSocketFd, strerror(errno));
+      _disconnect();
+      return -1;
+    }
+    if (len == 0)
+      break;
+
+    for (auto fd : pending.fds) {
+      close(fd);
+    }
+    pending.fds.clear();
+    pending.offset += len;
+    ch.queueBytes -= len;
+    if (pending.offset == pending.data.size()) {
+      ch.queue.pop_front();
+    }
+  }
+
+  bool writeWait = !ch.queue.empty();
+  if (writeWait != ch.writeWait && mStatusListener) {
+    ch.writeWait = writeWait;
+    mStatusListener->onSendPending(ch.fd, writeWait);
   }
+  _updateBackpressure();
   return 0;
 }
 
-int RemoteDisplay::setRotation(int rotation) {
+void RemoteDisplay::_updateBackpressure() {
+  std::unique_lock<std::mutex> lk(mBackpressureMutex);
+  // release below half of the high water mark to avoid flapping
+  size_t queued = mSendQueueBytes + mControl.queueBytes +
+                  mFrameChannel.queueBytes + mRingQueueBytes;
+  bool congested = mBackpressure ? queued > mSendHighWater / 2
+                                 : queued > mSendHighWater;
+  if (congested == mBackpressure)
+    return;
+
+  ALOGI("RemoteDisplay(%d) backpressure %s, %zd bytes queued", mSocketFd,
+        congested ? "on" : "off", queued);
+  mBackpressure = congested;
+  if (!congested && !mCreditStarved) {
+    mRefreshNeeded = true;
+  }
+  if (mEventListener) {
+    mEventListener->onBackpressure(congested);
+  }
+}
+
+int RemoteDisplay::onDisplayWritable() {
   ALOGV("RemoteDisplay(%d)::%s", mSocketFd, __func__);
 
-  rotation_event_t ev;
+  std::unique_lock<std::mutex> lk(mFlushMutex);
 
-  memset(&ev, 0, sizeof(ev));
-  ev.event.type = DD_EVENT_SET_ROTATION;
-  ev.event.size = sizeof(ev);
-  ev.rotation = rotation;
+  if (mDisconnected)
+    return -1;
 
-  if (_send(&ev, sizeof(ev)) < 0) {
-    ALOGE("RemoteDisplay(%d) failed to send display rotation request", mSocketFd);
+  return _flushQueue(mControl);
+}
+
+int RemoteDisplay::onChannelEvent(int fd, bool readable, bool writable) {
+  if (fd == mSendEventFd)
+    return _onSendEvent();
+  if (mRing && fd == mRing->rxEventFd())
+    return onRingEvent();
+  if (fd != mFrameChannel.fd || mDisconnected)
     return -1;
+
+  if (writable) {
+    std::unique_lock<std::mutex> lk(mFlushMutex);
+    if (_flushQueue(mFrameChannel) < 0)
+      return -1;
   }
+  if (readable)
+    return _recvPackets(mFrameChannel.fd, CAPTURE_CHANNEL_FRAME);
   return 0;
 }
 
-int RemoteDisplay::createLayer(uint64_t id) {
-  ALOGV("RemoteDisplay(%d)::%s", mSocketFd, __func__);
-
-  create_layer_event_t ev;
+int RemoteDisplay::_setupFrameChannel() {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0,
+                 sv) < 0) {
+    ALOGE("RemoteDisplay(%d) failed to create frame channel: %s", mSocketFd,
+          strerror(errno));
+    return -1;
+  }
 
+  display_event_t ev;
   memset(&ev, 0, sizeof(ev));
-  ev.event.type = DD_EVENT_CREATE_LAYER;
-  ev.event.size = sizeof(ev);
-  ev.layerId = id;
-
-  if (_send(&(ev), sizeof(ev)) < 0) {
-    ALOGE("RemoteDisplay(%d) failed to send create layer event", mSocketFd);
+  ev.type = DD_EVENT_SETUP_FRAME_CHANNEL;
+  ev.id = _nextRequestId();
+  ev.size = sizeof(ev);
+
+  Message msg;
+  msg.add(&ev, sizeof(ev));
+  msg.fds = &sv[1];
+  msg.numFds = 1;
+
+  std::unique_lock<std::mutex> lk(mSendMutex);
+  int ret = _sendMsgLocked(mControl, msg);
+  // the message holds a dup while it waits for the socket
+  close(sv[1]);
+  if (ret < 0) {
+    ALOGE("RemoteDisplay(%d) failed to send frame channel setup", mSocketFd);
+    close(sv[0]);
     return -1;
   }
-
+  mFrameChannel.fd = sv[0];
+  ALOGI("RemoteDisplay(%d) frame commits use frame channel %d", mSocketFd,
+        mFrameChannel.fd);
   return 0;
 }
 
-int RemoteDisplay::removeLayer(uint64_t id) {
-  ALOGV("RemoteDisplay(%d)::%s", mSocketFd, __func__);
+int RemoteDisplay::_sendFrameMsg(const Message& msg) {
+  if (mRing)
+    return _sendRingMsg(msg);
 
-  remove_layer_event_t ev;
+  std::unique_lock<std::mutex> lk(mSendMutex);
+  if (mFrameChannel.fd < 0)
+    return _sendMsgLocked(mControl, msg);
 
+  // remote holds the commit back until it has read the control message
+  // creating the last of the buffers it refers to, not the ones after
+  display_event_t ev;
+  memcpy(&ev, msg.iov[0].iov_base, sizeof(ev));
+  ev.pad = mFrameBarrier;
+  memcpy(msg.iov[0].iov_base, &ev, sizeof(ev));
+  return _sendMsgLocked(mFrameChannel, msg);
+}
+
+int RemoteDisplay::_setupRing() {
+  std::unique_ptr<ShmRing> ring(new ShmRing());
+  if (ring->create(mRingSize) < 0) {
+    ALOGE("RemoteDisplay(%d) failed to create shm ring", mSocketFd);
+    return -1;
+  }
+
+  ring_setup_event_t ev;
   memset(&ev, 0, sizeof(ev));
-  ev.event.type = DD_EVENT_REMOVE_LAYER;
+  ev.event.type = DD_EVENT_SETUP_RING;
+  ev.event.id = _nextRequestId();
   ev.event.size = sizeof(ev);
-  ev.layerId = id;
+  ev.size = ring->size();
 
-  if (_send(&(ev), sizeof(ev)) < 0) {
-    ALOGE("RemoteDisplay(%d) failed to send remove layer event", mSocketFd);
+  int fds[3] = {ring->memFd(), ring->txEventFd(), ring->rxEventFd()};
+  Message msg;
+  msg.add(&ev, sizeof(ev));
+  msg.fds = fds;
+  msg.numFds = 3;
+
+  std::unique_lock<std::mutex> lk(mSendMutex);
+  if (_sendMsgLocked(mControl, msg) < 0) {
+    ALOGE("RemoteDisplay(%d) failed to send ring setup", mSocketFd);
     return -1;
   }
-
+  mRing = std::move(ring);
+  ALOGI("RemoteDisplay(%d) frame commits use a %zd bytes shm ring", mSocketFd,
+        mRing->size());
   return 0;
 }
 
-int RemoteDisplay::updateLayers(std::vector<layer_info_t>& layerInfo) {
-  ALOGV("RemoteDisplay(%d)::%s", mSocketFd, __func__);
-
-  update_layers_event_t ev;
-  uint32_t numLayers = 0;
-  layer_info_t* layers = nullptr;
-
-  numLayers = layerInfo.size();
-  if (numLayers) {
-    layers = (layer_info_t*)malloc(sizeof(layer_info_t) * numLayers);
-    if (!layers) {
-      ALOGE("Failed to alloc layer info, out of memory");
-      return -1;
-    }
-    LAYER_TRACE("%s layer count %d", __func__, numLayers);
-    for (uint32_t i = 0; i < numLayers; i++) {
-      layers[i] = layerInfo[i];
-      LAYER_TRACE("  %d layer %" PRIx64 " stack %d task %d", i,
-                  layers[i].layerId, layers[i].stackId, layers[i].taskId);
-    }
-  }
+int RemoteDisplay::_sendRingMsg(const Message& msg) {
+  std::unique_lock<std::mutex> lk(mSendMutex);
 
-  ev.event.type = DD_EVENT_UPDATE_LAYERS;
-  ev.event.size = sizeof(ev) + sizeof(layer_info_t) * numLayers;
-  ev.numLayers = numLayers;
+  if (mDisconnected)
+    return -1;
 
-  if (_send(&(ev), sizeof(ev)) < 0) {
-    ALOGE("RemoteDisplay(%d) failed to send update layers event", mSocketFd);
-    if (layers) {
-      free(layers);
-    }
+  size_t total = msg.size();
+  if (total > mRing->maxMessageSize()) {
+    ALOGE("RemoteDisplay(%d) message of %zd bytes exceeds the shm ring",
+          mSocketFd, total);
     return -1;
   }
 
-  if (_send(layers, sizeof(layer_info_t) * numLayers) < 0) {
-    ALOGE("RemoteDisplay(%d) failed to send update layers info", mSocketFd);
-    if (layers) {
-      free(layers);
-    }
-    return -1;
+  // fds can't go through shared memory, they precede the record on the
+  // socket
+  uint32_t flags = 0;
+  uint32_t socketSeq = mFrameBarrier;
+  if (msg.fds && msg.numFds > 0) {
+    display_event_t ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = DD_EVENT_RING_FDS;
+    ev.id = _nextRequestId();
+    ev.size = sizeof(ev);
+
+    Message fdMsg;
+    fdMsg.add(&ev, sizeof(ev));
+    fdMsg.fds = msg.fds;
+    fdMsg.numFds = msg.numFds;
+    fdMsg.frameFences = msg.frameFences;
+    if (_sendMsgLocked(mControl, fdMsg) < 0)
+      return -1;
+    socketSeq = mControl.seq;
+    flags |= SHM_RING_RECORD_FDS;
+  }
+  if (mRecorder.recording()) {
+    mRecorder.record(CAPTURE_DIR_SENT, CAPTURE_CHANNEL_RING, msg.iov,
+                     msg.iovcnt, msg.fds, msg.numFds);
+  }
+
+  _flushRingQueue();
+  if (mRingQueue.empty() &&
+      mRing->write(msg.iov, msg.iovcnt, socketSeq, flags) == 0) {
+    return 0;
   }
 
-  if (layers) {
-    free(layers);
+  // ring is full, keep the record until remote makes room
+  RingMsg pending;
+  pending.socketSeq = socketSeq;
+  pending.flags = flags;
+  for (size_t i = 0; i < msg.iovcnt; i++) {
+    const uint8_t* base = (const uint8_t*)msg.iov[i].iov_base;
+    pending.data.insert(pending.data.end(), base, base + msg.iov[i].iov_len);
   }
+  mRingQueueBytes += pending.data.size();
+  mRingQueue.push_back(std::move(pending));
+  _updateBackpressure();
   return 0;
 }
 
-int RemoteDisplay::presentLayers(
-    std::vector<layer_buffer_info_t>& layerBuffer) {
-  ALOGV("RemoteDisplay(%d)::%s", mSocketFd, __func__);
+void RemoteDisplay::_flushRingQueue() {
+  while (!mRingQueue.empty()) {
+    RingMsg& pending = mRingQueue.front();
 
-  present_layers_req_event_t ev;
-  uint32_t numLayers = 0;
-  layer_buffer_info_t* layers = nullptr;
-
-  numLayers = layerBuffer.size();
-  if (numLayers) {
-    layers =
-        (layer_buffer_info_t*)malloc(sizeof(layer_buffer_info_t) * numLayers);
-    if (!layers) {
-      ALOGE("Failed to alloc present req layer buffer info, out of memory");
-      return -1;
-    }
-    for (uint32_t i = 0; i < numLayers; i++) {
-      layers[i] = layerBuffer[i];
-    }
+    struct iovec iov;
+    iov.iov_base = pending.data.data();
+    iov.iov_len = pending.data.size();
+    if (mRing->write(&iov, 1, pending.socketSeq, pending.flags) < 0)
+      break;
+
+    mRingQueueBytes -= pending.data.size();
+    mRingQueue.pop_front();
   }
+  _updateBackpressure();
+}
 
-  ev.event.type = DD_EVENT_PRESENT_LAYERS_REQ;
-  ev.event.size = sizeof(ev) + sizeof(layer_buffer_info_t) * numLayers;
-  ev.numLayers = numLayers;
+int RemoteDisplay::onRingEvent() {
+  ALOGV("RemoteDisplay(%d)::%s", mSocketFd, __func__);
 
-  if (_send(&(ev), sizeof(ev)) < 0) {
-    ALOGE("RemoteDisplay(%d) failed to send present layers req event",
-          mSocketFd);
-    if (layers) {
-      free(layers);
-    }
+  if (mDisconnected || !mRing)
     return -1;
+
+  mRing->clearEvent();
+  {
+    // the wakeup may be for room freed in our ring
+    std::unique_lock<std::mutex> lk(mSendMutex);
+    _flushRingQueue();
   }
 
-  if (_send(layers, sizeof(layer_buffer_info_t) * numLayers) < 0) {
-    ALOGE("RemoteDisplay(%d) failed to send present layers info", mSocketFd);
-    if (layers) {
-      free(layers);
+  shm_ring_record_t record;
+  ssize_t len;
+  while ((len = mRing->read(mRingRecvBuf, &record)) > 0) {
+    display_event_t ev;
+    if ((size_t)len < sizeof(ev)) {
+      len = -1;
+      break;
     }
-    return -1;
+    memcpy(&ev, mRingRecvBuf.data(), sizeof(ev));
+    if (ev.size != (size_t)len) {
+      len = -1;
+      break;
+    }
+    // messages with fds come by the socket, fence indexes are invalid here
+    _recordRecv(CAPTURE_CHANNEL_RING, mRingRecvBuf.data(), len);
+    _dispatch(ev, mRingRecvBuf.data() + sizeof(ev), len - sizeof(ev));
   }
-  // TODO: send layers' acqureFences
-  if (layers) {
-    free(layers);
+  if (len < 0) {
+    ALOGE("RemoteDisplay(%d) invalid shm ring record, stream lost",
+          mSocketFd);
+    _disconnect();
+    return -1;
   }
-
   return 0;
 }
 
-int RemoteDisplay::onDisplayInfoAck(const display_event_t& ev) {
+int RemoteDisplay::_send(const void* buf, size_t n) {
+  if (!buf || n <= 0)
+    return 0;
+
+  Message msg;
+  msg.add(buf, n);
+  return _sendMsg(msg);
+}
+
+int RemoteDisplay::_sendFds(int* pfd, size_t fdlen, uint32_t* seq) {
   ALOGV("RemoteDisplay(%d)::%s", mSocketFd, __func__);
 
-  display_info_t info;
-  int ret = _recv(&info, sizeof(info));
-  if (ret < 0) {
-    ALOGE("%s:%d: Can't send display info request\n", __func__, __LINE__);
-    return -1;
-  }
-  mWidth = info.width;
+  // legacy remotes expect the fds on a 16 bytes dummy payload
+  int sdata[4] = {
+      0x88,
+  };
+
+  Message msg;
+  msg.add(sdata, sizeof(sdata));
+  msg.fds = pfd;
+  msg.numFds = fdlen;
+  return _sendMsg(msg, seq);
+}
+
+int RemoteDisplay::getConfigs(RemoteRequestPtr* request) {
+  ALOGV("RemoteDisplay(%d)::%s", mSocketFd, __func__);
+
+  {
+    std::unique_lock<std::mutex> lk(mInflightMutex);
+    if (!mConfigRequest) {
+      mConfigRequest =
+          std::make_shared<RemoteRequest>(0, DD_EVENT_DISPINFO_ACK);
+      mConfigDeadline = std::chrono::steady_clock::now() +
+                        std::chrono::milliseconds(mRequestTimeoutMs);
+    }
+    if (request) {
+      *request = mConfigRequest;
+    }
+  }
+
+  char value[PROPERTY_VALUE_MAX];
+  property_get("sys.container.id", value, "0");
+
+  display_event_t req;
+
+  memset(&req, 0, sizeof(req));
+  req.type = DD_EVENT_DISPINFO_REQ;
+  req.size = sizeof(req);
+  req.id = atoi(value);
+  req.pad = DISPLAY_CAPS_VERSION;
+  if (_send(&req, sizeof(req)) < 0) {
+    ALOGE("%s:%d: Can't send display info request\n", __func__, __LINE__);
+    return -1;
+  }
+  return 0;
+}
+
+int RemoteDisplay::createBuffer(buffer_handle_t buffer) {
+  ALOGV("RemoteDisplay(%d)::%s", mSocketFd, __func__);
+
+  // pixels are read from the buffer when it is displayed
+  if (mPixelTransport)
+    return 0;
+
+  bool isNew = false;
+  uint64_t freedId = 0;
+  uint64_t id = mBuffers.acquire(buffer, &isNew, &freedId);
+  return _importBuffer(buffer, id, isNew, freedId);
+}
+
+int RemoteDisplay::_importBuffer(buffer_handle_t buffer,
+                                 uint64_t id,
+                                 bool isNew,
+                                 uint64_t freedId) {
+  if (freedId) {
+    _sendRemoveBuffer(freedId);
+  }
+  if (!isNew) {
+    // known, or another handle of a dma-buf remote has imported already
+    return 0;
+  }
+
+  buffer_info_event_t ev;
+  size_t handleSize =
+      sizeof(native_handle_t) + (buffer->numFds + buffer->numInts) * 4;
+  bool inlineFds = _inlineFds();
+
+  memset(&ev, 0, sizeof(ev));
+  ev.event.type = DD_EVENT_CREATE_BUFFER;
+  ev.event.id = _nextRequestId();
+  ev.info.bufferId = id;
+  ev.event.size = sizeof(ev) + handleSize;
+
+  Message msg;
+  msg.add(&ev, sizeof(ev));
+  msg.add(buffer, handleSize);
+  if (inlineFds && buffer->numFds > 0) {
+    msg.fds = buffer->data;
+    msg.numFds = buffer->numFds;
+  }
+  uint32_t seq = 0;
+  if (_sendMsg(msg, &seq) < 0) {
+    ALOGE("RemoteDisplay(%d) failed to send create buffer event", mSocketFd);
+    return -1;
+  }
+  if (!inlineFds && buffer->numFds > 0) {
+    if (_sendFds((int*)(buffer->data), buffer->numFds, &seq) < 0) {
+      ALOGE("RemoteDisplay(%d) failed to send create buffer event", mSocketFd);
+      return -1;
+    }
+  }
+  mBuffers.setCreateSeq(id, seq);
+  return 0;
+}
+
+int RemoteDisplay::removeBuffer(buffer_handle_t buffer) {
+  ALOGV("RemoteDisplay(%d)::%s", mSocketFd, __func__);
+
+  if (mPixelTransport)
+    return 0;
+
+  // remote keeps the buffer idle for a while, and while other handles of
+  // its dma-buf are in use. Frames sent so far may show it.
+  mBuffers.release(buffer, mUseSeq);
+  return _evictBuffers();
+}
+
+int RemoteDisplay::_evictBuffers() {
+  uint32_t before;
+  {
+    std::lock_guard<std::mutex> lock(mInflightMutex);
+    // remote shows the last frame it acked, until then any frame sent may
+    // be on screen. Without frames (hwc1) buffers are shown by requests.
+    if (!mFrameTracked) {
+      before = mUseSeq + 1;
+    } else if (mFrameAcked) {
+      before = mAckedSeq;
+    } else {
+      return 0;
+    }
+  }
+
+  uint64_t freedId = 0;
+  while (mBuffers.evictIdle(mIdleBuffers, before, &freedId)) {
+    if (freedId && _sendRemoveBuffer(freedId) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+int RemoteDisplay::_sendRemoveBuffer(uint64_t id) {
+  buffer_info_event_t ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.event.type = DD_EVENT_REMOVE_BUFFER;
+  ev.event.id = _nextRequestId();
+  ev.info.bufferId = id;
+  ev.event.size = sizeof(ev);
+
+  if (_send(&ev, sizeof(ev)) < 0) {
+    ALOGE("RemoteDisplay(%d) failed to send remove buffer event", mSocketFd);
+    return -1;
+  }
+  return 0;
+}
+
+int RemoteDisplay::displayBuffer(buffer_handle_t buffer, int fence) {
+  if (mPixelTransport) {
+    // hwc1, a TCP remote can't take the buffer
+    FrameCommit frame;
+    frame.frameSeq = ++mPixelFrameSeq;
+    frame.fbTarget = buffer;
+    frame.fbFence = fence;
+    return _sendPixels(frame, nullptr);
+  }
+  return _displayBuffer(buffer, fence, nullptr);
+}
+
+int RemoteDisplay::_displayBuffer(buffer_handle_t buffer,
+                                  int fence,
+                                  uint32_t* sentId) {
+  ALOGV("RemoteDisplay(%d)::%s", mSocketFd, __func__);
+
+  buffer_info_event_t ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.event.type = DD_EVENT_DISPLAY_REQ;
+  ev.event.id = _nextRequestId();
+  ev.event.size = sizeof(ev);
+  ev.info.bufferId = _bufferId(buffer);
+
+  Message msg;
+  msg.add(&ev, sizeof(ev));
+  if (fence >= 0 && _inlineFds()) {
+    msg.fds = &fence;
+    msg.numFds = 1;
+    msg.frameFences = true;
+  }
+  if (_sendMsg(msg) < 0) {
+    ALOGE("RemoteDisplay(%d) failed to send display buffer request", mSocketFd);
+    return -1;
+  }
+  if (sentId) {
+    *sentId = ev.event.id;
+  }
+  return 0;
+}
+
+int RemoteDisplay::setRotation(int rotation) {
+  ALOGV("RemoteDisplay(%d)::%s", mSocketFd, __func__);
+
+  rotation_event_t ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.event.type = DD_EVENT_SET_ROTATION;
+  ev.event.id = _nextRequestId();
+  ev.event.size = sizeof(ev);
+  ev.rotation = rotation;
+
+  if (_send(&ev, sizeof(ev)) < 0) {
+    ALOGE("RemoteDisplay(%d) failed to send display rotation request", mSocketFd);
+    return -1;
+  }
+  return 0;
+}
+
+int RemoteDisplay::createLayer(uint64_t id) {
+  ALOGV("RemoteDisplay(%d)::%s", mSocketFd, __func__);
+
+  create_layer_event_t ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.event.type = DD_EVENT_CREATE_LAYER;
+  ev.event.id = _nextRequestId();
+  ev.event.size = sizeof(ev);
+  ev.layerId = id;
+
+  if (_send(&(ev), sizeof(ev)) < 0) {
+    ALOGE("RemoteDisplay(%d) failed to send create layer event", mSocketFd);
+    return -1;
+  }
+
+  return 0;
+}
+
+int RemoteDisplay::removeLayer(uint64_t id) {
+  ALOGV("RemoteDisplay(%d)::%s", mSocketFd, __func__);
+
+  remove_layer_event_t ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.event.type = DD_EVENT_REMOVE_LAYER;
+  ev.event.id = _nextRequestId();
+  ev.event.size = sizeof(ev);
+  ev.layerId = id;
+
+  if (_send(&(ev), sizeof(ev)) < 0) {
+    ALOGE("RemoteDisplay(%d) failed to send remove layer event", mSocketFd);
+    return -1;
+  }
+
+  return 0;
+}
+
+int RemoteDisplay::updateLayers(const std::vector<layer_info_t>& layerInfo) {
+  ALOGV("RemoteDisplay(%d)::%s", mSocketFd, __func__);
+
+  update_layers_event_t ev;
+  uint32_t numLayers = layerInfo.size();
+
+  LAYER_TRACE("%s layer count %d", __func__, numLayers);
+  for (uint32_t i = 0; i < numLayers; i++) {
+    LAYER_TRACE("  %d layer %" PRIx64 " stack %d task %d", i,
+                layerInfo[i].layerId, layerInfo[i].stackId,
+                layerInfo[i].taskId);
+  }
+
+  memset(&ev, 0, sizeof(ev));
+  ev.event.type = DD_EVENT_UPDATE_LAYERS;
+  ev.event.id = _nextRequestId();
+  ev.event.size = sizeof(ev) + sizeof(layer_info_t) * numLayers;
+  ev.numLayers = numLayers;
+
+  Message msg;
+  msg.add(&ev, sizeof(ev));
+  msg.add(layerInfo.data(), sizeof(layer_info_t) * numLayers);
+  if (_sendMsg(msg) < 0) {
+    ALOGE("RemoteDisplay(%d) failed to send update layers event", mSocketFd);
+    return -1;
+  }
+  return 0;
+}
+
+int RemoteDisplay::presentLayers(
+    const std::vector<layer_buffer_info_t>& layerBuffer) {
+  return _presentLayers(layerBuffer, nullptr);
+}
+
+int RemoteDisplay::_presentLayers(
+    const std::vector<layer_buffer_info_t>& layerBuffer,
+    uint32_t* sentId) {
+  ALOGV("RemoteDisplay(%d)::%s", mSocketFd, __func__);
+
+  present_layers_req_event_t ev;
+  uint32_t numLayers = layerBuffer.size();
+
+  memset(&ev, 0, sizeof(ev));
+  ev.event.type = DD_EVENT_PRESENT_LAYERS_REQ;
+  ev.event.id = _nextRequestId();
+  ev.event.size = sizeof(ev) + sizeof(layer_buffer_info_t) * numLayers;
+  ev.numLayers = numLayers;
+
+  mFenceFds.clear();
+  _prepareLayerBuffers(layerBuffer);
+
+  Message msg;
+  msg.add(&ev, sizeof(ev));
+  msg.add(mLayerBufferScratch.data(), sizeof(layer_buffer_info_t) * numLayers);
+  msg.fds = mFenceFds.data();
+  msg.numFds = mFenceFds.size();
+  msg.frameFences = true;
+  if (_sendMsg(msg) < 0) {
+    ALOGE("RemoteDisplay(%d) failed to send present layers req event",
+          mSocketFd);
+    return -1;
+  }
+  if (sentId) {
+    *sentId = ev.event.id;
+  }
+  return 0;
+}
+
+int RemoteDisplay::_addFence(int fence) {
+  if (fence < 0 || !_inlineFds())
+    return -1;
+
+  if (mFenceFds.size() >= kMaxFds) {
+    ALOGW("RemoteDisplay(%d) too many acquire fences, drop fence %d",
+          mSocketFd, fence);
+    return -1;
+  }
+  mFenceFds.push_back(fence);
+  return mFenceFds.size() - 1;
+}
+
+uint64_t RemoteDisplay::_bufferId(buffer_handle_t buffer) {
+  if (!buffer)
+    return 0;
+
+  // e.g. a layer buffer registered with a previous connection is imported
+  // again, without a reference until its layer takes one
+  bool isNew = false;
+  uint64_t freedId = 0;
+  uint64_t id = mBuffers.use(buffer, mUseSeq, &isNew, &freedId);
+  if (_importBuffer(buffer, id, isNew, freedId) < 0)
+    return 0;
+  uint32_t seq = mBuffers.createSeq(id);
+  if (seq && (!mFrameBarrier || (int32_t)(seq - mFrameBarrier) > 0)) {
+    mFrameBarrier = seq;
+  }
+  return id;
+}
+
+void RemoteDisplay::_prepareLayerBuffers(
+    const std::vector<layer_buffer_info_t>& layerBuffer) {
+  mLayerBufferScratch.resize(layerBuffer.size());
+  for (size_t i = 0; i < layerBuffer.size(); i++) {
+    mLayerBufferScratch[i] = layerBuffer[i];
+    mLayerBufferScratch[i].bufferId =
+        _bufferId((buffer_handle_t)layerBuffer[i].bufferId);
+    mLayerBufferScratch[i].fence = _addFence(layerBuffer[i].fence);
+  }
+}
+
+size_t RemoteDisplay::_beginSection(uint32_t type) {
+  frame_section_t section;
+  section.type = type;
+  section.size = 0;
+
+  size_t offset = mMsgBuf.size();
+  mMsgBuf.resize(offset + sizeof(section));
+  memcpy(mMsgBuf.data() + offset, &section, sizeof(section));
+  return offset;
+}
+
+void RemoteDisplay::_endSection(size_t offset) {
+  size_t size = mMsgBuf.size() - offset - sizeof(frame_section_t);
+  size_t padded = (size + 7) & ~(size_t)7;
+
+  mMsgBuf.resize(offset + sizeof(frame_section_t) + padded, 0);
+  uint32_t sectionSize = padded;
+  memcpy(mMsgBuf.data() + offset + offsetof(frame_section_t, size),
+         &sectionSize, sizeof(sectionSize));
+}
+
+void RemoteDisplay::_appendSection(uint32_t type,
+                                   const void* data,
+                                   size_t size) {
+  size_t offset = _beginSection(type);
+  mMsgBuf.insert(mMsgBuf.end(), (const uint8_t*)data,
+                 (const uint8_t*)data + size);
+  _endSection(offset);
+}
+
+void RemoteDisplay::_appendLayerDelta(const layer_info_t& info,
+                                      uint32_t mask) {
+  layer_delta_t delta;
+  size_t offset = mMsgBuf.size();
+
+  mMsgBuf.resize(offset + sizeof(delta));
+  auto put = [this](const void* field, size_t size) {
+    mMsgBuf.insert(mMsgBuf.end(), (const uint8_t*)field,
+                   (const uint8_t*)field + size);
+  };
+
+  if (mask & LAYER_CHANGED_TYPE) {
+    put(&info.type, sizeof(info.type));
+  }
+  if (mask & LAYER_CHANGED_TASK) {
+    put(&info.stackId, sizeof(info.stackId));
+    put(&info.taskId, sizeof(info.taskId));
+    put(&info.userId, sizeof(info.userId));
+    put(&info.index, sizeof(info.index));
+  }
+  if (mask & LAYER_CHANGED_SRC_CROP) {
+    put(&info.srcCrop, sizeof(info.srcCrop));
+  }
+  if (mask & LAYER_CHANGED_DST_FRAME) {
+    put(&info.dstFrame, sizeof(info.dstFrame));
+  }
+  if (mask & LAYER_CHANGED_TRANSFORM) {
+    put(&info.transform, sizeof(info.transform));
+  }
+  if (mask & LAYER_CHANGED_Z) {
+    put(&info.z, sizeof(info.z));
+  }
+  if (mask & LAYER_CHANGED_BLEND) {
+    put(&info.blendMode, sizeof(info.blendMode));
+  }
+  if (mask & LAYER_CHANGED_ALPHA) {
+    put(&info.planeAlpha, sizeof(info.planeAlpha));
+  }
+  if (mask & LAYER_CHANGED_COLOR) {
+    put(&info.color, sizeof(info.color));
+  }
+
+  size_t size = mMsgBuf.size() - offset - sizeof(delta);
+  size_t padded = (size + 7) & ~(size_t)7;
+  mMsgBuf.resize(offset + sizeof(delta) + padded, 0);
+
+  delta.layerId = info.layerId;
+  delta.mask = mask;
+  delta.size = padded;
+  memcpy(mMsgBuf.data() + offset, &delta, sizeof(delta));
+}
+
+uint32_t RemoteDisplay::_nextRequestId() {
+  if (!hasCap(DISPLAY_CAP_REQUEST_ID))
+    return 0;
+  uint32_t id = ++mRequestId;
+  return id ? id : ++mRequestId;
+}
+
+uint32_t RemoteDisplay::_trackFrame(uint32_t frameSeq,
+                                    uint32_t ackType,
+                                    bool withId,
+                                    RemoteRequestPtr* request) {
+  InflightFrame frame;
+  frame.frameSeq = frameSeq;
+  frame.ackType = ackType;
+  frame.id = withId ? _nextRequestId() : 0;
+  frame.sent = std::chrono::steady_clock::now();
+  frame.deadline =
+      frame.sent + std::chrono::milliseconds(mRequestTimeoutMs);
+  if (request) {
+    frame.request = std::make_shared<RemoteRequest>(frame.id, ackType);
+    *request = frame.request;
+  }
+
+  // tracked before sending, the ack may come before send returns
+  std::unique_lock<std::mutex> lk(mInflightMutex);
+  mInflightFrames.push_back(frame);
+  mFrameTracked = true;
+  return frame.id;
+}
+
+void RemoteDisplay::_setFrameId(uint32_t frameSeq,
+                                uint32_t ackType,
+                                uint32_t id) {
+  std::unique_lock<std::mutex> lk(mInflightMutex);
+  // gone if the ack came already, it was matched by type then
+  for (auto it = mInflightFrames.rbegin(); it != mInflightFrames.rend();
+       ++it) {
+    if (it->frameSeq == frameSeq && it->ackType == ackType && !it->id) {
+      it->id = id;
+      break;
+    }
+  }
+}
+
+void RemoteDisplay::_frameAcked(uint32_t ackType,
+                                uint32_t frameSeq,
+                                uint32_t id) {
+  bool done = false;
+  uint32_t doneSeq = 0;
+  std::vector<RemoteRequestPtr> completed;
+  std::vector<int64_t> latency;
+  auto now = std::chrono::steady_clock::now();
+  {
+    std::unique_lock<std::mutex> lk(mInflightMutex);
+    // an ack with an id completes its request and the ones before it. An
+    // unknown id belongs to a request that timed out, isn't tracked, or to
+    // a legacy frame whose id isn't recorded yet: it only matches frames
+    // without an id, by type.
+    bool byId = false;
+    bool idless = false;
+    if (id && hasCap(DISPLAY_CAP_REQUEST_ID)) {
+      for (auto& frame : mInflightFrames) {
+        if (frame.id == id && frame.ackType == ackType) {
+          byId = true;
+          break;
+        }
+      }
+      idless = !byId;
+    }
+    while (!mInflightFrames.empty()) {
+      auto& frame = mInflightFrames.front();
+      if (idless && frame.id)
+        break;
+      if (byId) {
+        if (frame.ackType != ackType)
+          break;
+      } else if (ackType == DD_EVENT_FRAME_COMMIT_ACK) {
+        // frame commit acks carry the sequence, they may be coalesced
+        if ((int32_t)(frame.frameSeq - frameSeq) > 0)
+          break;
+      } else if (frame.ackType != ackType) {
+        // e.g. the DISPLAY_ACK of a frame that waits for PRESENT_LAYERS_ACK
+        break;
+      }
+      doneSeq = frame.frameSeq;
+      done = true;
+      bool last = byId ? frame.id == id : ackType != DD_EVENT_FRAME_COMMIT_ACK;
+      if (frame.request) {
+        completed.push_back(frame.request);
+      }
+      if (mLatencyReport) {
+        mAckLatency.push_back(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(now -
+                                                                 frame.sent)
+                .count());
+      }
+      mInflightFrames.pop_front();
+      if (last)
+        break;
+    }
+    if (mLatencyReport && mAckLatency.size() >= mLatencyReport) {
+      latency.swap(mAckLatency);
+    }
+    if (done) {
+      mFrameAcked = true;
+      mAckedSeq = doneSeq;
+    }
+    if (done && mCreditStarved.exchange(false) && !mBackpressure) {
+      mRefreshNeeded = true;
+    }
+    if (done && mFrameCredits) {
+      mCreditCond.notify_all();
+    }
+  }
+
+  for (auto& request : completed) {
+    request->complete(0);
+  }
+  if (done && mEventListener) {
+    mEventListener->onFrameDone(doneSeq);
+  }
+  if (!latency.empty()) {
+    _reportLatency(latency);
+  }
+}
+
+void RemoteDisplay::_reportLatency(std::vector<int64_t>& samples) {
+  std::sort(samples.begin(), samples.end());
+  auto ms = [&samples](size_t p) {
+    return samples[(samples.size() - 1) * p / 100] / 1e6;
+  };
+  ALOGI("RemoteDisplay(%d) present to ack latency of %zd frames, ms p50 %.2f "
+        "p90 %.2f p99 %.2f max %.2f",
+        mSocketFd, samples.size(), ms(50), ms(90), ms(99),
+        samples.back() / 1e6);
+}
+
+int RemoteDisplay::expireRequests() {
+  if (mRequestTimeoutMs <= 0)
+    return -1;
+
+  auto now = std::chrono::steady_clock::now();
+  auto next = now + std::chrono::milliseconds(mRequestTimeoutMs);
+  bool expired = false;
+  uint32_t expiredSeq = 0;
+  std::vector<RemoteRequestPtr> failed;
+  {
+    std::unique_lock<std::mutex> lk(mInflightMutex);
+    if (mConfigRequest && !mConfigRequest->done()) {
+      if (mConfigDeadline <= now) {
+        ALOGW("RemoteDisplay(%d) no display info ack in %d ms", mSocketFd,
+              mRequestTimeoutMs);
+        failed.push_back(mConfigRequest);
+      } else {
+        next = std::min(next, mConfigDeadline);
+      }
+    }
+    // frames were sent in order with the same timeout, the oldest is due
+    // first
+    while (!mInflightFrames.empty()) {
+      auto& frame = mInflightFrames.front();
+      if (frame.deadline > now) {
+        next = std::min(next, frame.deadline);
+        break;
+      }
+      expired = true;
+      expiredSeq = frame.frameSeq;
+      if (frame.request) {
+        failed.push_back(frame.request);
+      }
+      mInflightFrames.pop_front();
+    }
+    if (expired && mCreditStarved.exchange(false) && !mBackpressure) {
+      mRefreshNeeded = true;
+    }
+    if (expired && mFrameCredits) {
+      mCreditCond.notify_all();
+    }
+  }
+
+  for (auto& request : failed) {
+    request->complete(-ETIMEDOUT);
+  }
+  // present fences of a stalled remote retire rather than hang the
+  // compositor, a late ack is ignored
+  if (expired) {
+    ALOGW("RemoteDisplay(%d) frame %u not acked in %d ms", mSocketFd,
+          expiredSeq, mRequestTimeoutMs);
+    if (mEventListener) {
+      mEventListener->onFrameDone(expiredSeq);
+    }
+  }
+  return std::chrono::duration_cast<std::chrono::milliseconds>(next - now)
+             .count() +
+         1;
+}
+
+void RemoteDisplay::_failFrame(uint32_t frameSeq, int status) {
+  bool failed = false;
+  std::vector<RemoteRequestPtr> completed;
+  {
+    std::unique_lock<std::mutex> lk(mInflightMutex);
+    while (!mInflightFrames.empty()) {
+      auto& frame = mInflightFrames.front();
+      if ((int32_t)(frame.frameSeq - frameSeq) > 0)
+        break;
+      failed = true;
+      if (frame.request) {
+        completed.push_back(frame.request);
+      }
+      mInflightFrames.pop_front();
+    }
+    if (failed && mCreditStarved.exchange(false) && !mBackpressure) {
+      mRefreshNeeded = true;
+    }
+    if (failed && mFrameCredits) {
+      mCreditCond.notify_all();
+    }
+  }
+
+  for (auto& request : completed) {
+    request->complete(status);
+  }
+  // its present fence retires, remote keeps showing the frame before
+  if (failed && mEventListener) {
+    mEventListener->onFrameDone(frameSeq);
+  }
+}
+
+void RemoteDisplay::_failRequests(int status) {
+  std::vector<RemoteRequestPtr> failed;
+  {
+    std::unique_lock<std::mutex> lk(mInflightMutex);
+    if (mConfigRequest) {
+      failed.push_back(mConfigRequest);
+    }
+    for (auto& frame : mInflightFrames) {
+      if (frame.request) {
+        failed.push_back(frame.request);
+      }
+    }
+  }
+  for (auto& request : failed) {
+    request->complete(status);
+  }
+}
+
+bool RemoteDisplay::frameUnacked() {
+  std::lock_guard<std::mutex> lk(mInflightMutex);
+  if (mDisconnected || mInflightFrames.empty())
+    return false;
+
+  // cleared by the ack, RemoteDisplayMgr then refreshes
+  mCreditStarved = true;
+  return true;
+}
+
+bool RemoteDisplay::takeTasks(std::vector<uint32_t>* tasks) {
+  std::lock_guard<std::mutex> lk(mTaskMutex);
+  if (!mTasksChanged)
+    return false;
+
+  *tasks = mTasks;
+  mTasksChanged = false;
+  return true;
+}
+
+bool RemoteDisplay::waitFrameCredit(int timeoutMs) {
+  std::unique_lock<std::mutex> lk(mInflightMutex);
+  if (!mFrameCredits)
+    return true;
+
+  auto hasCredit = [this]() {
+    return mDisconnected || mInflightFrames.size() < mFrameCredits;
+  };
+  if (timeoutMs > 0) {
+    mCreditCond.wait_for(lk, std::chrono::milliseconds(timeoutMs), hasCredit);
+  }
+  if (hasCredit())
+    return true;
+
+  // the ack returning a credit clears it, RemoteDisplayMgr then refreshes
+  mCreditStarved = true;
+  return false;
+}
+
+int RemoteDisplay::_commitFrameLegacy(const FrameCommit& frame,
+                                      RemoteRequestPtr* request) {
+  // the last request of the frame tells when it is shown, its id is only
+  // known once it is sent
+  uint32_t ackType = 0;
+  if (frame.layerBuffers.size()) {
+    ackType = DD_EVENT_PRESENT_LAYERS_ACK;
+  } else if (frame.fbTarget) {
+    ackType = DD_EVENT_DISPLAY_ACK;
+  }
+  if (ackType) {
+    _trackFrame(frame.frameSeq, ackType, false, request);
+  } else {
+    if (request) {
+      *request = std::make_shared<RemoteRequest>(0, 0);
+      (*request)->complete(0);
+    }
+    if (mEventListener) {
+      mEventListener->onFrameDone(frame.frameSeq);
+    }
+  }
+
+  for (auto id : frame.createdLayers) {
+    if (createLayer(id) < 0)
+      return -1;
+  }
+  for (auto id : frame.removedLayers) {
+    if (removeLayer(id) < 0)
+      return -1;
+  }
+  uint32_t id = 0;
+  if (frame.fbTarget &&
+      _displayBuffer(frame.fbTarget, frame.fbFence, &id) < 0)
+    return -1;
+  if (frame.rotationChanged && setRotation(frame.rotation) < 0)
+    return -1;
+  if (frame.layers.size() && updateLayers(frame.layers) < 0)
+    return -1;
+  if (frame.layerBuffers.size() &&
+      _presentLayers(frame.layerBuffers, &id) < 0)
+    return -1;
+  if (id) {
+    _setFrameId(frame.frameSeq, ackType, id);
+  }
+  return 0;
+}
+
+int RemoteDisplay::commitFrame(const FrameCommit& frame,
+                               RemoteRequestPtr* request,
+                               bool takeFences) {
+  ALOGV("RemoteDisplay(%d)::%s frame %u", mSocketFd, __func__,
+        frame.frameSeq);
+
+  mFrameFences.clear();
+  if (takeFences) {
+    if (frame.fbFence >= 0) {
+      mFrameFences.push_back(frame.fbFence);
+    }
+    for (auto& lb : frame.layerBuffers) {
+      if (lb.fence >= 0 && std::find(mFrameFences.begin(), mFrameFences.end(),
+                                     lb.fence) == mFrameFences.end()) {
+        mFrameFences.push_back(lb.fence);
+      }
+    }
+  }
+
+  int ret = 0;
+  if (mPixelTransport) {
+    ret = _sendPixels(frame, request);
+  } else {
+    mUseSeq = frame.frameSeq;
+    ret = hasCap(DISPLAY_CAP_FRAME_COMMIT)
+              ? _sendFrameCommit(frame, request)
+              : _commitFrameLegacy(frame, request);
+    if (ret >= 0) {
+      ret = _evictBuffers();
+    }
+  }
+
+  // fences sent right away, or not at all, were not taken
+  for (auto fd : mFrameFences) {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+  mFrameFences.clear();
+  return ret;
+}
+
+void RemoteDisplay::_damageRects(const std::vector<rect_t>& damage,
+                                 uint32_t width,
+                                 uint32_t height) {
+  mDamageScratch.clear();
+  rect_t full = {0, 0, (int)width, (int)height};
+  if (!mPixelsSent || damage.empty()) {
+    mDamageScratch.push_back(full);
+    return;
+  }
+
+  rect_t bounds = {(int)width, (int)height, 0, 0};
+  for (auto& r : damage) {
+    rect_t clipped = {std::max(r.left, 0), std::max(r.top, 0),
+                      std::min(r.right, (int)width),
+                      std::min(r.bottom, (int)height)};
+    if (clipped.left >= clipped.right || clipped.top >= clipped.bottom)
+      continue;
+    mDamageScratch.push_back(clipped);
+    bounds.left = std::min(bounds.left, clipped.left);
+    bounds.top = std::min(bounds.top, clipped.top);
+    bounds.right = std::max(bounds.right, clipped.right);
+    bounds.bottom = std::max(bounds.bottom, clipped.bottom);
+  }
+  // many small rects cost more in headers and runs than their bounds
+  if (mDamageScratch.size() > kMaxDamageRects) {
+    mDamageScratch.assign(1, bounds);
+  }
+}
+
+int RemoteDisplay::_sendPixels(const FrameCommit& frame,
+                               RemoteRequestPtr* request) {
+  if (!frame.fbTarget) {
+    if (mEventListener) {
+      mEventListener->onFrameDone(frame.frameSeq);
+    }
+    return 0;
+  }
+
+  int fence = -1;
+  if (frame.fbFence >= 0) {
+    fence = _takeFence(frame.fbFence);
+    if (fence < 0) {
+      fence = fcntl(frame.fbFence, F_DUPFD_CLOEXEC, 0);
+    }
+    if (fence < 0) {
+      ALOGE("RemoteDisplay(%d) failed to dup fb fence: %s", mSocketFd,
+            strerror(errno));
+      return -1;
+    }
+  }
+  // a replaced frame is completed by the ack of the one replacing it
+  uint32_t id =
+      _trackFrame(frame.frameSeq, DD_EVENT_FRAME_COMMIT_ACK, true, request);
+
+  std::unique_lock<std::mutex> lk(mPixelMutex);
+  if (!mPixelWorker.joinable()) {
+    mPixelWorker = std::thread(&RemoteDisplay::_pixelThread, this);
+  }
+  PixelFrame& pending = mPixelFrame;
+  if (mPixelPending) {
+    // never sent, its damage goes with this frame
+    if (pending.fence >= 0) {
+      close(pending.fence);
+    }
+    if (!pending.damage.empty() && !frame.fbDamage.empty()) {
+      pending.damage.insert(pending.damage.end(), frame.fbDamage.begin(),
+                            frame.fbDamage.end());
+    } else {
+      pending.damage.clear();
+    }
+  } else {
+    pending.damage = frame.fbDamage;
+  }
+  pending.frameSeq = frame.frameSeq;
+  pending.id = id;
+  pending.buffer = frame.fbTarget;
+  pending.fence = fence;
+  mPixelPending = true;
+  lk.unlock();
+  mPixelCond.notify_one();
+  return 0;
+}
+
+void RemoteDisplay::_pixelThread() {
+  std::unique_lock<std::mutex> lk(mPixelMutex);
+  while (true) {
+    mPixelCond.wait(lk, [this]() { return mPixelStop || mPixelPending; });
+    if (mPixelStop)
+      break;
+
+    PixelFrame frame = std::move(mPixelFrame);
+    mPixelFrame.damage.clear();
+    mPixelPending = false;
+    lk.unlock();
+    int ret = _encodePixels(frame);
+    if (ret < 0) {
+      // the next frame sent can't build on its damage
+      mPixelsSent = false;
+      if (ret == -EAGAIN) {
+        mRefreshNeeded = true;
+      }
+      _failFrame(frame.frameSeq, ret);
+    }
+    if (frame.fence >= 0) {
+      close(frame.fence);
+    }
+    lk.lock();
+  }
+}
+
+int RemoteDisplay::_encodePixels(const PixelFrame& frame) {
+  if (mPixelFormat < 0)
+    return -EINVAL;
+
+  // the buffer is read right away, rendering must be complete. A frame
+  // still rendering is skipped and a new one is composed.
+  if (frame.fence >= 0) {
+    struct pollfd pfd = {frame.fence, POLLIN, 0};
+    if (poll(&pfd, 1, kFenceTimeoutMs) <= 0) {
+      ALOGW("RemoteDisplay(%d) fb fence not signalled in %d ms, skip frame %u",
+            mSocketFd, kFenceTimeoutMs, frame.frameSeq);
+      return -EAGAIN;
+    }
+  }
+
+  auto& mapper = BufferMapper::getMapper();
+  uint32_t width = 0, height = 0;
+  if (mapper.getBufferSize(frame.buffer, width, height) < 0)
+    return -EAGAIN;
+  if (!mPixelFormat) {
+    // the client target keeps its format, a wrong one is reported once
+    int32_t format = 0;
+    if (mapper.getBufferFormat(frame.buffer, format) < 0)
+      return -EAGAIN;
+    if (format != HAL_PIXEL_FORMAT_RGBA_8888 &&
+        format != HAL_PIXEL_FORMAT_RGBX_8888 &&
+        format != HAL_PIXEL_FORMAT_BGRA_8888) {
+      ALOGE("RemoteDisplay(%d) can't send pixels of format %d", mSocketFd,
+            format);
+      mPixelFormat = -1;
+      return -EINVAL;
+    }
+    mPixelFormat = format;
+  }
+  if (width != mPixelWidth || height != mPixelHeight) {
+    mPixelWidth = width;
+    mPixelHeight = height;
+    mPixelsSent = false;
+  }
+
+  buffer_handle_t handle = nullptr;
+  uint8_t* pixels = nullptr;
+  uint32_t stride = 0;
+  if (mapper.importBuffer(frame.buffer, &handle) < 0)
+    return -EAGAIN;
+  if (mapper.lockBuffer(handle, pixels, stride) < 0 || !pixels) {
+    mapper.release(handle);
+    return -EAGAIN;
+  }
+
+  _damageRects(frame.damage, width, height);
+  display_pixels_event_t ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.event.type = DD_EVENT_DISPLAY_PIXELS;
+  ev.event.id = frame.id;
+  ev.frameSeq = frame.frameSeq;
+  ev.format = mPixelFormat;
+  ev.width = width;
+  ev.height = height;
+  ev.numRects = mDamageScratch.size();
+
+  mPixelBuf.resize(sizeof(ev));
+  for (auto& rect : mDamageScratch) {
+    size_t offset = mPixelBuf.size();
+    pixel_rect_t header;
+    header.rect = rect;
+    mPixelBuf.resize(offset + sizeof(header));
+    header.codec = mPixelCodec.encode(pixels, stride, rect, mPixelBuf);
+    header.size = mPixelBuf.size() - offset - sizeof(header);
+    memcpy(mPixelBuf.data() + offset, &header, sizeof(header));
+  }
+  mapper.unlockBuffer(handle);
+  mapper.release(handle);
+
+  ev.event.size = mPixelBuf.size();
+  memcpy(mPixelBuf.data(), &ev, sizeof(ev));
+  if (_send(mPixelBuf.data(), mPixelBuf.size()) < 0) {
+    ALOGE("RemoteDisplay(%d) failed to send display pixels", mSocketFd);
+    return -EIO;
+  }
+  mPixelsSent = true;
+  return 0;
+}
+
+int RemoteDisplay::_sendFrameCommit(const FrameCommit& frame,
+                                    RemoteRequestPtr* request) {
+  frame_commit_event_t ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.event.type = DD_EVENT_FRAME_COMMIT;
+  ev.frameSeq = frame.frameSeq;
+
+  mMsgBuf.resize(sizeof(ev));
+  mFenceFds.clear();
+  mFrameBarrier = 0;
+  if (frame.createdLayers.size()) {
+    _appendSection(FRAME_SECTION_CREATE_LAYERS, frame.createdLayers.data(),
+                   sizeof(uint64_t) * frame.createdLayers.size());
+    ev.numSections++;
+  }
+  if (frame.removedLayers.size()) {
+    _appendSection(FRAME_SECTION_REMOVE_LAYERS, frame.removedLayers.data(),
+                   sizeof(uint64_t) * frame.removedLayers.size());
+    ev.numSections++;
+  }
+  if (hasCap(DISPLAY_CAP_LAYER_DELTA)) {
+    // z goes with the order section, skip layers only moved in z
+    size_t offset = 0;
+    for (auto& info : frame.layers) {
+      uint32_t mask = info.changed & ~LAYER_CHANGED_Z;
+      if (!mask)
+        continue;
+      if (!offset) {
+        offset = _beginSection(FRAME_SECTION_LAYER_DELTAS);
+        ev.numSections++;
+      }
+      _appendLayerDelta(info, mask);
+    }
+    if (offset) {
+      _endSection(offset);
+    }
+    if (frame.zOrder.size()) {
+      _appendSection(FRAME_SECTION_Z_ORDER, frame.zOrder.data(),
+                     sizeof(uint64_t) * frame.zOrder.size());
+      ev.numSections++;
+    }
+  } else if (frame.layers.size()) {
+    _appendSection(FRAME_SECTION_UPDATE_LAYERS, frame.layers.data(),
+                   sizeof(layer_info_t) * frame.layers.size());
+    ev.numSections++;
+  }
+  if (frame.layerBuffers.size()) {
+    _prepareLayerBuffers(frame.layerBuffers);
+    _appendSection(FRAME_SECTION_LAYER_BUFFERS, mLayerBufferScratch.data(),
+                   sizeof(layer_buffer_info_t) * mLayerBufferScratch.size());
+    ev.numSections++;
+  }
+  if (frame.fbTarget) {
+    buffer_info_t info;
+    info.bufferId = _bufferId(frame.fbTarget);
+    _appendSection(FRAME_SECTION_FB_TARGET, &info, sizeof(info));
+    ev.numSections++;
+
+    frame_fence_t fence;
+    fence.fence = _addFence(frame.fbFence);
+    fence.pad = 0;
+    if (fence.fence >= 0) {
+      _appendSection(FRAME_SECTION_FB_FENCE, &fence, sizeof(fence));
+      ev.numSections++;
+    }
+  }
+  if (frame.rotationChanged) {
+    frame_rotation_t rotation;
+    rotation.rotation = frame.rotation;
+    rotation.pad = 0;
+    _appendSection(FRAME_SECTION_ROTATION, &rotation, sizeof(rotation));
+    ev.numSections++;
+  }
+  if (ev.numSections == 0) {
+    // nothing for remote to show, the frame is done already
+    if (mEventListener) {
+      mEventListener->onFrameDone(frame.frameSeq);
+    }
+    return 0;
+  }
+
+  ev.event.size = mMsgBuf.size();
+  ev.event.id =
+      _trackFrame(frame.frameSeq, DD_EVENT_FRAME_COMMIT_ACK, true, request);
+  memcpy(mMsgBuf.data(), &ev, sizeof(ev));
+
+  Message msg;
+  msg.add(mMsgBuf.data(), mMsgBuf.size());
+  msg.fds = mFenceFds.data();
+  msg.numFds = mFenceFds.size();
+  msg.frameFences = true;
+  if (_sendFrameMsg(msg) < 0) {
+    ALOGE("RemoteDisplay(%d) failed to send frame commit", mSocketFd);
+    return -1;
+  }
+  return 0;
+}
+
+static uint64_t capsFromVersion(uint32_t version) {
+  uint64_t caps = 0;
+  if (version >= DISPLAY_VERSION_INLINE_FDS)
+    caps |= DISPLAY_CAP_INLINE_FDS;
+  if (version >= DISPLAY_VERSION_FRAME_COMMIT)
+    caps |= DISPLAY_CAP_FRAME_COMMIT;
+  if (version >= DISPLAY_VERSION_LAYER_DELTA)
+    caps |= DISPLAY_CAP_LAYER_DELTA;
+  if (version >= DISPLAY_VERSION_SHM_RING)
+    caps |= DISPLAY_CAP_SHM_RING;
+  return caps;
+}
+
+void RemoteDisplay::_parseCaps(const uint8_t* data, size_t len) {
+  memset(&mRemoteCaps, 0, sizeof(mRemoteCaps));
+  const size_t minSize = offsetof(display_caps_t, caps) + sizeof(uint64_t);
+  if (len >= minSize) {
+    // only the bytes the remote says it filled in count, a newer remote
+    // may send more than this hal knows, an older one less
+    uint32_t size = 0;
+    memcpy(&size, data + offsetof(display_caps_t, size), sizeof(size));
+    if (size >= minSize) {
+      memcpy(&mRemoteCaps, data, std::min({len, (size_t)size,
+                                           sizeof(mRemoteCaps)}));
+    }
+  }
+
+  if (mRemoteCaps.version == 0) {
+    // older remote, the protocol version tells what it implements
+    mRemoteCaps.caps = capsFromVersion(mDisplayFlags.version);
+  }
+  if (mRemoteCaps.numFormats > DISPLAY_CAPS_MAX_FORMATS) {
+    mRemoteCaps.numFormats = DISPLAY_CAPS_MAX_FORMATS;
+  }
+  mCaps = mRemoteCaps.caps & kHalCaps & ~mDisabledCaps;
+
+  {
+    std::unique_lock<std::mutex> lk(mInflightMutex);
+    mFrameCredits = mRemoteCaps.maxFramesInFlight;
+    if (mMaxFramesInFlight &&
+        (!mFrameCredits || mMaxFramesInFlight < mFrameCredits)) {
+      mFrameCredits = mMaxFramesInFlight;
+    }
+  }
+
+  ALOGI("RemoteDisplay(%d) caps v%u remote 0x%" PRIx64 " used 0x%" PRIx64
+        ", max layers %u, max frames in flight %u, %u formats, %u credits",
+        mSocketFd, mRemoteCaps.version, mRemoteCaps.caps, mCaps,
+        mRemoteCaps.maxLayers, mRemoteCaps.maxFramesInFlight,
+        mRemoteCaps.numFormats, mFrameCredits);
+}
+
+bool RemoteDisplay::supportsFormat(int32_t format) const {
+  if (mRemoteCaps.numFormats == 0)
+    return true;
+  for (uint32_t i = 0; i < mRemoteCaps.numFormats; i++) {
+    if (mRemoteCaps.formats[i] == format)
+      return true;
+  }
+  return false;
+}
+
+int RemoteDisplay::onDisplayInfoAck(const display_event_t& ev,
+                                    const uint8_t* data,
+                                    size_t len) {
+  ALOGV("RemoteDisplay(%d)::%s", mSocketFd, __func__);
+
+  display_info_t info;
+  if (len < sizeof(info)) {
+    ALOGE("RemoteDisplay(%d) display info ack too short (%zd)", mSocketFd,
+          len);
+    return -1;
+  }
+  memcpy(&info, data, sizeof(info));
+
+  mWidth = info.width;
   mHeight = info.height;
   mFramerate = info.fps;
   mXDpi = info.xdpi;
   mYDpi = info.ydpi;
   mDisplayFlags.value = info.flags;
+  _parseCaps(data + sizeof(info), len - sizeof(info));
+  if (mPixelTransport) {
+    // nothing which needs fds, the framebuffer goes as pixels
+    mCaps &= ~(DISPLAY_CAP_INLINE_FDS | DISPLAY_CAP_SHM_RING |
+               DISPLAY_CAP_FRAME_CHANNEL);
+    mDisplayFlags.mode = 0;
+  }
+  if (mPacketSocket) {
+    // a packet always carries its own fds, there is no dummy payload
+    mCaps |= DISPLAY_CAP_INLINE_FDS;
+  }
 
+  if (!mRing && mRingSize > 0 && hasCap(DISPLAY_CAP_SHM_RING) &&
+      _setupRing() == 0 && mStatusListener) {
+    mStatusListener->onChannelCreated(mSocketFd, mRing->rxEventFd());
+  }
+  if (!mRing && mFrameChannel.fd < 0 && mFrameChannelEnabled &&
+      hasCap(DISPLAY_CAP_FRAME_COMMIT) && hasCap(DISPLAY_CAP_FRAME_CHANNEL) &&
+      _setupFrameChannel() == 0 && mStatusListener) {
+    mStatusListener->onChannelCreated(mSocketFd, mFrameChannel.fd);
+  }
   if (mStatusListener) {
     mStatusListener->onConnect(mSocketFd);
   }
+
+  RemoteRequestPtr request;
+  {
+    std::unique_lock<std::mutex> lk(mInflightMutex);
+    request = mConfigRequest;
+  }
+  if (request) {
+    request->complete(0);
+  }
   return 0;
 }
 
-int RemoteDisplay::onDisplayBufferAck(const display_event_t& ev) {
+int RemoteDisplay::onDisplayBufferAck(const display_event_t& ev,
+                                      const uint8_t* data,
+                                      size_t len) {
   ALOGV("RemoteDisplay(%d)::%s", mSocketFd, __func__);
 
   buffer_info_t info;
-  int ret = _recv(&info, sizeof(info));
-  if (ret < 0) {
-    ALOGE("RemoteDisplay(%d) failed to receive present ack", mSocketFd);
+  if (len < sizeof(info)) {
+    ALOGE("RemoteDisplay(%d) display ack too short (%zd)", mSocketFd, len);
     return -1;
   }
+  memcpy(&info, data, sizeof(info));
+
   if (mEventListener) {
     mEventListener->onBufferDisplayed(info);
   }
+  _frameAcked(DD_EVENT_DISPLAY_ACK, 0, ev.id);
   return 0;
 }
 
-int RemoteDisplay::onPresentLayersAck(const display_event_t& ev) {
+int RemoteDisplay::onPresentLayersAck(const display_event_t& ev,
+                                      const uint8_t* data,
+                                      size_t len) {
   ALOGV("RemoteDisplay(%d)::%s", mSocketFd, __func__);
 
   present_layers_ack_event_t ack;
+  const size_t ackLen = sizeof(ack) - sizeof(ev);
 
-  if (_recv(&ack.flags, sizeof(ack) - sizeof(ev)) < 0) {
-    ALOGE("RemoteDisplay(%d) failed to receive present layers ack event",
-          mSocketFd);
+  if (len < ackLen) {
+    ALOGE("RemoteDisplay(%d) present layers ack too short (%zd)", mSocketFd,
+          len);
+    return -1;
+  }
+  memcpy(&ack.flags, data, ackLen);
+  if (ack.numLayers > (len - ackLen) / sizeof(layer_buffer_info_t)) {
+    ALOGE("RemoteDisplay(%d) present layers ack has %u layers in %zd bytes",
+          mSocketFd, ack.numLayers, len);
     return -1;
   }
   mDisplayFlags.value = ack.flags;
 
-  std::vector<layer_buffer_info_t> layerBuffers;
-  layerBuffers.resize(ack.numLayers);
-  for (size_t i = 0; i < ack.numLayers; i++) {
-    if (_recv(&layerBuffers.at(i), sizeof(layer_buffer_info_t)) < 0) {
-      ALOGE("Failed to recv presemt layer(%zd) ack", i);
-      return -1;
-    }
+  mAckLayers.resize(ack.numLayers);
+  memcpy(mAckLayers.data(), data + ackLen,
+         sizeof(layer_buffer_info_t) * ack.numLayers);
+  _notifyPresented(ack.releaseFence);
+  _frameAcked(DD_EVENT_PRESENT_LAYERS_ACK, 0, ev.id);
+
+  return 0;
+}
+
+int RemoteDisplay::onFrameCommitAck(const display_event_t& ev,
+                                    const uint8_t* data,
+                                    size_t len) {
+  ALOGV("RemoteDisplay(%d)::%s", mSocketFd, __func__);
+
+  frame_commit_ack_event_t ack;
+  const size_t ackLen = sizeof(ack) - sizeof(ev);
+
+  if (len < ackLen) {
+    ALOGE("RemoteDisplay(%d) frame commit ack too short (%zd)", mSocketFd,
+          len);
+    return -1;
   }
-  if (mEventListener) {
-    mEventListener->onPresented(layerBuffers, ack.releaseFence);
+  memcpy(&ack.frameSeq, data, ackLen);
+  if (ack.numLayers > (len - ackLen) / sizeof(layer_buffer_info_t)) {
+    ALOGE("RemoteDisplay(%d) frame commit ack has %u layers in %zd bytes",
+          mSocketFd, ack.numLayers, len);
+    return -1;
   }
+  mDisplayFlags.value = ack.flags;
 
+  mAckLayers.resize(ack.numLayers);
+  memcpy(mAckLayers.data(), data + ackLen,
+         sizeof(layer_buffer_info_t) * ack.numLayers);
+  _notifyPresented(ack.releaseFence);
+  _frameAcked(DD_EVENT_FRAME_COMMIT_ACK, ack.frameSeq, ev.id);
   return 0;
 }
 
-int RemoteDisplay::onDisplayEvent() {
+int RemoteDisplay::onSubscribeTasks(const display_event_t& ev,
+                                   const uint8_t* data,
+                                   size_t len) {
   ALOGV("RemoteDisplay(%d)::%s", mSocketFd, __func__);
 
-  display_event_t ev;
-  int ret = _recv(&ev, sizeof(ev));
-  if (ret < 0) {
+  subscribe_tasks_event_t sub;
+  const size_t subLen = sizeof(sub) - sizeof(ev);
+
+  if (!hasCap(DISPLAY_CAP_TASK_ROUTING) || mDisplayFlags.mode == 0) {
+    ALOGW("RemoteDisplay(%d) can't route tasks, subscription ignored",
+          mSocketFd);
+    return 0;
+  }
+  if (len < subLen) {
+    ALOGE("RemoteDisplay(%d) subscribe tasks too short (%zd)", mSocketFd, len);
+    return -1;
+  }
+  memcpy(&sub.numTasks, data, subLen);
+  if (sub.numTasks > (len - subLen) / sizeof(uint32_t)) {
+    ALOGE("RemoteDisplay(%d) subscribe tasks has %u tasks in %zd bytes",
+          mSocketFd, sub.numTasks, len);
+    return -1;
+  }
+
+  std::vector<uint32_t> tasks(sub.numTasks);
+  memcpy(tasks.data(), data + subLen, sizeof(uint32_t) * sub.numTasks);
+  std::sort(tasks.begin(), tasks.end());
+  tasks.erase(std::unique(tasks.begin(), tasks.end()), tasks.end());
+
+  ALOGD("RemoteDisplay(%d) subscribed to %zd tasks", mSocketFd, tasks.size());
+  {
+    std::lock_guard<std::mutex> lk(mTaskMutex);
+    if (tasks == mTasks)
+      return 0;
+    mTasks.swap(tasks);
+    mTasksChanged = true;
+  }
+  // the display composes again to route the layers
+  mRefreshNeeded = true;
+  return 0;
+}
+
+int RemoteDisplay::_recvFence(int index) {
+  // fences of legacy remotes are fd numbers in the remote process
+  if (!_inlineFds() || index < 0)
+    return -1;
+  if ((size_t)index >= mMsgFds.size()) {
+    ALOGW("RemoteDisplay(%d) fence index %d out of %zd fds", mSocketFd, index,
+          mMsgFds.size());
     return -1;
   }
+  // several layers may be released by the same fence, each gets its own fd
+  return fcntl(mMsgFds[index], F_DUPFD_CLOEXEC, 0);
+}
+
+void RemoteDisplay::_notifyPresented(int releaseFence) {
+  for (auto& layerBuffer : mAckLayers) {
+    layerBuffer.fence = _recvFence(layerBuffer.fence);
+  }
+  releaseFence = _recvFence(releaseFence);
+
+  // listener takes the fences it keeps by resetting them to -1
+  if (mEventListener) {
+    mEventListener->onPresented(mAckLayers, releaseFence);
+  }
+  for (auto& layerBuffer : mAckLayers) {
+    if (layerBuffer.fence >= 0)
+      close(layerBuffer.fence);
+  }
+  if (releaseFence >= 0)
+    close(releaseFence);
+}
 
+void RemoteDisplay::_recordRecv(uint32_t channel,
+                                const uint8_t* data,
+                                size_t len) {
+  if (!mRecorder.recording())
+    return;
+
+  struct iovec iov;
+  iov.iov_base = const_cast<uint8_t*>(data);
+  iov.iov_len = len;
+  mRecorder.record(CAPTURE_DIR_RECV, channel, &iov, 1, mMsgFds.data(),
+                   mMsgFds.size());
+}
+
+int RemoteDisplay::_dispatch(const display_event_t& ev,
+                             const uint8_t* data,
+                             size_t len) {
   switch (ev.type) {
     case DD_EVENT_DISPINFO_ACK:
-      onDisplayInfoAck(ev);
-      break;
+      return onDisplayInfoAck(ev, data, len);
     case DD_EVENT_DISPLAY_ACK:
-      onDisplayBufferAck(ev);
-      break;
+      return onDisplayBufferAck(ev, data, len);
     case DD_EVENT_PRESENT_LAYERS_ACK:
-      onPresentLayersAck(ev);
+      return onPresentLayersAck(ev, data, len);
+    case DD_EVENT_FRAME_COMMIT_ACK:
+      return onFrameCommitAck(ev, data, len);
+    case DD_EVENT_SUBSCRIBE_TASKS:
+      return onSubscribeTasks(ev, data, len);
+    default:
+      ALOGW("RemoteDisplay(%d) skip unknown event type 0x%x size %u",
+            mSocketFd, ev.type, ev.size);
       break;
-    default: {
-      char buf[1024];
-      ret = _recv(buf, 1024);
-      printf("Unknown command type %d expect %d recv=%d\n", ev.type,
-             (int)(ev.size - sizeof(ev)), ret);
+  }
+  return 0;
+}
+
+int RemoteDisplay::_parseMessages() {
+  size_t offset = 0;
+
+  while (mRecvLen - offset >= sizeof(display_event_t)) {
+    display_event_t ev;
+    memcpy(&ev, mRecvBuf.data() + offset, sizeof(ev));
+
+    if (ev.size < sizeof(ev) || ev.size > kMaxMessageSize) {
+      ALOGE("RemoteDisplay(%d) invalid event type 0x%x size %u, stream lost",
+            mSocketFd, ev.type, ev.size);
+      _disconnect();
+      return -1;
+    }
+    if (mRecvLen - offset < ev.size)
       break;
+
+    uint64_t end = mRecvOffset + offset + ev.size;
+    while (!mRecvFds.empty() && mRecvFds.front().offset < end) {
+      mMsgFds.push_back(mRecvFds.front().fd);
+      mRecvFds.pop_front();
+    }
+
+    _recordRecv(CAPTURE_CHANNEL_CONTROL, mRecvBuf.data() + offset, ev.size);
+    _dispatch(ev, mRecvBuf.data() + offset + sizeof(ev), ev.size - sizeof(ev));
+    offset += ev.size;
+
+    for (auto fd : mMsgFds) {
+      close(fd);
+    }
+    mMsgFds.clear();
+  }
+
+  if (offset > 0) {
+    memmove(mRecvBuf.data(), mRecvBuf.data() + offset, mRecvLen - offset);
+    mRecvLen -= offset;
+    mRecvOffset += offset;
+  }
+  return 0;
+}
+
+int RemoteDisplay::_recvPackets(int fd, uint32_t channel) {
+  if (mPacketBuf.empty()) {
+    mPacketBuf.resize(kMaxPacketSize);
+  }
+  if (mRecvCmsgBuf.empty()) {
+    mRecvCmsgBuf.resize(CMSG_SPACE(kMaxFds * sizeof(int)));
+  }
+
+  // one message per packet, read until drained for edge triggered polling
+  while (true) {
+    struct iovec iov;
+    iov.iov_base = mPacketBuf.data();
+    iov.iov_len = mPacketBuf.size();
+
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = mRecvCmsgBuf.data();
+    hdr.msg_controllen = mRecvCmsgBuf.size();
+
+    ssize_t len = recvmsg(fd, &hdr, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    if (len < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      ALOGE("RemoteDisplay(%d) recv on %d failed: %s", mSocketFd, fd,
+            strerror(errno));
+      _disconnect();
+      return -1;
+    }
+    if (len == 0) {
+      ALOGI("RemoteDisplay(%d) peer closed %d", mSocketFd, fd);
+      _disconnect();
+      return -1;
+    }
+
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr); cmsg;
+         cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+      if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        continue;
+      size_t numFds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      const int* fds = reinterpret_cast<const int*>(CMSG_DATA(cmsg));
+      mMsgFds.insert(mMsgFds.end(), fds, fds + numFds);
+    }
+
+    display_event_t ev;
+    bool valid = len >= (ssize_t)sizeof(ev) && !(hdr.msg_flags & MSG_TRUNC);
+    if (valid) {
+      memcpy(&ev, mPacketBuf.data(), sizeof(ev));
+      valid = ev.size == (size_t)len;
+      if (valid) {
+        _recordRecv(channel, mPacketBuf.data(), len);
+        _dispatch(ev, mPacketBuf.data() + sizeof(ev), len - sizeof(ev));
+      }
+    }
+    for (auto msgFd : mMsgFds) {
+      close(msgFd);
+    }
+    mMsgFds.clear();
+
+    if (!valid) {
+      ALOGE("RemoteDisplay(%d) invalid packet on %d (%zd bytes)", mSocketFd,
+            fd, len);
+      _disconnect();
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int RemoteDisplay::onDisplayEvent() {
+  ALOGV("RemoteDisplay(%d)::%s", mSocketFd, __func__);
+
+  if (mDisconnected)
+    return -1;
+  if (mPacketSocket)
+    return _recvPackets(mSocketFd, CAPTURE_CHANNEL_CONTROL);
+
+  // read until the socket is empty so edge triggered wakeups don't stall
+  while (true) {
+    if (mRecvBuf.size() - mRecvLen < kRecvChunk) {
+      mRecvBuf.resize(mRecvLen + kRecvChunk);
+    }
+
+    if (mRecvCmsgBuf.empty()) {
+      mRecvCmsgBuf.resize(CMSG_SPACE(kMaxFds * sizeof(int)));
+    }
+
+    struct iovec iov;
+    iov.iov_base = mRecvBuf.data() + mRecvLen;
+    iov.iov_len = mRecvBuf.size() - mRecvLen;
+
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = mRecvCmsgBuf.data();
+    hdr.msg_controllen = mRecvCmsgBuf.size();
+
+    ssize_t len = recvmsg(mSocketFd, &hdr, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    if (len < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      ALOGE("RemoteDisplay(%d) recv failed: %s", mSocketFd, strerror(errno));
+      _disconnect();
+      return -1;
+    }
+    if (len == 0) {
+      _disconnect();
+      return -1;
+    }
+
+    if (hdr.msg_flags & MSG_CTRUNC) {
+      ALOGW("RemoteDisplay(%d) received fds truncated", mSocketFd);
+    }
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr); cmsg;
+         cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+      if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        continue;
+      size_t numFds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      const int* fds = reinterpret_cast<const int*>(CMSG_DATA(cmsg));
+      for (size_t i = 0; i < numFds; i++) {
+        mRecvFds.push_back({mRecvOffset + mRecvLen, fds[i]});
+      }
     }
+
+    mRecvLen += len;
+    if (_parseMessages() < 0)
+      return -1;
   }
 
   return 0;
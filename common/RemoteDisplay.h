@@ -26,12 +26,56 @@ Date: 2021.06.09
 #define __REMOTE_DISPLAY_H__
 
 #include <hardware/hwcomposer2.h>
+#include <sys/uio.h>
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <vector>
 
+#include "BufferRegistry.h"
 #include "IRemoteDevice.h"
+#include "PixelCodec.h"
+#include "ProtocolRecorder.h"
+#include "RemoteRequest.h"
+#include "ShmRing.h"
+#include "SpscQueue.h"
 #include "display_protocol.h"
 
+// Changes of one frame, sent as a single DD_EVENT_FRAME_COMMIT when remote
+// supports it or as the legacy request sequence otherwise
+struct FrameCommit {
+  uint32_t frameSeq = 0;
+  std::vector<uint64_t> createdLayers;
+  std::vector<uint64_t> removedLayers;
+  std::vector<layer_info_t> layers;
+  std::vector<layer_buffer_info_t> layerBuffers;
+  // all layers from bottom to top, only set when z order changed
+  std::vector<uint64_t> zOrder;
+  buffer_handle_t fbTarget = nullptr;
+  int fbFence = -1;
+  // parts of fbTarget changed since the last frame sent, empty if unknown
+  std::vector<rect_t> fbDamage;
+  bool rotationChanged = false;
+  int rotation = 0;
+
+  void clear() {
+    createdLayers.clear();
+    removedLayers.clear();
+    layers.clear();
+    layerBuffers.clear();
+    zOrder.clear();
+    fbTarget = nullptr;
+    fbFence = -1;
+    fbDamage.clear();
+    rotationChanged = false;
+  }
+};
+
 class RemoteDisplay {
  public:
   RemoteDisplay(int fd);
@@ -44,6 +88,11 @@ class RemoteDisplay {
   int ydpi() const { return mYDpi; }
   uint32_t flags() const { return mDisplayFlags.value; }
   bool primaryHotplug() const { return mDisplayFlags.primaryHotplug; }
+  // DISPLAY_CAP_* both sides support, known once the display info is acked
+  uint64_t caps() const { return mCaps; }
+  bool hasCap(uint64_t cap) const { return (mCaps & cap) == cap; }
+  const display_caps_t& remoteCaps() const { return mRemoteCaps; }
+  bool supportsFormat(int32_t format) const;
 
   uint64_t getDisplayId() const { return mDisplayId; }
   void setDisplayId(uint64_t id) { mDisplayId = id; }
@@ -57,30 +106,243 @@ class RemoteDisplay {
     return 0;
   }
 
-  // requests sent to remote
-  int getConfigs();
+  // queued bytes above the high water mark are reported as backpressure
+  void setSendHighWater(size_t bytes) { mSendHighWater = bytes; }
+  bool congested() const { return mBackpressure || mCreditStarved; }
+  // true once after congestion cleared, frames skipped meanwhile need a new
+  // composition, or after remote subscribed to other tasks
+  bool refreshNeeded() { return mRefreshNeeded.exchange(false); }
+
+  // Remote grants display_caps_t.maxFramesInFlight credits, capped by
+  // hwc_vhal.max_frames_in_flight, 0 means unbounded. Each frame sent takes
+  // one and its ack returns it. Waits up to timeoutMs for a credit, when
+  // none comes the caller drops the frame and the display is congested
+  // until a credit is back.
+  bool waitFrameCredit(int timeoutMs);
+  // For "latest wins" displays: true while a frame sent is not acked, the
+  // caller then holds the new frame back. The display is congested until
+  // the ack so the latest frame is composed and sent right after it.
+  bool frameUnacked();
+  uint32_t frameCredits() const { return mFrameCredits; }
+
+  // tasks remote subscribed to by DD_EVENT_SUBSCRIBE_TASKS, empty for every
+  // task. True and tasks set once after they changed.
+  bool takeTasks(std::vector<uint32_t>* tasks);
+
+  // requests sent to remote, those taking a RemoteRequestPtr hand out the
+  // request completed by the ack, see DISPLAY_CAP_REQUEST_ID
+  int getConfigs(RemoteRequestPtr* request = nullptr);
+  // references to a buffer shown on remote, it is imported with the first
+  // and removed some time after the last is gone
   int createBuffer(buffer_handle_t buffer);
   int removeBuffer(buffer_handle_t buffer);
-  int displayBuffer(buffer_handle_t buffer);
+  int displayBuffer(buffer_handle_t buffer, int fence = -1);
+  // id remote knows buffer by, 0 if it has none
+  uint64_t bufferId(buffer_handle_t buffer) const {
+    return mBuffers.find(buffer);
+  }
   int setRotation(int rotation);
   int createLayer(uint64_t id);
   int removeLayer(uint64_t id);
-  int updateLayers(std::vector<layer_info_t>& layerInfo);
-  int presentLayers(std::vector<layer_buffer_info_t>& layerBuffer);
+  int updateLayers(const std::vector<layer_info_t>& layerInfo);
+  int presentLayers(const std::vector<layer_buffer_info_t>& layerBuffer);
+  // takeFences hands the fences of frame over, they are closed once sent
+  // instead of being duplicated for the send queue
+  int commitFrame(const FrameCommit& frame,
+                  RemoteRequestPtr* request = nullptr,
+                  bool takeFences = false);
+
+  // Fails requests without an ack after hwc_vhal.request_timeout_ms, a
+  // frame then counts as done. Returns the ms until the next check is due,
+  // -1 if timeouts are off. Call from the socket thread.
+  int expireRequests();
+  // ms a request waits for its ack, 0 or less if timeouts are off
+  static const int kDefaultRequestTimeoutMs = 2000;
+  int requestTimeoutMs() const { return mRequestTimeoutMs; }
+
+  // With hwc_vhal.send_queue (the default) requests are copied to a queue
+  // and the socket thread writes them, callers never wait for the socket.
+  // A caller finding the queue full writes it out itself.
+  // The queue is signalled by a fd handed to
+  // DisplayStatusListener::onChannelCreated. Call before the first request.
+  int setupSendQueue();
 
   // events from remote
   int onDisplayEvent();
+  // socket became writable, flush queued requests
+  int onDisplayWritable();
+  // remote wrote to the shm ring or made room in it
+  int onRingEvent();
+  // a fd reported by DisplayStatusListener::onChannelCreated needs service
+  int onChannelEvent(int fd, bool readable, bool writable);
 
  private:
+  // One protocol message gathered from several pieces, sent by a single
+  // sendmsg() together with its fds
+  struct Message {
+    static const size_t kMaxIov = 4;
+    struct iovec iov[kMaxIov];
+    size_t iovcnt = 0;
+    const int* fds = nullptr;
+    size_t numFds = 0;
+    // fds are fences of the frame being committed, see _takeFence()
+    bool frameFences = false;
+    // fds belong to the message, it closes them once sent or dropped
+    bool ownedFds = false;
+
+    size_t size() const {
+      size_t total = 0;
+      for (size_t i = 0; i < iovcnt; i++) {
+        total += iov[i].iov_len;
+      }
+      return total;
+    }
+    void add(const void* buf, size_t n) {
+      if (n > 0 && iovcnt < kMaxIov) {
+        iov[iovcnt].iov_base = const_cast<void*>(buf);
+        iov[iovcnt].iov_len = n;
+        iovcnt++;
+      }
+    }
+  };
+
+  // bytes the socket didn't accept yet, flushed in order once writable
+  struct PendingMsg {
+    std::vector<uint8_t> data;
+    std::vector<int> fds;  // owned, sent along with the first byte
+    size_t offset = 0;
+  };
+
+  // a connection to remote and the requests it didn't take yet
+  struct Channel {
+    int fd = -1;
+    std::deque<PendingMsg> queue;
+    std::atomic<size_t> queueBytes{0};
+    bool writeWait = false;  // told onSendPending() to poll for writable
+    uint32_t seq = 0;        // messages sent so far
+  };
+
+  // a request on its way to the socket thread, its bytes are in mSendArena
+  static const size_t kSendItemFds = 32;
+  struct SendItem {
+    Channel* ch = nullptr;
+    size_t offset = 0;  // in mSendArena, grows without wrapping
+    size_t size = 0;
+    int fds[kSendItemFds];  // owned
+    size_t numFds = 0;
+  };
+
+  // seq is set to the control message seq after the send
+  int _sendMsg(const Message& msg, uint32_t* seq = nullptr);
+  int _sendMsgLocked(Channel& ch, const Message& msg);
+  int _setupRing();
+  int _setupFrameChannel();
+  int _sendFrameMsg(const Message& msg);
+  int _sendRingMsg(const Message& msg);
+  void _flushRingQueue();
+  // writes msg or queues what the socket doesn't take, mFlushMutex must be
+  // held
+  int _writeMsg(Channel& ch, const Message& msg);
+  // closes the fds of msg if it owns them
+  void _closeFds(const Message& msg);
+  int _copyMsg(const Message& msg, size_t sent, PendingMsg* pending);
+  int _queueMsg(Channel& ch, const Message& msg, size_t sent);
+  int _pushMsg(Channel& ch, const Message& msg);
+  // fd i of msg for a queued copy to own, -1 on failure
+  int _ownFd(const Message& msg, size_t i);
+  // fence of the frame being committed with takeFences, -1 if it isn't one
+  // or was taken already
+  int _takeFence(int fence);
+  int _onSendEvent();
+  // writes out the send queue and flushes the channels, mFlushMutex must be
+  // held
+  int _drainSendQueue();
+  int _flushQueue(Channel& ch);
+  int _recvPackets(int fd, uint32_t channel);
+  void _recordRecv(uint32_t channel, const uint8_t* data, size_t len);
+  void _attachFds(struct msghdr* hdr, const int* fds, size_t numFds);
+  void _updateBackpressure();
+  void _disconnect();
   int _send(const void* buf, size_t n);
-  int _recv(void* buf, size_t n);
-  int _sendFds(int* pfd, size_t fdlen);
-  int onDisplayInfoAck(const display_event_t& ev);
-  int onDisplayBufferAck(const display_event_t& ev);
-  int onPresentLayersAck(const display_event_t& ev);
+  int _sendFds(int* pfd, size_t fdlen, uint32_t* seq = nullptr);
+  bool _inlineFds() const { return hasCap(DISPLAY_CAP_INLINE_FDS); }
+  void _parseCaps(const uint8_t* data, size_t len);
+  int _addFence(int fence);
+  int _importBuffer(buffer_handle_t buffer,
+                    uint64_t id,
+                    bool isNew,
+                    uint64_t freedId);
+  int _sendRemoveBuffer(uint64_t id);
+  // removes idle buffers beyond hwc_vhal.idle_buffers from remote
+  int _evictBuffers();
+  // id of a buffer shown by the frame being sent, importing it if needed
+  uint64_t _bufferId(buffer_handle_t buffer);
+  // copies layer buffers to mLayerBufferScratch with remote buffer ids and
+  // fence indexes
+  void _prepareLayerBuffers(
+      const std::vector<layer_buffer_info_t>& layerBuffer);
+  // as displayBuffer()/presentLayers(), sentId is set to the request id
+  int _displayBuffer(buffer_handle_t buffer, int fence, uint32_t* sentId);
+  int _presentLayers(const std::vector<layer_buffer_info_t>& layerBuffer,
+                     uint32_t* sentId);
+  int _commitFrameLegacy(const FrameCommit& frame, RemoteRequestPtr* request);
+  int _sendFrameCommit(const FrameCommit& frame, RemoteRequestPtr* request);
+  // framebuffer target of a frame waiting for the pixel worker
+  struct PixelFrame {
+    uint32_t frameSeq = 0;
+    uint32_t id = 0;
+    buffer_handle_t buffer = nullptr;
+    int fence = -1;  // owned
+    std::vector<rect_t> damage;  // empty if unknown
+  };
+  int _sendPixels(const FrameCommit& frame, RemoteRequestPtr* request);
+  void _pixelThread();
+  // -EAGAIN if the frame can't be sent now, other errors won't go away
+  int _encodePixels(const PixelFrame& frame);
+  void _damageRects(const std::vector<rect_t>& damage,
+                    uint32_t width,
+                    uint32_t height);
+  uint32_t _nextRequestId();
+  // returns the id for the request header, withId is false when the
+  // requests of the frame pick their own
+  uint32_t _trackFrame(uint32_t frameSeq,
+                       uint32_t ackType,
+                       bool withId,
+                       RemoteRequestPtr* request);
+  // records the id of the request whose ack completes a legacy frame
+  void _setFrameId(uint32_t frameSeq, uint32_t ackType, uint32_t id);
+  // logs percentiles of present to ack latency, sorts samples
+  void _reportLatency(std::vector<int64_t>& samples);
+  void _frameAcked(uint32_t ackType, uint32_t frameSeq, uint32_t id);
+  void _failRequests(int status);
+  // completes frameSeq and frames before it which never reach remote
+  void _failFrame(uint32_t frameSeq, int status);
+  void _appendSection(uint32_t type, const void* data, size_t size);
+  size_t _beginSection(uint32_t type);
+  void _endSection(size_t offset);
+  void _appendLayerDelta(const layer_info_t& info, uint32_t mask);
+  int _parseMessages();
+  int _dispatch(const display_event_t& ev, const uint8_t* data, size_t len);
+  int onDisplayInfoAck(const display_event_t& ev,
+                       const uint8_t* data,
+                       size_t len);
+  int onDisplayBufferAck(const display_event_t& ev,
+                         const uint8_t* data,
+                         size_t len);
+  int onPresentLayersAck(const display_event_t& ev,
+                         const uint8_t* data,
+                         size_t len);
+  int onFrameCommitAck(const display_event_t& ev,
+                       const uint8_t* data,
+                       size_t len);
+  int onSubscribeTasks(const display_event_t& ev,
+                       const uint8_t* data,
+                       size_t len);
+  int _recvFence(int index);
+  void _notifyPresented(int releaseFence);
 
  private:
-  bool mDisconnected = false;
+  std::atomic<bool> mDisconnected{false};
   uint64_t mDisplayId = 0;
   int mSocketFd = -1;
   DisplayStatusListener* mStatusListener = nullptr;
@@ -93,6 +355,164 @@ class RemoteDisplay {
   uint32_t mYDpi;
 
   display_flags mDisplayFlags = {.value = 0};
+
+  // what this hal implements
+  static const uint64_t kHalCaps = DISPLAY_CAP_INLINE_FDS |
+                                   DISPLAY_CAP_FRAME_COMMIT |
+                                   DISPLAY_CAP_LAYER_DELTA |
+                                   DISPLAY_CAP_SHM_RING |
+                                   DISPLAY_CAP_FRAME_CHANNEL |
+                                   DISPLAY_CAP_REQUEST_ID |
+                                   DISPLAY_CAP_TASK_ROUTING;
+  uint64_t mDisabledCaps = 0;
+  uint64_t mCaps = 0;
+  display_caps_t mRemoteCaps = {};
+
+  // control message scratch for SCM_RIGHTS, reused by every send
+  std::vector<uint8_t> mCmsgBuf;
+  // scratch to encode frame commits, only used from the composition thread
+  std::vector<uint8_t> mMsgBuf;
+  // acquire fences attached to the request being built and the layer
+  // buffers referring to them by index
+  static const size_t kMaxFds = 253;  // SCM_MAX_FD
+  std::vector<int> mFenceFds;
+  // fences commitFrame() was handed, -1 once taken by a queued request
+  std::vector<int> mFrameFences;
+  std::vector<layer_buffer_info_t> mLayerBufferScratch;
+  // buffers created on remote, only used from the composition thread.
+  // createBuffer takes a reference, removeBuffer drops it. Up to
+  // mIdleBuffers without a reference stay imported.
+  static const size_t kDefaultIdleBuffers = 16;
+  BufferRegistry mBuffers;
+  size_t mIdleBuffers = kDefaultIdleBuffers;
+  uint32_t mUseSeq = 0;  // frame being sent
+  // control message the frame being sent waits for, the latest creating
+  // one of its buffers
+  uint32_t mFrameBarrier = 0;
+
+  static const size_t kDefaultSendHighWater = 256 * 1024;
+  // held while building and sending requests
+  std::mutex mSendMutex;
+  // held while writing to the channels and for their queues, by the socket
+  // thread alone when there is a send queue
+  std::mutex mFlushMutex;
+  std::mutex mBackpressureMutex;
+  // requests handed to the socket thread, it writes them out right away so
+  // the queue only fills if that thread is stuck or sends a lot itself.
+  // Their bytes are copied to mSendArena, a ring appended to under
+  // mSendMutex and freed in order by the consumer. A request which doesn't
+  // fit is written by its sender after draining the queue.
+  static const size_t kSendQueueSize = 256;
+  static const size_t kSendArenaSize = 256 * 1024;  // power of 2
+  bool mSendQueueEnabled = true;
+  std::unique_ptr<SpscQueue<SendItem>> mSendQueue;
+  std::vector<uint8_t> mSendArena;
+  size_t mSendArenaHead = 0;
+  std::atomic<size_t> mSendArenaTail{0};
+  int mSendEventFd = -1;
+  std::atomic<size_t> mSendQueueBytes{0};
+  // mSocketFd, control requests and buffers, its seq orders ring records and
+  // frame channel messages against it
+  Channel mControl;
+  // optional SOCK_SEQPACKET connection for frame commits and their acks
+  bool mFrameChannelEnabled = true;
+  Channel mFrameChannel;
+  // mSocketFd is SOCK_SEQPACKET, every message is one packet with its fds
+  bool mPacketSocket = false;
+  static const size_t kMaxPacketSize = 64 * 1024;
+  std::vector<uint8_t> mPacketBuf;
+  size_t mSendHighWater = kDefaultSendHighWater;
+  std::atomic<bool> mBackpressure{false};
+
+  // optional shm ring carrying frame commits and their acks
+  struct RingMsg {
+    std::vector<uint8_t> data;
+    uint32_t socketSeq;
+    uint32_t flags;
+  };
+  static const size_t kDefaultRingSize = 256 * 1024;
+  size_t mRingSize = kDefaultRingSize;
+  std::unique_ptr<ShmRing> mRing;
+  std::deque<RingMsg> mRingQueue;
+  std::atomic<size_t> mRingQueueBytes{0};
+  std::vector<uint8_t> mRingRecvBuf;
+
+  // bytes received from remote and not parsed as a full message yet
+  static const size_t kRecvChunk = 4096;
+  static const size_t kMaxMessageSize = 1024 * 1024;
+  std::vector<uint8_t> mRecvBuf;
+  size_t mRecvLen = 0;
+  // fds received along with the stream, each is handed to the message
+  // containing the byte it arrived with
+  struct RecvFd {
+    uint64_t offset;
+    int fd;
+  };
+  std::vector<uint8_t> mRecvCmsgBuf;
+  std::deque<RecvFd> mRecvFds;
+  uint64_t mRecvOffset = 0;  // stream offset of mRecvBuf[0]
+  std::vector<int> mMsgFds;  // fds of the message being dispatched
+  std::vector<layer_buffer_info_t> mAckLayers;
+
+  // frames sent and the ack which completes each of them, in send order
+  struct InflightFrame {
+    uint32_t frameSeq;
+    uint32_t ackType;
+    uint32_t id;  // 0 matches acks by type and frameSeq only
+    std::chrono::steady_clock::time_point sent;
+    std::chrono::steady_clock::time_point deadline;
+    RemoteRequestPtr request;
+  };
+  // remote is reached by TCP and can't take fds, frames are sent as pixels.
+  // A worker waits for rendering and encodes them, off the composition
+  // thread. A frame it hasn't picked up yet is replaced by the next one.
+  static const int kFenceTimeoutMs = 1000;
+  static const size_t kMaxDamageRects = 16;
+  bool mPixelTransport = false;
+  std::thread mPixelWorker;
+  std::mutex mPixelMutex;
+  std::condition_variable mPixelCond;
+  bool mPixelStop = false;
+  bool mPixelPending = false;
+  PixelFrame mPixelFrame;
+  uint32_t mPixelFrameSeq = 0;  // hwc1 frames, hwc2 numbers its own
+  // used by the worker only
+  bool mPixelsSent = false;
+  // of the framebuffer target, checked on the first frame. -1 can't be
+  // sent, every frame fails.
+  int32_t mPixelFormat = 0;
+  uint32_t mPixelWidth = 0;
+  uint32_t mPixelHeight = 0;
+  PixelCodec mPixelCodec;
+  std::vector<rect_t> mDamageScratch;
+  std::vector<uint8_t> mPixelBuf;
+
+  // capture of the connection when hwc_vhal.record_dir is set
+  ProtocolRecorder mRecorder;
+
+  std::mutex mInflightMutex;
+  std::condition_variable mCreditCond;
+  std::deque<InflightFrame> mInflightFrames;
+  // present to ack latency in ns of frames acked, logged every
+  // hwc_vhal.latency_report frames, 0 doesn't record it
+  size_t mLatencyReport = 0;
+  std::vector<int64_t> mAckLatency;
+  // the frame remote shows, buffers it refers to stay imported
+  bool mFrameTracked = false;
+  bool mFrameAcked = false;
+  uint32_t mAckedSeq = 0;
+  int mRequestTimeoutMs = kDefaultRequestTimeoutMs;
+  std::atomic<uint32_t> mRequestId{0};
+  RemoteRequestPtr mConfigRequest;
+  std::chrono::steady_clock::time_point mConfigDeadline;
+  uint32_t mMaxFramesInFlight = 0;
+  uint32_t mFrameCredits = 0;
+  std::atomic<bool> mCreditStarved{false};
+  std::atomic<bool> mRefreshNeeded{false};
+
+  std::mutex mTaskMutex;
+  std::vector<uint32_t> mTasks;
+  bool mTasksChanged = false;
 };
 
 #endif  // __REMOTE_DISPLAY_H__
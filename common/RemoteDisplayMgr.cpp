@@ -27,7 +27,11 @@ Date: 2021.06.09
 //#define LOG_NDEBUG 0
 
 #include <cutils/log.h>
+#include <cutils/properties.h>
 
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/epoll.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
@@ -43,6 +47,12 @@ RemoteDisplayMgr::~RemoteDisplayMgr() {
   if (mServerFd >= 0) {
     close(mServerFd);
   }
+  if (mSeqPacketServerFd >= 0) {
+    close(mSeqPacketServerFd);
+  }
+  if (mTcpServerFd >= 0) {
+    close(mTcpServerFd);
+  }
   if (mWorkerEventReadPipeFd >= 0) {
     close(mWorkerEventReadPipeFd);
   }
@@ -55,11 +65,13 @@ int RemoteDisplayMgr::init(IRemoteDevice* dev) {
 
   return -1;
 
-  mEpollFd = epoll_create(kMaxEvents);
-  if (mEpollFd == -1) {
-    ALOGE("epoll_create:%s", strerror(errno));
+  char value[PROPERTY_VALUE_MAX];
+  property_get("hwc_vhal.event_loop", value, "epoll");
+  mEventLoop = EventLoop::create(value);
+  if (!mEventLoop) {
     return -1;
   }
+  ALOGI("Remote display events by %s", mEventLoop->name());
 
   mHwcDevice = std::unique_ptr<IRemoteDevice>(dev);
   mMaxConnections = mHwcDevice->getMaxRemoteDisplayCount();
@@ -74,7 +86,7 @@ int RemoteDisplayMgr::init(IRemoteDevice* dev) {
   mWorkerEventReadPipeFd = workerEventFds[0];
   mWorkerEventWritePipeFd = workerEventFds[1];
   setNonblocking(mWorkerEventReadPipeFd);
-  addEpollFd(mWorkerEventReadPipeFd);
+  addPollFd(mWorkerEventReadPipeFd);
 
   mSocketThread = std::unique_ptr<std::thread>(
       new std::thread(&RemoteDisplayMgr::socketThreadProc, this));
@@ -82,16 +94,18 @@ int RemoteDisplayMgr::init(IRemoteDevice* dev) {
   return 0;
 }
 
-int RemoteDisplayMgr::addRemoteDisplay(int fd) {
+int RemoteDisplayMgr::addRemoteDisplay(int fd, RemoteRequestPtr* request) {
   ALOGV("%s(%d)", __func__, fd);
 
   setNonblocking(fd);
-  addEpollFd(fd);
+  addPollFd(fd);
 
   mRemoteDisplays.emplace(fd, fd);
   auto& remote = mRemoteDisplays.at(fd);
   remote.setDisplayStatusListener(this);
-  if (remote.getConfigs() < 0) {
+  // composition never waits for the socket, this thread writes to it
+  remote.setupSendQueue();
+  if (remote.getConfigs(request) < 0) {
     ALOGE("Failed to init remote display!");
     return -1;
   }
@@ -101,7 +115,15 @@ int RemoteDisplayMgr::addRemoteDisplay(int fd) {
 int RemoteDisplayMgr::removeRemoteDisplay(int fd) {
   ALOGV("%s(%d)", __func__, fd);
 
-  delEpollFd(fd);
+  delPollFd(fd);
+  for (auto it = mChannelFds.begin(); it != mChannelFds.end();) {
+    if (it->second == fd) {
+      delPollFd(it->first);
+      it = mChannelFds.erase(it);
+    } else {
+      ++it;
+    }
+  }
 
   if (mRemoteDisplays.find(fd) != mRemoteDisplays.end()) {
     mHwcDevice->removeRemoteDisplay(&mRemoteDisplays.at(fd));
@@ -136,23 +158,32 @@ int RemoteDisplayMgr::connectToRemote() {
     mClientFd = -1;
     return -1;
   }
-  if (mClientFd >= 0) {
-    addRemoteDisplay(mClientFd);
+  RemoteRequestPtr request;
+  addRemoteDisplay(mClientFd, &request);
+  int timeoutMs = mRemoteDisplays.at(mClientFd).requestTimeoutMs();
+  if (timeoutMs <= 0) {
+    // timeouts are off for requests, not for this wait
+    timeoutMs = RemoteDisplay::kDefaultRequestTimeoutMs;
   }
+  lck.unlock();
 
-  // wait the display config ready
-  mClientConnected.wait(lck);
+  // wait the display config ready, bounded by the request timeout
+  if (!request || !request->wait(timeoutMs) || request->status() < 0) {
+    ALOGE("Remote didn't send its display config");
+    onDisconnect(mClientFd);
+    mClientFd = -1;
+    return -1;
+  }
   return 0;
 }
 
 int RemoteDisplayMgr::onConnect(int fd) {
-  std::unique_lock<std::mutex> lck(mConnectionMutex);
-
+  // from the socket thread handling the display info ack, mConnectionMutex
+  // is held
   if (mRemoteDisplays.find(fd) != mRemoteDisplays.end()) {
     ALOGI("Remote Display %d connected", fd);
     mHwcDevice->addRemoteDisplay(&mRemoteDisplays.at(fd));
   }
-  mClientConnected.notify_all();
   return 0;
 }
 
@@ -162,11 +193,26 @@ int RemoteDisplayMgr::onDisconnect(int fd) {
   std::unique_lock<std::mutex> lk(mWorkerMutex);
 
   mPendingRemoveDisplays.push_back(fd);
-  // notify the epoll thread
+  // notify the socket thread
   write(mWorkerEventWritePipeFd, "D", 1);
   return 0;
 }
 
+int RemoteDisplayMgr::onSendPending(int fd, bool pending) {
+  ALOGV("%s(%d): %d", __func__, fd, pending);
+
+  return modPollFd(fd, pending ? (EPOLLIN | EPOLLOUT) : EPOLLIN);
+}
+
+int RemoteDisplayMgr::onChannelCreated(int fd, int channelFd) {
+  ALOGV("%s(%d): %d", __func__, fd, channelFd);
+
+  // called while adding the remote or handling its display info ack, both
+  // with mConnectionMutex held
+  mChannelFds[channelFd] = fd;
+  return addPollFd(channelFd);
+}
+
 int RemoteDisplayMgr::setNonblocking(int fd) {
   int flag = 1;
   if (ioctl(fd, FIONBIO, &flag) < 0) {
@@ -176,93 +222,174 @@ int RemoteDisplayMgr::setNonblocking(int fd) {
   return 0;
 }
 
-int RemoteDisplayMgr::addEpollFd(int fd) {
-  struct epoll_event ev;
-
-  ev.events = EPOLLIN;
-  ev.data.fd = fd;
-  if (epoll_ctl(mEpollFd, EPOLL_CTL_ADD, fd, &ev) == -1) {
-    ALOGE("epoll_ctl add fd %d:%s", fd, strerror(errno));
+int RemoteDisplayMgr::addPollFd(int fd) {
+  if (mEventLoop->add(fd, EPOLLIN) < 0) {
     exit(EXIT_FAILURE);
   }
   return 0;
 }
 
-int RemoteDisplayMgr::delEpollFd(int fd) {
-  struct epoll_event ev;
+int RemoteDisplayMgr::modPollFd(int fd, uint32_t events) {
+  return mEventLoop->mod(fd, events);
+}
 
-  ev.events = EPOLLIN;
-  ev.data.fd = fd;
-  if (epoll_ctl(mEpollFd, EPOLL_CTL_DEL, fd, &ev) == -1) {
-    ALOGE("epoll_ctl del fd %d:%s", fd, strerror(errno));
+int RemoteDisplayMgr::delPollFd(int fd) {
+  if (mEventLoop->del(fd) < 0) {
     exit(EXIT_FAILURE);
   }
   return 0;
 }
 
-void RemoteDisplayMgr::socketThreadProc() {
-  mServerFd = socket(AF_UNIX, SOCK_STREAM, 0);
-  if (mServerFd < 0) {
-    ALOGE("Failed to create server socket");
-    return;
+int RemoteDisplayMgr::listenTcp() {
+  char value[PROPERTY_VALUE_MAX];
+  int port = 0;
+  if (property_get("hwc_vhal.tcp_port", value, nullptr)) {
+    port = atoi(value);
+  }
+  if (port <= 0)
+    return 0;
+  // loopback unless the remote is in another network namespace or VM
+  property_get("hwc_vhal.tcp_addr", value, "127.0.0.1");
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  if (inet_pton(AF_INET, value, &addr.sin_addr) != 1) {
+    ALOGE("Invalid tcp address %s", value);
+    return -1;
+  }
+
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    ALOGE("Failed to create tcp server socket");
+    return -1;
+  }
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      listen(fd, 1) < 0) {
+    ALOGE("Failed to listen on %s:%d: %s", value, port, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  setNonblocking(fd);
+  addPollFd(fd);
+  mTcpServerFd = fd;
+  ALOGI("Listen for pixel remotes on %s:%d", value, port);
+  return 0;
+}
+
+void RemoteDisplayMgr::acceptRemote(int serverFd) {
+  // one wakeup may stand for several connections with io_uring polls
+  while (true) {
+    int clientFd = accept(serverFd, nullptr, nullptr);
+    if (clientFd < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        ALOGE("Failed to accept client connection");
+      }
+      return;
+    }
+    if (serverFd == mTcpServerFd) {
+      // acks are small and latency bound
+      int on = 1;
+      setsockopt(clientFd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+    if (mHwcDevice->getRemoteDisplayCount() < mMaxConnections) {
+      addRemoteDisplay(clientFd);
+    } else {
+      ALOGD("Can't accept more than %d remote displays!", mMaxConnections);
+      close(clientFd);
+    }
   }
+}
 
-  setNonblocking(mServerFd);
-  addEpollFd(mServerFd);
+int RemoteDisplayMgr::listenUnix(const char* path, int type) {
+  int fd = socket(AF_UNIX, type, 0);
+  if (fd < 0) {
+    ALOGE("Failed to create server socket %s", path);
+    return -1;
+  }
 
   struct sockaddr_un addr;
   memset(&addr, 0, sizeof(addr));
   addr.sun_family = AF_UNIX;
-  strncpy(&addr.sun_path[0], kServerSock, strlen(kServerSock));
+  strncpy(&addr.sun_path[0], path, strlen(path));
 
-  unlink(kServerSock);
-  if (bind(mServerFd, (struct sockaddr*)&addr,
-           sizeof(sa_family_t) + strlen(kServerSock) + 1) < 0) {
-    ALOGE("Failed to bind server socket address");
-    return;
+  unlink(path);
+  if (bind(fd, (struct sockaddr*)&addr,
+           sizeof(sa_family_t) + strlen(path) + 1) < 0) {
+    ALOGE("Failed to bind server socket address %s", path);
+    close(fd);
+    return -1;
   }
 
   // TODO: use group access only for security
   struct stat st;
   __mode_t mod = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
-  if (fstat(mServerFd, &st) == 0) {
+  if (fstat(fd, &st) == 0) {
     mod |= st.st_mode;
   }
-  chmod(kServerSock, mod);
+  chmod(path, mod);
+
+  if (listen(fd, 1) < 0) {
+    ALOGE("Failed to listen on server socket %s", path);
+    close(fd);
+    return -1;
+  }
+  setNonblocking(fd);
+  addPollFd(fd);
+  return fd;
+}
 
-  if (listen(mServerFd, 1) < 0) {
-    ALOGE("Failed to listen on server socket");
+void RemoteDisplayMgr::socketThreadProc() {
+  mServerFd = listenUnix(kServerSock, SOCK_STREAM);
+  if (mServerFd < 0)
     return;
+
+  // remotes connecting here get one message per packet, no stream framing
+  char value[PROPERTY_VALUE_MAX];
+  property_get("hwc_vhal.seqpacket", value, "0");
+  if (atoi(value)) {
+    mSeqPacketServerFd = listenUnix(kSeqPacketServerSock, SOCK_SEQPACKET);
   }
+  listenTcp();
 
+  std::unique_lock<std::mutex> lck(mConnectionMutex);
   while (true) {
-    struct epoll_event events[kMaxEvents];
-    int nfds = epoll_wait(mEpollFd, events, kMaxEvents, -1);
+    // wake up in time to fail requests remote didn't ack
+    int timeoutMs = -1;
+    for (auto& it : mRemoteDisplays) {
+      auto& remote = it.second;
+      int ms = remote.expireRequests();
+      if (ms >= 0 && (timeoutMs < 0 || ms < timeoutMs)) {
+        timeoutMs = ms;
+      }
+      if (remote.refreshNeeded()) {
+        mHwcDevice->refreshRemoteDisplay(&remote);
+      }
+    }
+
+    // connectToRemote adds a remote meanwhile
+    lck.unlock();
+    EventLoop::Event events[kMaxEvents];
+    int nfds = mEventLoop->wait(events, kMaxEvents, timeoutMs);
+    lck.lock();
     if (nfds < 0) {
       nfds = 0;
       if (errno != EINTR) {
-        ALOGE("epoll_wait:%s", strerror(errno));
+        ALOGE("%s wait:%s", mEventLoop->name(), strerror(errno));
       }
     }
 
     for (int n = 0; n < nfds; ++n) {
-      if (events[n].data.fd == mServerFd) {
-        struct sockaddr_un addr;
-        socklen_t sockLen;
-        int clientFd = -1;
-
-        clientFd = accept(mServerFd, (struct sockaddr*)&addr, &sockLen);
-        if (clientFd < 0) {
-          ALOGE("Failed to accept client connection");
-          break;
-        }
-        if (mHwcDevice->getRemoteDisplayCount() < mMaxConnections) {
-          addRemoteDisplay(clientFd);
-        } else {
-          ALOGD("Can't accept more than %d remote displays!", mMaxConnections);
-          close(clientFd);
-        }
-      } else if (events[n].data.fd == mWorkerEventReadPipeFd) {
+      if (events[n].fd == mServerFd ||
+          events[n].fd == mSeqPacketServerFd ||
+          events[n].fd == mTcpServerFd) {
+        acceptRemote(events[n].fd);
+      } else if (events[n].fd == mWorkerEventReadPipeFd) {
         char buf[16];
         read(mWorkerEventReadPipeFd, buf, sizeof(buf));
 
@@ -271,15 +398,41 @@ void RemoteDisplayMgr::socketThreadProc() {
           removeRemoteDisplay(fd);
         }
         mPendingRemoveDisplays.clear();
+      } else if (mChannelFds.count(events[n].fd)) {
+        int fd = mChannelFds.at(events[n].fd);
+        if (mRemoteDisplays.find(fd) != mRemoteDisplays.end()) {
+          auto& remote = mRemoteDisplays.at(fd);
+          remote.onChannelEvent(
+              events[n].fd,
+              events[n].events & (EPOLLIN | EPOLLHUP | EPOLLERR),
+              events[n].events & EPOLLOUT);
+          if (remote.refreshNeeded()) {
+            mHwcDevice->refreshRemoteDisplay(&remote);
+          }
+        }
       } else {
-        int fd = events[n].data.fd;
+        int fd = events[n].fd;
         if (mRemoteDisplays.find(fd) != mRemoteDisplays.end()) {
-          mRemoteDisplays.at(fd).onDisplayEvent();
+          auto& remote = mRemoteDisplays.at(fd);
+          if (events[n].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+            remote.onDisplayEvent();
+            // an ack returned the credit a dropped or held frame waited for
+            if (remote.refreshNeeded()) {
+              mHwcDevice->refreshRemoteDisplay(&remote);
+            }
+          }
+          if (events[n].events & EPOLLOUT) {
+            remote.onDisplayWritable();
+            // frames skipped under backpressure need a new composition
+            if (remote.refreshNeeded()) {
+              mHwcDevice->refreshRemoteDisplay(&remote);
+            }
+          }
         } else {
           // This shouldn't happen, something is wrong if go here
-          ALOGE("No remote display for %d", events[n].data.fd);
-          delEpollFd(events[n].data.fd);
-          close(events[n].data.fd);
+          ALOGE("No remote display for %d", events[n].fd);
+          delPollFd(events[n].fd);
+          close(events[n].fd);
         }
       }
     }
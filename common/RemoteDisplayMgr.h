@@ -26,12 +26,13 @@ Date: 2021.06.09
 #ifndef __REMOTE_DISPLAY_MGR_H__
 #define __REMOTE_DISPLAY_MGR_H__
 
-#include <condition_variable>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <thread>
 #include <vector>
 
+#include "EventLoop.h"
 #include "IRemoteDevice.h"
 #include "RemoteDisplay.h"
 
@@ -47,28 +48,41 @@ class RemoteDisplayMgr : public DisplayStatusListener {
   // DisplayStatusListener
   int onConnect(int fd) override;
   int onDisconnect(int fd) override;
+  int onSendPending(int fd, bool pending) override;
+  int onChannelCreated(int fd, int channelFd) override;
 
  private:
-  int addRemoteDisplay(int fd);
+  int addRemoteDisplay(int fd, RemoteRequestPtr* request = nullptr);
   int removeRemoteDisplay(int fd);
   void socketThreadProc();
   void workerThreadProc();
+  int listenUnix(const char* path, int type);
+  int listenTcp();
+  void acceptRemote(int serverFd);
 
   int setNonblocking(int fd);
-  int addEpollFd(int fd);
-  int delEpollFd(int fd);
+  int addPollFd(int fd);
+  int modPollFd(int fd, uint32_t events);
+  int delPollFd(int fd);
 
  private:
   const char* kClientSock = "/ipc/display-sock";
   const char* kServerSock = "/ipc/hwc-sock";
+  const char* kSeqPacketServerSock = "/ipc/hwc-seqsock";
 
   std::unique_ptr<IRemoteDevice> mHwcDevice;
   int mClientFd = -1;
+  // guards mRemoteDisplays and mChannelFds, the socket thread holds it but
+  // while waiting for events
   std::mutex mConnectionMutex;
-  std::condition_variable mClientConnected;
 
   std::unique_ptr<std::thread> mSocketThread;
   int mServerFd = -1;
+  // optional SOCK_SEQPACKET listener, enabled by hwc_vhal.seqpacket
+  int mSeqPacketServerFd = -1;
+  // optional TCP listener for remotes which can't take fds, see
+  // DD_EVENT_DISPLAY_PIXELS
+  int mTcpServerFd = -1;
   int mMaxConnections = 2;
 
   std::vector<int> mPendingRemoveDisplays;
@@ -77,7 +91,10 @@ class RemoteDisplayMgr : public DisplayStatusListener {
   int mWorkerEventWritePipeFd = -1;
 
   std::map<int, RemoteDisplay> mRemoteDisplays;
-  static const int kMaxEvents = 10;
-  int mEpollFd = -1;
+  // shm ring eventfds and frame channels to the socket of their display
+  std::map<int, int> mChannelFds;
+  // a dozen remotes each with a socket and a channel fit in one wait
+  static const int kMaxEvents = 32;
+  std::unique_ptr<EventLoop> mEventLoop;
 };
 #endif  //__REMOTE_DISPLAY_MGR_H__
@@ -0,0 +1,104 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+
+#ifndef __REMOTE_REQUEST_H__
+#define __REMOTE_REQUEST_H__
+
+#include <errno.h>
+#include <stdint.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+// A request remote acks, see DISPLAY_CAP_REQUEST_ID. Completed once by its
+// ack, by RemoteDisplay::expireRequests() after the request timeout or when
+// the connection drops, usually on the socket thread.
+class RemoteRequest {
+ public:
+  typedef std::function<void(const RemoteRequest&)> Callback;
+  static const int kPending = 1;
+
+  RemoteRequest(uint32_t id, uint32_t ackType) : mId(id), mAckType(ackType) {}
+
+  // display_event_t.id sent with the request, 0 if remote doesn't echo ids
+  // and for legacy frames, made of several requests
+  uint32_t id() const { return mId; }
+  uint32_t ackType() const { return mAckType; }
+  // 0 once acked, -ETIMEDOUT, -ENOTCONN, kPending until then
+  int status() const {
+    std::unique_lock<std::mutex> lk(mMutex);
+    return mStatus;
+  }
+  bool done() const { return status() != kPending; }
+
+  // false if still pending after timeoutMs, a negative timeout waits until
+  // the request is done
+  bool wait(int timeoutMs) {
+    std::unique_lock<std::mutex> lk(mMutex);
+    auto isDone = [this]() { return mStatus != kPending; };
+    if (timeoutMs < 0) {
+      mCond.wait(lk, isDone);
+    } else {
+      mCond.wait_for(lk, std::chrono::milliseconds(timeoutMs), isDone);
+    }
+    return isDone();
+  }
+
+  // cb runs on the completing thread, right away if already done
+  void setCallback(Callback cb) {
+    std::unique_lock<std::mutex> lk(mMutex);
+    if (mStatus == kPending) {
+      mCallback = std::move(cb);
+      return;
+    }
+    lk.unlock();
+    cb(*this);
+  }
+
+  void complete(int status) {
+    Callback cb;
+    {
+      std::unique_lock<std::mutex> lk(mMutex);
+      if (mStatus != kPending)
+        return;
+      mStatus = status;
+      cb.swap(mCallback);
+      mCond.notify_all();
+    }
+    if (cb) {
+      cb(*this);
+    }
+  }
+
+ private:
+  const uint32_t mId;
+  const uint32_t mAckType;
+  mutable std::mutex mMutex;
+  std::condition_variable mCond;
+  int mStatus = kPending;
+  Callback mCallback;
+};
+
+typedef std::shared_ptr<RemoteRequest> RemoteRequestPtr;
+
+#endif  // __REMOTE_REQUEST_H__
@@ -0,0 +1,236 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/memfd.h>
+#include <cutils/log.h>
+#include <algorithm>
+
+#include "ShmRing.h"
+
+static size_t recordSize(size_t messageSize) {
+  return (sizeof(shm_ring_record_t) + messageSize + 7) & ~(size_t)7;
+}
+
+ShmRing::~ShmRing() {
+  if (mBase) {
+    munmap(mBase, mMapSize);
+  }
+  if (mMemFd >= 0) {
+    close(mMemFd);
+  }
+  if (mTxEventFd >= 0) {
+    close(mTxEventFd);
+  }
+  if (mRxEventFd >= 0) {
+    close(mRxEventFd);
+  }
+}
+
+int ShmRing::create(size_t size) {
+  mSize = 4096;
+  while (mSize < size) {
+    mSize <<= 1;
+  }
+  mMapSize = 2 * sizeof(shm_ring_header_t) + 2 * mSize;
+
+  mMemFd = syscall(__NR_memfd_create, "hwc_vhal_ring",
+                   MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (mMemFd < 0) {
+    ALOGE("ShmRing failed to create memfd: %s", strerror(errno));
+    return -1;
+  }
+  if (ftruncate(mMemFd, mMapSize) < 0) {
+    ALOGE("ShmRing failed to size memfd: %s", strerror(errno));
+    return -1;
+  }
+  // remote must not be able to shrink it under our mapping
+  if (fcntl(mMemFd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) <
+      0) {
+    ALOGW("ShmRing failed to seal memfd: %s", strerror(errno));
+  }
+
+  mTxEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  mRxEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (mTxEventFd < 0 || mRxEventFd < 0) {
+    ALOGE("ShmRing failed to create eventfd: %s", strerror(errno));
+    return -1;
+  }
+  return _map(true);
+}
+
+int ShmRing::attach(int memFd, size_t size, int txEventFd, int rxEventFd) {
+  mMemFd = memFd;
+  mTxEventFd = txEventFd;
+  mRxEventFd = rxEventFd;
+  mSize = size;
+  mMapSize = 2 * sizeof(shm_ring_header_t) + 2 * mSize;
+
+  if (mSize < 4096 || (mSize & (mSize - 1))) {
+    ALOGE("ShmRing invalid ring size %zd", mSize);
+    return -1;
+  }
+  return _map(false);
+}
+
+int ShmRing::_map(bool creator) {
+  void* base =
+      mmap(nullptr, mMapSize, PROT_READ | PROT_WRITE, MAP_SHARED, mMemFd, 0);
+  if (base == MAP_FAILED) {
+    ALOGE("ShmRing failed to map %zd bytes: %s", mMapSize, strerror(errno));
+    return -1;
+  }
+  mBase = (uint8_t*)base;
+
+  shm_ring_header_t* first = (shm_ring_header_t*)mBase;
+  uint8_t* data = mBase + 2 * sizeof(shm_ring_header_t);
+  mTx = creator ? first : first + 1;
+  mRx = creator ? first + 1 : first;
+  mTxData = creator ? data : data + mSize;
+  mRxData = creator ? data + mSize : data;
+  return 0;
+}
+
+size_t ShmRing::maxMessageSize() const {
+  return mSize - sizeof(shm_ring_record_t);
+}
+
+void ShmRing::_copyIn(uint32_t pos, const void* data, size_t len) {
+  size_t offset = pos & (mSize - 1);
+  size_t first = std::min(len, mSize - offset);
+  memcpy(mTxData + offset, data, first);
+  memcpy(mTxData, (const uint8_t*)data + first, len - first);
+}
+
+void ShmRing::_copyOut(uint32_t pos, void* data, size_t len) {
+  size_t offset = pos & (mSize - 1);
+  size_t first = std::min(len, mSize - offset);
+  memcpy(data, mRxData + offset, first);
+  memcpy((uint8_t*)data + first, mRxData, len - first);
+}
+
+void ShmRing::_kick(int fd) {
+  uint64_t one = 1;
+  if (::write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+    ALOGW("ShmRing failed to write eventfd: %s", strerror(errno));
+  }
+}
+
+void ShmRing::clearEvent() {
+  uint64_t count;
+  while (::read(mRxEventFd, &count, sizeof(count)) < 0 && errno == EINTR) {
+  }
+}
+
+int ShmRing::write(const struct iovec* iov,
+                   size_t iovcnt,
+                   uint32_t socketSeq,
+                   uint32_t flags) {
+  size_t len = 0;
+  for (size_t i = 0; i < iovcnt; i++) {
+    len += iov[i].iov_len;
+  }
+  size_t total = recordSize(len);
+  if (len == 0 || total > mSize)
+    return -1;
+
+  uint32_t head = mTx->head;
+  uint32_t used = head - __atomic_load_n(&mTx->tail, __ATOMIC_ACQUIRE);
+  if (used > mSize) {
+    ALOGE("ShmRing corrupted, %u bytes used of %zd", used, mSize);
+    return -1;
+  }
+  if (mSize - used < total) {
+    // ask for a wakeup, then check again in case the consumer just moved
+    __atomic_store_n(&mTx->producerWaiting, 1, __ATOMIC_SEQ_CST);
+    used = head - __atomic_load_n(&mTx->tail, __ATOMIC_SEQ_CST);
+    if (used > mSize || mSize - used < total)
+      return -1;
+    __atomic_store_n(&mTx->producerWaiting, 0, __ATOMIC_RELAXED);
+  }
+
+  shm_ring_record_t record;
+  record.size = len;
+  record.socketSeq = socketSeq;
+  record.flags = flags;
+  record.pad = 0;
+
+  uint32_t pos = head;
+  _copyIn(pos, &record, sizeof(record));
+  pos += sizeof(record);
+  for (size_t i = 0; i < iovcnt; i++) {
+    _copyIn(pos, iov[i].iov_base, iov[i].iov_len);
+    pos += iov[i].iov_len;
+  }
+  static const uint8_t kZeros[8] = {0};
+  _copyIn(pos, kZeros, head + total - pos);
+
+  __atomic_store_n(&mTx->head, head + total, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&mTx->consumerWaiting, __ATOMIC_SEQ_CST)) {
+    _kick(mTxEventFd);
+  }
+  return 0;
+}
+
+ssize_t ShmRing::read(std::vector<uint8_t>& buf, shm_ring_record_t* record) {
+  for (;;) {
+    uint32_t tail = mRx->tail;
+    uint32_t head = __atomic_load_n(&mRx->head, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+      // going to sleep, the producer kicks us for the next record
+      __atomic_store_n(&mRx->consumerWaiting, 1, __ATOMIC_SEQ_CST);
+      head = __atomic_load_n(&mRx->head, __ATOMIC_SEQ_CST);
+      if (head == tail)
+        return 0;
+    }
+    __atomic_store_n(&mRx->consumerWaiting, 0, __ATOMIC_RELAXED);
+
+    uint32_t avail = head - tail;
+    if (avail > mSize || avail < sizeof(*record)) {
+      ALOGE("ShmRing corrupted, %u bytes available of %zd", avail, mSize);
+      return -1;
+    }
+    _copyOut(tail, record, sizeof(*record));
+    size_t total = recordSize(record->size);
+    if (total > avail) {
+      ALOGE("ShmRing record of %u bytes exceeds %u available", record->size,
+            avail);
+      return -1;
+    }
+    buf.resize(record->size);
+    _copyOut(tail + sizeof(*record), buf.data(), record->size);
+
+    __atomic_store_n(&mRx->tail, tail + total, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&mRx->producerWaiting, __ATOMIC_SEQ_CST)) {
+      __atomic_store_n(&mRx->producerWaiting, 0, __ATOMIC_RELAXED);
+      _kick(mTxEventFd);
+    }
+    // 0 would read as empty and stall the records behind it
+    if (record->size)
+      return record->size;
+    ALOGW("ShmRing skipped an empty record");
+  }
+}
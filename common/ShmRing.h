@@ -0,0 +1,82 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+
+#ifndef __SHM_RING_H__
+#define __SHM_RING_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <vector>
+
+#include "display_protocol.h"
+
+// Pair of single producer/single consumer rings in shared memory, see
+// shm_ring_header_t. The side calling create() writes the first ring and
+// reads the second, the side calling attach() the other way around.
+class ShmRing {
+ public:
+  ShmRing() {}
+  ~ShmRing();
+
+  int create(size_t size);
+  int attach(int memFd, size_t size, int txEventFd, int rxEventFd);
+
+  int memFd() const { return mMemFd; }
+  // eventfds this side writes to and waits on, one wakeup serves both new
+  // records and freed room
+  int txEventFd() const { return mTxEventFd; }
+  int rxEventFd() const { return mRxEventFd; }
+  size_t size() const { return mSize; }
+
+  // adds one record, -1 if the ring has no room for it now or it's empty
+  int write(const struct iovec* iov,
+            size_t iovcnt,
+            uint32_t socketSeq,
+            uint32_t flags);
+  // copies the next record into buf, 0 if the ring is empty. Empty
+  // records are skipped.
+  ssize_t read(std::vector<uint8_t>& buf, shm_ring_record_t* record);
+  // drops the pending wakeup, call before reading
+  void clearEvent();
+  // largest message a record can hold
+  size_t maxMessageSize() const;
+
+ private:
+  int _map(bool creator);
+  void _copyIn(uint32_t pos, const void* data, size_t len);
+  void _copyOut(uint32_t pos, void* data, size_t len);
+  void _kick(int fd);
+
+ private:
+  int mMemFd = -1;
+  int mTxEventFd = -1;
+  int mRxEventFd = -1;
+  size_t mSize = 0;
+  uint8_t* mBase = nullptr;
+  size_t mMapSize = 0;
+
+  shm_ring_header_t* mTx = nullptr;
+  shm_ring_header_t* mRx = nullptr;
+  uint8_t* mTxData = nullptr;
+  uint8_t* mRxData = nullptr;
+};
+
+#endif  // __SHM_RING_H__
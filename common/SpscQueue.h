@@ -0,0 +1,81 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+
+#ifndef __SPSC_QUEUE_H__
+#define __SPSC_QUEUE_H__
+
+#include <stddef.h>
+
+#include <atomic>
+#include <utility>
+#include <vector>
+
+// Bounded lock-free queue between one producer and one consumer thread.
+// capacity is rounded up to a power of 2.
+template <typename T>
+class SpscQueue {
+ public:
+  explicit SpscQueue(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    mSlots.resize(size);
+    mMask = size - 1;
+  }
+
+  // producer only, false when full
+  bool push(T&& item) {
+    size_t tail = mTail.load(std::memory_order_relaxed);
+    if (tail - mHead.load(std::memory_order_acquire) > mMask)
+      return false;
+    mSlots[tail & mMask] = std::move(item);
+    mTail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // producer only, a push after false succeeds
+  bool full() const {
+    return mTail.load(std::memory_order_relaxed) -
+               mHead.load(std::memory_order_acquire) >
+           mMask;
+  }
+
+  // consumer only, false when empty
+  bool pop(T* item) {
+    size_t head = mHead.load(std::memory_order_relaxed);
+    if (head == mTail.load(std::memory_order_acquire))
+      return false;
+    *item = std::move(mSlots[head & mMask]);
+    mHead.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+ private:
+  std::vector<T> mSlots;
+  size_t mMask = 0;
+  // head and tail only grow, their difference is the number of items.
+  // Kept apart so the two threads don't share a cache line.
+  std::atomic<size_t> mHead{0};
+  char mPad[64];
+  std::atomic<size_t> mTail{0};
+};
+
+#endif  // __SPSC_QUEUE_H__
@@ -0,0 +1,119 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <cutils/log.h>
+
+#include "SyncTimeline.h"
+
+// uapi of drivers/dma-buf/sw_sync.c, not exported by the kernel headers
+struct sw_sync_create_fence_data {
+  uint32_t value;
+  char name[32];
+  int32_t fence;
+};
+
+#define SW_SYNC_IOC_MAGIC 'W'
+#define SW_SYNC_IOC_CREATE_FENCE \
+  _IOWR(SW_SYNC_IOC_MAGIC, 0, struct sw_sync_create_fence_data)
+#define SW_SYNC_IOC_INC _IOW(SW_SYNC_IOC_MAGIC, 1, uint32_t)
+
+SyncTimeline::SyncTimeline() {}
+
+SyncTimeline::~SyncTimeline() {
+  if (mFd >= 0) {
+    // closing the timeline signals its pending fences
+    close(mFd);
+    mFd = -1;
+  }
+}
+
+int SyncTimeline::init() {
+  static const char* kDevices[] = {
+      "/sys/kernel/debug/sync/sw_sync",
+      "/dev/sw_sync",
+  };
+
+  if (mFd >= 0)
+    return 0;
+
+  for (auto dev : kDevices) {
+    mFd = open(dev, O_RDWR | O_CLOEXEC);
+    if (mFd >= 0) {
+      ALOGD("SyncTimeline use %s", dev);
+      return 0;
+    }
+  }
+  ALOGE("SyncTimeline failed to open sw_sync: %s", strerror(errno));
+  return -1;
+}
+
+int SyncTimeline::createFence(uint32_t point, const char* name) {
+  std::unique_lock<std::mutex> lk(mMutex);
+
+  if (mFd < 0)
+    return -1;
+
+  struct sw_sync_create_fence_data data;
+  memset(&data, 0, sizeof(data));
+  data.value = point;
+  strncpy(data.name, name, sizeof(data.name) - 1);
+  if (ioctl(mFd, SW_SYNC_IOC_CREATE_FENCE, &data) < 0) {
+    ALOGE("SyncTimeline failed to create fence at %u: %s", point,
+          strerror(errno));
+    return -1;
+  }
+  if ((int32_t)(point - mMaxPoint) > 0) {
+    mMaxPoint = point;
+  }
+  return data.fence;
+}
+
+int SyncTimeline::_advance(uint32_t point) {
+  if (mFd < 0)
+    return -1;
+
+  // points wrap around, compare by distance
+  int32_t inc = (int32_t)(point - mValue);
+  if (inc <= 0)
+    return 0;
+
+  uint32_t value = inc;
+  if (ioctl(mFd, SW_SYNC_IOC_INC, &value) < 0) {
+    ALOGE("SyncTimeline failed to advance to %u: %s", point, strerror(errno));
+    return -1;
+  }
+  mValue = point;
+  return 0;
+}
+
+int SyncTimeline::signal(uint32_t point) {
+  std::unique_lock<std::mutex> lk(mMutex);
+  return _advance(point);
+}
+
+int SyncTimeline::signalAll() {
+  std::unique_lock<std::mutex> lk(mMutex);
+  return _advance(mMaxPoint);
+}
@@ -0,0 +1,53 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+
+#ifndef __SYNC_TIMELINE_H__
+#define __SYNC_TIMELINE_H__
+
+#include <stdint.h>
+#include <mutex>
+
+// Software sync timeline (sw_sync), fences created at a point signal once
+// the timeline is advanced to or past it.
+class SyncTimeline {
+ public:
+  SyncTimeline();
+  ~SyncTimeline();
+
+  int init();
+  bool valid() const { return mFd >= 0; }
+  // returns a fence fd signalled at point, -1 on failure
+  int createFence(uint32_t point, const char* name);
+  // advances the timeline to point, earlier points are ignored
+  int signal(uint32_t point);
+  // signals every fence created so far
+  int signalAll();
+
+ private:
+  int _advance(uint32_t point);
+
+ private:
+  int mFd = -1;
+  std::mutex mMutex;
+  uint32_t mValue = 0;     // point the timeline is at
+  uint32_t mMaxPoint = 0;  // highest point a fence was created for
+};
+
+#endif  // __SYNC_TIMELINE_H__
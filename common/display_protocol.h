@@ -40,15 +40,70 @@
 #define DD_EVENT_UPDATE_LAYERS 0x1102
 #define DD_EVENT_PRESENT_LAYERS_REQ 0x1103
 #define DD_EVENT_PRESENT_LAYERS_ACK 0x1104
+#define DD_EVENT_FRAME_COMMIT 0x1105
+#define DD_EVENT_FRAME_COMMIT_ACK 0x1106
+#define DD_EVENT_SETUP_RING 0x1107
+#define DD_EVENT_RING_FDS 0x1108  // fences of a ring record, no payload
+#define DD_EVENT_SETUP_FRAME_CHANNEL 0x1109
+#define DD_EVENT_DISPLAY_PIXELS 0x110a
+#define DD_EVENT_SUBSCRIBE_TASKS 0x110b
 
 // define framebuffer id as the max
 #define LAYER_ID_FRAMEBUFFER 0xffffffffffffffff
 
+// protocol versions reported by remote in display_flags.version, only used
+// to derive the capabilities of remotes which don't send display_caps_t
+#define DISPLAY_VERSION_LEGACY 0
+#define DISPLAY_VERSION_LAYER 1
+// fds are attached (SCM_RIGHTS) to the message carrying them instead of being
+// sent in a separate 16 bytes trailer, remote must recvmsg() every header.
+// Acquire fences come this way too: layer_buffer_info_t.fence is the index of
+// the fence in the attached fds, -1 if the buffer is ready, and a
+// DD_EVENT_DISPLAY_REQ with one fd attached carries the FB acquire fence.
+// Release fences in DD_EVENT_PRESENT_LAYERS_ACK/DD_EVENT_FRAME_COMMIT_ACK are
+// indexes into the fds attached to the ack the same way, a layer without its
+// own fence is released by the ack's releaseFence. Each fence releases the
+// buffer bufferId of layer layerId once the layer shows another one.
+#define DISPLAY_VERSION_INLINE_FDS 2
+// all changes of a frame come in one DD_EVENT_FRAME_COMMIT instead of separate
+// layer/buffer/rotation requests
+#define DISPLAY_VERSION_FRAME_COMMIT 3
+// layer updates in a frame commit only carry changed fields, z order is sent
+// as the list of layers from bottom to top
+#define DISPLAY_VERSION_LAYER_DELTA 4
+// frame commits go through a shared memory ring set up by DD_EVENT_SETUP_RING,
+// the socket still carries everything else
+#define DISPLAY_VERSION_SHM_RING 5
+
+// sections of a frame commit, remote skips the types it doesn't know
+#define FRAME_SECTION_CREATE_LAYERS 1  // uint64_t layerId[]
+#define FRAME_SECTION_REMOVE_LAYERS 2  // uint64_t layerId[]
+#define FRAME_SECTION_UPDATE_LAYERS 3  // layer_info_t[]
+#define FRAME_SECTION_LAYER_BUFFERS 4  // layer_buffer_info_t[]
+#define FRAME_SECTION_FB_TARGET 5      // buffer_info_t
+#define FRAME_SECTION_ROTATION 6       // frame_rotation_t
+#define FRAME_SECTION_LAYER_DELTAS 7   // layer_delta_t records
+#define FRAME_SECTION_Z_ORDER 8        // uint64_t layerId[], bottom to top
+#define FRAME_SECTION_FB_FENCE 9       // frame_fence_t, FB acquire fence
+
+// layer_info_t.changed bits, fields of a layer_delta_t record come in this
+// order with their layer_info_t types
+#define LAYER_CHANGED_TYPE (1 << 0)       // type
+#define LAYER_CHANGED_TASK (1 << 1)       // stackId, taskId, userId, index
+#define LAYER_CHANGED_SRC_CROP (1 << 2)   // srcCrop
+#define LAYER_CHANGED_DST_FRAME (1 << 3)  // dstFrame
+#define LAYER_CHANGED_TRANSFORM (1 << 4)  // transform
+#define LAYER_CHANGED_Z (1 << 5)          // z
+#define LAYER_CHANGED_BLEND (1 << 6)      // blendMode
+#define LAYER_CHANGED_ALPHA (1 << 7)      // planeAlpha
+#define LAYER_CHANGED_COLOR (1 << 8)      // color
+#define LAYER_CHANGED_ALL 0x1ff
+
 typedef struct _display_flags {
   union {
     uint32_t value;
     struct {
-      uint32_t version : 8;  // 0 - legacy, 1 - support layer
+      uint32_t version : 8;  // DISPLAY_VERSION_*
       uint32_t mode : 2;  // 0 - legacy, 1 -layers only, 2 - both fb and layers
       uint32_t primaryHotplug : 1;  // Primary can be configured if request size
                                     // doesnt match default
@@ -70,6 +125,13 @@ typedef struct _display_info_t {
   int numFramebuffers;
 } display_info_t;
 
+// bufferId is the slot of the buffer in the low 32 bits and the slot
+// generation in the high 32 bits. Slots are dense and reused after
+// DD_EVENT_REMOVE_BUFFER with the next generation, 0 is no buffer.
+// Handles gralloc imported for the same dma-buf share one bufferId, remote
+// gets DD_EVENT_CREATE_BUFFER only for the first of them.
+// DD_EVENT_REMOVE_BUFFER comes once no layer uses the buffer and frames
+// showing it are acked, remote can release its import right away.
 typedef struct _buffer_info_t {
   uint64_t bufferId;
   int data[0];  // local handle
@@ -87,6 +149,58 @@ typedef struct _display_info_event_t {
   display_info_t info;
 } display_info_event_t;
 
+// DD_EVENT_DISPINFO_REQ sets display_event_t.pad to the DISPLAY_CAPS_VERSION
+// the hal understands. A remote knowing it appends its display_caps_t to
+// the display_info_t of DD_EVENT_DISPINFO_ACK, features are used when both
+// sides have the bit.
+#define DISPLAY_CAPS_VERSION 1
+
+#define DISPLAY_CAP_INLINE_FDS (1ULL << 0)     // see DISPLAY_VERSION_INLINE_FDS
+#define DISPLAY_CAP_FRAME_COMMIT (1ULL << 1)   // DD_EVENT_FRAME_COMMIT
+#define DISPLAY_CAP_LAYER_DELTA (1ULL << 2)    // FRAME_SECTION_LAYER_DELTAS
+#define DISPLAY_CAP_SHM_RING (1ULL << 3)       // DD_EVENT_SETUP_RING
+#define DISPLAY_CAP_FRAME_CHANNEL (1ULL << 4)  // DD_EVENT_SETUP_FRAME_CHANNEL
+#define DISPLAY_CAP_REQUEST_ID (1ULL << 5)     // see below
+#define DISPLAY_CAP_TASK_ROUTING (1ULL << 6)  // DD_EVENT_SUBSCRIBE_TASKS
+
+// With DISPLAY_CAP_REQUEST_ID every message the hal sends after the display
+// info ack has a sequence number in display_event_t.id, counted from 1 on
+// the connection and never 0. DD_EVENT_DISPLAY_ACK,
+// DD_EVENT_PRESENT_LAYERS_ACK and DD_EVENT_FRAME_COMMIT_ACK carry the id of
+// the request they answer, an ack may stand for earlier requests of the same
+// type too. DD_EVENT_DISPINFO_REQ keeps the container id in the id field.
+
+#define DISPLAY_CAPS_MAX_FORMATS 16
+
+// A remote with DISPLAY_CAP_TASK_ROUTING may send DD_EVENT_SUBSCRIBE_TASKS
+// any time after the display info ack. From the next frame it only gets
+// the layers whose layer_info_t.taskId is listed, with their buffers, and no
+// framebuffer target. Layers leaving the tasks are removed, ones joining are
+// created and updated with all fields. No tasks, the default, is every
+// layer. Ignored in mode 0.
+typedef struct _subscribe_tasks_event_t {
+  display_event_t event;
+  uint32_t numTasks;
+  uint32_t pad;
+  uint32_t taskIds[0];
+} subscribe_tasks_event_t;
+
+typedef struct _display_caps_t {
+  uint32_t version;            // DISPLAY_CAPS_VERSION of the sender
+  uint32_t size;               // bytes sent, fields past it are taken as 0
+  uint64_t caps;               // DISPLAY_CAP_*
+  uint32_t maxLayers;          // 0 - no limit, see below
+  uint32_t maxFramesInFlight;  // frames sent and not acked, 0 - no limit
+  uint32_t numFormats;         // 0 - any format
+  uint32_t pad;
+  int32_t formats[DISPLAY_CAPS_MAX_FORMATS];  // HAL_PIXEL_FORMAT_*
+} display_caps_t;
+
+// In mode 1 frames of a display with more layers than maxLayers, or with a
+// layer buffer of a format not in formats, carry the framebuffer target
+// too. It has every layer composed, remote shows it instead of the layers
+// until frames come without it again. Layers are still updated meanwhile.
+
 typedef struct _buffer_info_event_t {
   display_event_t event;
   buffer_info_t info;
@@ -128,9 +242,15 @@ typedef struct _layer_info_t {
   int32_t blendMode;
   float planeAlpha;
   uint32_t color;
-  uint32_t changed;
+  uint32_t changed;  // LAYER_CHANGED_*
 } layer_info_t;
 
+typedef struct _layer_delta_t {
+  uint64_t layerId;
+  uint32_t mask;  // LAYER_CHANGED_*
+  uint32_t size;  // bytes of fields following this header, multiple of 8
+} layer_delta_t;
+
 typedef struct _update_layers_event_t {
   display_event_t event;
   uint32_t numLayers;
@@ -158,4 +278,110 @@ typedef struct _present_layers_ack_event_t {
   layer_buffer_info_t layers[0];
 } present_layers_ack_event_t;
 
+typedef struct _frame_section_t {
+  uint32_t type;
+  uint32_t size;  // bytes following this header, multiple of 8
+} frame_section_t;
+
+typedef struct _frame_fence_t {
+  int32_t fence;  // index in the fds attached to the commit
+  uint32_t pad;
+} frame_fence_t;
+
+typedef struct _frame_rotation_t {
+  int32_t rotation;
+  uint32_t pad;
+} frame_rotation_t;
+
+// followed by numSections frame_section_t, remote applies them at once in
+// the order they come
+typedef struct _frame_commit_event_t {
+  display_event_t event;
+  uint32_t frameSeq;
+  uint32_t numSections;
+} frame_commit_event_t;
+
+typedef struct _frame_commit_ack_event_t {
+  display_event_t event;
+  uint32_t frameSeq;
+  uint32_t flags;
+  int releaseFence;
+  uint32_t numLayers;
+  layer_buffer_info_t layers[0];
+} frame_commit_ack_event_t;
+
+// Shared memory rings, one each way, in a memfd laid out as
+//   shm_ring_header_t hal_to_remote, remote_to_hal
+//   uint8_t hal_to_remote_data[size], remote_to_hal_data[size]
+// size is a power of 2. A record is a shm_ring_record_t followed by one
+// protocol message, padded to 8 bytes, and may wrap at the end of the data.
+// Records without a message are dropped by the reader.
+// head/tail are free running byte counters. A consumer going to sleep sets
+// consumerWaiting and a producer finding the ring full sets producerWaiting,
+// the other side then writes the eventfd of that direction.
+typedef struct _shm_ring_header_t {
+  uint32_t head;  // written by producer
+  uint32_t producerWaiting;
+  uint32_t pad0[14];
+  uint32_t tail;  // written by consumer
+  uint32_t consumerWaiting;
+  uint32_t pad1[14];
+} shm_ring_header_t;
+
+// the record is handled after socket message number socketSeq (counted from
+// 1 on the connection), its fence indexes refer to that message's fds when
+// flags has SHM_RING_RECORD_FDS
+#define SHM_RING_RECORD_FDS (1 << 0)
+typedef struct _shm_ring_record_t {
+  uint32_t size;  // message bytes after this header
+  uint32_t socketSeq;
+  uint32_t flags;
+  uint32_t pad;
+} shm_ring_record_t;
+
+// fds attached: memfd, eventfd to wake remote, eventfd to wake hal
+typedef struct _ring_setup_event_t {
+  display_event_t event;
+  uint32_t size;  // data bytes of each ring
+  uint32_t flags;
+} ring_setup_event_t;
+
+// DD_EVENT_SETUP_FRAME_CHANNEL has no payload and carries one fd, a
+// SOCK_SEQPACKET socket with one message per packet. Frame commits, their
+// fences and acks move to it so a large commit doesn't hold up control
+// requests and the other way around. The commit is handled after control
+// message number display_event_t.pad (counted from 1 on the connection),
+// the last one creating a buffer it uses, 0 to handle it right away. Not
+// sent when a shm ring is in use.
+
+// Remotes may also connect with SOCK_SEQPACKET (hwc_vhal.seqpacket). Then
+// every message in either direction is one packet of display_event_t.size
+// bytes with its fds attached (DISPLAY_CAP_INLINE_FDS is implied), and no
+// message may exceed 64 KB.
+
+// Remotes connected by TCP can't take fds. They get no buffers, layers or
+// channels: the display runs in mode 0 and every frame is a
+// DD_EVENT_DISPLAY_PIXELS with the damaged parts of the framebuffer target,
+// acked by a DD_EVENT_FRAME_COMMIT_ACK of its frameSeq. The first frame, and
+// any after a size change, covers the whole buffer.
+#define PIXEL_CODEC_RAW 0    // rows of width * 4 bytes
+#define PIXEL_CODEC_RLE32 1  // see PixelCodec.h
+
+typedef struct _pixel_rect_t {
+  rect_t rect;
+  uint32_t codec;  // PIXEL_CODEC_*
+  uint32_t size;   // bytes of pixel data following this header
+} pixel_rect_t;
+
+// followed by numRects pixel_rect_t, each followed by its pixel data
+typedef struct _display_pixels_event_t {
+  display_event_t event;
+  uint32_t frameSeq;
+  int32_t format;  // HAL_PIXEL_FORMAT_*, 4 bytes per pixel
+  uint32_t width;
+  uint32_t height;
+  uint32_t numRects;
+  uint32_t pad;
+} display_pixels_event_t;
+
 #endif  // _H_DISPLAY_PROTOCOL_
@@ -0,0 +1,62 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+
+#ifndef _H_PROTOCOL_CAPTURE_
+#define _H_PROTOCOL_CAPTURE_
+
+#include <stdint.h>
+
+// Capture of the messages of one remote display connection, written by
+// ProtocolRecorder and read by tools/hwc_replay. The file is a
+// capture_header_t followed by records, each a capture_record_t, numFds
+// capture_fd_t and the message of size bytes. Host byte order.
+#define CAPTURE_MAGIC 0x52435748  // "HWCR"
+#define CAPTURE_VERSION 1
+
+#define CAPTURE_DIR_SENT 0  // hal to remote
+#define CAPTURE_DIR_RECV 1  // remote to hal
+
+#define CAPTURE_CHANNEL_CONTROL 0  // the display socket
+#define CAPTURE_CHANNEL_FRAME 1    // DD_EVENT_SETUP_FRAME_CHANNEL socket
+#define CAPTURE_CHANNEL_RING 2     // DD_EVENT_SETUP_RING shm ring
+
+typedef struct _capture_header_t {
+  uint32_t magic;
+  uint32_t version;
+  int64_t startTime;  // CLOCK_REALTIME ns when capture started
+} capture_header_t;
+
+typedef struct _capture_record_t {
+  int64_t timestamp;  // CLOCK_MONOTONIC ns since capture started
+  uint8_t direction;
+  uint8_t channel;
+  uint16_t numFds;
+  uint32_t size;
+} capture_record_t;
+
+// what the fd was, the fd itself is gone once the capture is read
+typedef struct _capture_fd_t {
+  uint32_t mode;  // st_mode & S_IFMT
+  uint32_t pad;
+  uint64_t ino;   // same ino in a capture is the same file
+  uint64_t size;  // st_size, or the dma-buf size
+} capture_fd_t;
+
+#endif  // _H_PROTOCOL_CAPTURE_
@@ -158,6 +158,15 @@ int Hwc1Device::getRemoteDisplayCount() {
   }
   return count;
 }
+int Hwc1Device::refreshRemoteDisplay(RemoteDisplay* rd) {
+  if (!rd)
+    return -1;
+
+  if (mCbProcs && mCbProcs->invalidate) {
+    mCbProcs->invalidate(mCbProcs);
+  }
+  return 0;
+}
 
 int Hwc1Device::prepare(size_t numDisplays,
                         hwc_display_contents_1_t** displays) {
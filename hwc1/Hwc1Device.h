@@ -59,6 +59,7 @@ class Hwc1Device : public hwc_composer_device_1_t, public IRemoteDevice {
   int removeRemoteDisplay(RemoteDisplay* rd) override;
   int getMaxRemoteDisplayCount() override;
   int getRemoteDisplayCount() override;
+  int refreshRemoteDisplay(RemoteDisplay* rd) override;
 
  private:
   void workerThreadProc();
@@ -63,6 +63,13 @@ Error Hwc2Device::init() {
     ALOGE("Failed to create remote display manager, out of memory");
     return Error::NoResources;
   }
+  // remotes joining while primary is attached mirror it instead of adding
+  // displays
+  char value[PROPERTY_VALUE_MAX];
+  if (property_get("hwc_vhal.mirror", value, nullptr)) {
+    mMirror = atoi(value) != 0;
+  }
+
   mRemoteDisplayMgr->init(this);
   if (mRemoteDisplayMgr->connectToRemote() < 0) {
     mDisplays.emplace(kPrimayDisplay, 0);
@@ -120,6 +127,12 @@ int Hwc2Device::addRemoteDisplay(RemoteDisplay* rd) {
       mDisplays.at(kPrimayDisplay).attach(rd);
       onHotplug(kPrimayDisplay, true);
     }
+  } else if (mMirror && mDisplays.find(kPrimayDisplay) != mDisplays.end() &&
+             mDisplays.at(kPrimayDisplay).addMirror(rd) == 0) {
+    ALOGD("%s: mirror %" PRIu64, __func__, kPrimayDisplay);
+
+    rd->setDisplayId(kPrimayDisplay);
+    onRefresh(kPrimayDisplay);
   } else {
     auto id = sNextId++;
     ALOGD("%s: add new display %" PRIu64, __func__, id);
@@ -165,7 +178,20 @@ int Hwc2Device::getMaxRemoteDisplayCount() {
 int Hwc2Device::getRemoteDisplayCount() {
   ALOGV("%s", __func__);
 
-  return mDisplays.size() - 1;
+  // mirrors take a connection as well
+  std::unique_lock<std::mutex> lk(mDisplayMutex);
+  size_t count = 0;
+  for (auto& display : mDisplays) {
+    count += display.second.remoteCount();
+  }
+  return count;
+}
+int Hwc2Device::refreshRemoteDisplay(RemoteDisplay* rd) {
+  if (!rd)
+    return -1;
+
+  onRefresh(rd->getDisplayId());
+  return 0;
 }
 
 Error Hwc2Device::createVirtualDisplay(uint32_t width,
@@ -400,8 +426,9 @@ hwc2_function_pointer_t Hwc2Device::getFunctionHook(struct hwc2_device* dev,
                     &Hwc2Layer::setBlendMode, int32_t>);
     case FunctionDescriptor::SetLayerBuffer:
       return asFP<HWC2_PFN_SET_LAYER_BUFFER>(
-          LayerHook<decltype(&Hwc2Layer::setBuffer), &Hwc2Layer::setBuffer,
-                    buffer_handle_t, int32_t>);
+          DisplayHook<decltype(&Hwc2Display::setLayerBuffer),
+                      &Hwc2Display::setLayerBuffer, hwc2_layer_t,
+                      buffer_handle_t, int32_t>);
     case FunctionDescriptor::SetLayerColor:
       return asFP<HWC2_PFN_SET_LAYER_COLOR>(
           LayerHook<decltype(&Hwc2Layer::setColor), &Hwc2Layer::setColor,
@@ -60,6 +60,7 @@ class Hwc2Device : public hwc2_device_t, public IRemoteDevice {
   int removeRemoteDisplay(RemoteDisplay* rd) override;
   int getMaxRemoteDisplayCount() override;
   int getRemoteDisplayCount() override;
+  int refreshRemoteDisplay(RemoteDisplay* rd) override;
 
  public:
   static Hwc2Device* toHwc2Device(hwc2_device_t* dev) {
@@ -143,6 +144,7 @@ class Hwc2Device : public hwc2_device_t, public IRemoteDevice {
 
   std::map<hwc2_display_t, Hwc2Display> mDisplays;
   std::mutex mDisplayMutex;
+  bool mMirror = false;
 
   std::unique_ptr<RemoteDisplayMgr> mRemoteDisplayMgr;
 };
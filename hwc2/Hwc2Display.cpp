@@ -29,6 +29,9 @@ Date: 2021.06.09
 
 #include <errno.h>
 #include <inttypes.h>
+#include <string.h>
+
+#include <algorithm>
 
 #include <cutils/log.h>
 #include <cutils/properties.h>
@@ -51,7 +54,7 @@ using namespace HWC2;
 #define LAYER_TRACE(...)
 #endif
 
-Hwc2Display::Hwc2Display(hwc2_display_t id) {
+Hwc2Display::Hwc2Display(hwc2_display_t id) : mFbtRefs(kMaxFbtBuffers) {
   ALOGD("%s", __func__);
   mDisplayID = id;
 
@@ -73,6 +76,19 @@ Hwc2Display::Hwc2Display(hwc2_display_t id) {
     mHeight = h;
   }
 
+  // "drop" (default) or "stall" when remote has no frame credit left,
+  // "mailbox" holds every frame while the last one sent isn't acked
+  if (property_get("hwc_vhal.frame_credit_policy", value, nullptr)) {
+    if (strcmp(value, "stall") == 0) {
+      mFrameCreditWaitMs = kDefaultFrameCreditStallMs;
+      if (property_get("hwc_vhal.frame_credit_stall_ms", value, nullptr)) {
+        mFrameCreditWaitMs = atoi(value);
+      }
+    } else if (strcmp(value, "mailbox") == 0) {
+      mMailbox = true;
+    }
+  }
+
 #ifdef ENABLE_HWC_UIO
   mUioDisplay = new UioDisplay((int)id, mWidth, mHeight);
   if (mUioDisplay && mUioDisplay->init() < 0) {
@@ -92,6 +108,7 @@ Hwc2Display::~Hwc2Display() {
     close(mOutputBufferFenceFd);
     mOutputBufferFenceFd = -1;
   }
+  clearReleaseFences();
 }
 
 int Hwc2Display::attach(RemoteDisplay* rd) {
@@ -100,7 +117,12 @@ int Hwc2Display::attach(RemoteDisplay* rd) {
   if (!rd)
     return -1;
 
-  mRemoteDisplay = rd;
+  std::unique_lock<std::mutex> lk(mRemoteMutex);
+  if (!mPresentTimeline.valid()) {
+    mPresentTimeline.init();
+  }
+  _addSink(rd, true);
+  _setPrimary(rd);
   mWidth = mRemoteDisplay->width();
   mHeight = mRemoteDisplay->height();
   mFramerate = mRemoteDisplay->fps();
@@ -120,15 +142,90 @@ int Hwc2Display::attach(RemoteDisplay* rd) {
   return 0;
 }
 
+int Hwc2Display::addMirror(RemoteDisplay* rd) {
+  std::unique_lock<std::mutex> lk(mRemoteMutex);
+  if (!rd || !mRemoteDisplay)
+    return -1;
+
+  display_flags flags;
+  flags.value = rd->flags();
+  if (flags.mode != mMode) {
+    ALOGW("Hwc2Display(%" PRIu64 ")::%s mode %d doesn't match %d", mDisplayID,
+          __func__, flags.mode, mMode);
+    return -1;
+  }
+  if (rd->width() != mWidth || rd->height() != mHeight) {
+    ALOGW("Hwc2Display(%" PRIu64 ")::%s size %dx%d doesn't match %dx%d",
+          mDisplayID, __func__, rd->width(), rd->height(), mWidth, mHeight);
+    return -1;
+  }
+
+  _addSink(rd, false);
+  ALOGD("Hwc2Display(%" PRIu64 ")::%s %d remotes", mDisplayID, __func__,
+        (int)mSinks.size());
+  return 0;
+}
+
+void Hwc2Display::_addSink(RemoteDisplay* rd, bool primary) {
+  Sink sink;
+  sink.remote = rd;
+  mSinks.insert(primary ? mSinks.begin() : mSinks.end(), sink);
+
+  // the registry goes with the connection, references start on each
+  mFbtRefs.addRemote(rd, mFbTarget);
+  for (auto& layer : mLayers) {
+    layer.second.addRemote(rd);
+  }
+}
+
+void Hwc2Display::_setPrimary(RemoteDisplay* rd) {
+  mRemoteDisplay = rd;
+  mRemoteDisplay->setDisplayEventListener(this);
+  mBackpressure = rd->congested();
+}
+
 int Hwc2Display::detach(RemoteDisplay* rd) {
-  if (rd == mRemoteDisplay) {
-    mFbtBuffers.clear();
-    mTransform = 0;
-    mRemoteDisplay = nullptr;
+  std::unique_lock<std::mutex> lk(mRemoteMutex);
+  mRemoteCond.wait(lk, [this, rd]() { return mCreditWaiter != rd; });
+  auto sink = std::find_if(mSinks.begin(), mSinks.end(),
+                           [rd](const Sink& s) { return s.remote == rd; });
+  if (sink == mSinks.end())
+    return 0;
+
+  mSinks.erase(sink);
+  mFbtRefs.removeRemote(rd);
+  for (auto& layer : mLayers) {
+    layer.second.removeRemote(rd);
+  }
+  if (rd != mRemoteDisplay)
+    return 0;
+
+  mBackpressure = false;
+  mRemoteDisplay->setDisplayEventListener(nullptr);
+  clearReleaseFences();
+  // frames in flight are never acked now
+  mPresentTimeline.signalAll();
+  mRemoteDisplay = nullptr;
+
+  if (!mSinks.empty()) {
+    // a mirror has all frames the primary had, it takes over
+    _setPrimary(mSinks.front().remote);
+    ALOGD("Hwc2Display(%" PRIu64 ")::%s mirror %p is primary now", mDisplayID,
+          __func__, mRemoteDisplay);
+    return 0;
   }
+  mFrame.clear();
+  mFbDamage.clear();
+  mFbDamageFull = true;
+  mTransform = 0;
   return 0;
 }
 
+size_t Hwc2Display::remoteCount() {
+  std::unique_lock<std::mutex> lk(mRemoteMutex);
+  return mSinks.size();
+}
+
 int Hwc2Display::onBufferDisplayed(const buffer_info_t& info) {
   ALOGV("Hwc2Display(%" PRIu64 ")::%s", mDisplayID, __func__);
 
@@ -142,6 +239,95 @@ int Hwc2Display::onPresented(std::vector<layer_buffer_info_t>& layerBuffer,
   flags.value = mRemoteDisplay->flags();
   // mMode = flags.mode;
 
+  std::unique_lock<std::mutex> lk(mReleaseFenceMutex);
+  for (auto& lb : layerBuffer) {
+    if (lb.layerId == LAYER_ID_FRAMEBUFFER)
+      continue;
+
+    int releaseFence = lb.fence;
+    lb.fence = -1;
+    if (releaseFence < 0 && fence >= 0) {
+      releaseFence = dup(fence);
+    }
+    if (releaseFence < 0)
+      continue;
+
+    // the buffer may be acked again, the latest fence counts
+    auto key = LayerBuffer(lb.layerId, lb.bufferId);
+    auto it = mPendingReleaseFences.find(key);
+    if (it != mPendingReleaseFences.end()) {
+      close(it->second);
+      it->second = releaseFence;
+    } else {
+      mPendingReleaseFences[key] = releaseFence;
+    }
+  }
+
+  return 0;
+}
+
+void Hwc2Display::applyReleaseFences() {
+  // buffers without a fence from remote are released once it acks this
+  // frame, it shows their replacements then. In mode 0 remote only reads
+  // the client target.
+  int ackFence = -1;
+  std::unique_lock<std::mutex> lk(mReleaseFenceMutex);
+  for (auto& layer : mLayers) {
+    buffer_handle_t released = layer.second.takeReleasedBuffer();
+    if (!released || !mRemoteDisplay || mMode == 0)
+      continue;
+
+    int fence =
+        _takeReleaseFence(layer.first, mRemoteDisplay->bufferId(released));
+    if (fence < 0 && mPresentTimeline.valid()) {
+      if (ackFence < 0) {
+        ackFence = mPresentTimeline.createFence(mFrameNum + 1, "hwc_release");
+      }
+      fence = ackFence >= 0 ? dup(ackFence) : -1;
+    }
+    layer.second.setReleaseFence(fence);
+  }
+  if (ackFence >= 0) {
+    close(ackFence);
+  }
+}
+
+int Hwc2Display::_takeReleaseFence(hwc2_layer_t layer, uint64_t bufferId) {
+  // fences of the layer's other buffers came after their present
+  int fence = -1;
+  auto begin = mPendingReleaseFences.lower_bound(LayerBuffer(layer, 0));
+  auto end = begin;
+  for (; end != mPendingReleaseFences.end() && end->first.first == layer;
+       ++end) {
+    if (bufferId && end->first.second == bufferId) {
+      fence = end->second;
+    } else {
+      close(end->second);
+    }
+  }
+  mPendingReleaseFences.erase(begin, end);
+  return fence;
+}
+
+void Hwc2Display::clearReleaseFences() {
+  std::unique_lock<std::mutex> lk(mReleaseFenceMutex);
+  for (auto& pending : mPendingReleaseFences) {
+    close(pending.second);
+  }
+  mPendingReleaseFences.clear();
+}
+
+int Hwc2Display::onFrameDone(uint32_t frameSeq) {
+  ALOGV("Hwc2Display(%" PRIu64 ")::%s %u", mDisplayID, __func__, frameSeq);
+
+  mPresentTimeline.signal(frameSeq + 1);
+  return 0;
+}
+
+int Hwc2Display::onBackpressure(bool congested) {
+  ALOGD("Hwc2Display(%" PRIu64 ")::%s %d", mDisplayID, __func__, congested);
+
+  mBackpressure = congested;
   return 0;
 }
 
@@ -173,11 +359,17 @@ Error Hwc2Display::createLayer(hwc2_layer_t* layer) {
   LAYER_TRACE("Hwc2Display(%" PRIu64 ")::%s mode=%d layerId=%" PRIx64,
               mDisplayID, __func__, mMode, mLayerIndex);
 
+  std::unique_lock<std::mutex> lk(mRemoteMutex);
   if (mRemoteDisplay && mMode > 0) {
-    mRemoteDisplay->createLayer(mLayerIndex);
+    mFrame.createdLayers.push_back(mLayerIndex);
   }
   mLayers.emplace(mLayerIndex, mLayerIndex);
-  mLayers.at(mLayerIndex).setRemoteDisplay(mRemoteDisplay);
+  // remotes routed by task get the layer once its task is known
+  for (auto& sink : mSinks) {
+    if (sink.tasks.empty()) {
+      mLayers.at(mLayerIndex).addRemote(sink.remote);
+    }
+  }
   *layer = mLayerIndex;
   mLayerIndex++;
   return Error::None;
@@ -189,8 +381,20 @@ Error Hwc2Display::destroyLayer(hwc2_layer_t layer) {
   LAYER_TRACE("Hwc2Display(%" PRIu64 ")::%s mode=%d layerId=%" PRIx64,
               mDisplayID, __func__, mMode, mLayerIndex);
 
+  std::unique_lock<std::mutex> lk(mRemoteMutex);
   if (mRemoteDisplay && mMode > 0) {
-    mRemoteDisplay->removeLayer(layer);
+    auto& created = mFrame.createdLayers;
+    auto it = std::find(created.begin(), created.end(), layer);
+    if (it != created.end()) {
+      // remote never heard about it
+      created.erase(it);
+    } else {
+      mFrame.removedLayers.push_back(layer);
+    }
+  }
+  {
+    std::unique_lock<std::mutex> fenceLock(mReleaseFenceMutex);
+    _takeReleaseFence(layer, 0);
   }
   mLayers.erase(layer);
   return Error::None;
@@ -349,18 +553,19 @@ Error Hwc2Display::getReleaseFences(uint32_t* numElements,
                                     int32_t* fences) {
   ALOGV("Hwc2Display(%" PRIu64 ")::%s", mDisplayID, __func__);
 
-  if (!layers || !fences) {
-    *numElements = mLayers.size();
-    return Error::None;
-  }
-
+  // layers whose buffer the last present released, SF owns the fences once
+  // they are returned
   uint32_t numLayers = 0;
   for (auto& l : mLayers) {
-    if (numLayers < *numElements) {
+    if (l.second.releaseFence() < 0)
+      continue;
+    if (layers && fences) {
+      if (numLayers >= *numElements)
+        break;
       layers[numLayers] = l.first;
-      fences[numLayers] = l.second.releaseFence();
-      numLayers++;
+      fences[numLayers] = l.second.takeReleaseFence();
     }
+    numLayers++;
   }
   *numElements = numLayers;
 
@@ -370,39 +575,105 @@ Error Hwc2Display::getReleaseFences(uint32_t* numElements,
 Error Hwc2Display::present(int32_t* retireFence) {
   ALOGV("Hwc2Display(%" PRIu64 ")::%s", mDisplayID, __func__);
 
-  if (mRemoteDisplay) {
-    if (mMode == 0 || mMode == 2) {
+  // point mFrameNum + 1 is reached once remote acks this frame, a skipped
+  // frame is completed by the ack of the next one sent
+  *retireFence = -1;
+  if (mRemoteDisplay && mPresentTimeline.valid()) {
+    *retireFence = mPresentTimeline.createFence(mFrameNum + 1, "hwc_present");
+  }
+
+  std::unique_lock<std::mutex> lk(mRemoteMutex);
+  bool anyReady = false;
+  for (auto& sink : mSinks) {
+    _updateRoute(sink);
+    sink.ready = _sinkReady(sink.remote);
+    anyReady = anyReady || sink.ready;
+  }
+  // "stall" lets a primary out of credits wait for one. Mirrors get the
+  // frame first so the wait never delays them.
+  bool stall = mRemoteDisplay && !mSinks.front().ready &&
+               mFrameCreditWaitMs > 0 && !mMailbox && !mBackpressure;
+  if (stall && !anyReady) {
+    anyReady = _stallForCredit(lk)->ready;
+    stall = false;
+  }
+  if (mRemoteDisplay && !anyReady) {
+    // keep layer changes pending, they go out with the first frame after the
+    // remote caught up. A held frame is replaced by the next present, the
+    // refresh after the ack makes sure there is one.
+    ALOGV("Hwc2Display(%" PRIu64 ")::%s skip frame %d, remote is congested",
+          mDisplayID, __func__, mFrameNum);
+  } else if (mRemoteDisplay) {
+    if (mMode == 0 || mMode == 2 || mLayersFallback) {
       if (mFbTarget) {
-        mRemoteDisplay->displayBuffer(mFbTarget);
+        mFrame.fbTarget = mFbTarget;
+        mFrame.fbFence = mFbAcquireFenceFd;
+        if (!mFbDamageFull) {
+          mFrame.fbDamage.swap(mFbDamage);
+        }
+        mFbDamage.clear();
+        mFbDamageFull = false;
         updateRotation();
       }
     }
     if (mMode > 0) {
-      bool forceUpdateAll = false;
-      std::vector<layer_info_t> layerInfos;
+      bool zOrderChanged = false;
       for (auto& layer : mLayers) {
-        if (forceUpdateAll || layer.second.changed()) {
-          layerInfos.push_back(layer.second.info());
+        if (layer.second.changed()) {
+          mFrame.layers.push_back(layer.second.info());
+        }
+        if (layer.second.changedFields() & LAYER_CHANGED_Z) {
+          zOrderChanged = true;
         }
-      }
-      if (layerInfos.size()) {
-        mRemoteDisplay->updateLayers(layerInfos);
-      }
-
-      std::vector<layer_buffer_info_t> layerBuffers;
-      for (auto& layer : mLayers) {
         if (layer.second.bufferChanged()) {
-          layerBuffers.push_back(layer.second.layerBuffer());
+          mFrame.layerBuffers.push_back(layer.second.layerBuffer());
         }
       }
-      if (layerBuffers.size()) {
-        mRemoteDisplay->presentLayers(layerBuffers);
+      if (zOrderChanged) {
+        _sortZOrder(&mFrame.zOrder);
       }
+    }
+    mFrame.frameSeq = mFrameNum;
+
+    // remotes which skipped frames missed changes, they get all of the
+    // state instead, built once for all of them
+    for (auto& sink : mSinks) {
+      bool stalled = stall && &sink == &mSinks.front();
+      if (sink.resync && (sink.ready || stalled)) {
+        _buildFullFrame();
+        break;
+      }
+    }
+    // the last remote sent to takes the fences, the others get copies
+    Sink* taker = stall ? &mSinks.front() : nullptr;
+    for (auto& sink : mSinks) {
+      if (!stall && sink.ready) {
+        taker = &sink;
+      }
+    }
+    const FrameCommit* taken = nullptr;
+    for (auto& sink : mSinks) {
+      if (stall && &sink == &mSinks.front())
+        continue;
+      const FrameCommit* frame = _commitSink(sink, &sink == taker);
+      taken = &sink == taker ? frame : taken;
+    }
+    if (stall) {
+      taken = _commitSink(*_stallForCredit(lk), true);
+    }
+    if (taken) {
+      _dropFences(*taken);
+    }
+    mFrame.clear();
+
+    if (mMode > 0) {
       for (auto& layer : mLayers) {
         layer.second.setUnchanged();
       }
     }
   }
+  applyReleaseFences();
+  lk.unlock();
 
 #ifdef ENABLE_HWC_UIO
   if (mUioDisplay && mFbTarget) {
@@ -430,7 +701,6 @@ Error Hwc2Display::present(int32_t* retireFence) {
 #endif
 
   mFrameNum++;
-  *retireFence = -1;
   return Error::None;
 }
 
@@ -453,22 +723,32 @@ Error Hwc2Display::setClientTarget(buffer_handle_t target,
   }
   mFbAcquireFenceFd = acquireFence;
 
-  if (mRemoteDisplay) {
-    bool isNew = true;
-
-    for (auto fbt : mFbtBuffers) {
-      if (fbt == mFbTarget) {
-        isNew = false;
-      }
+  // frames skipped under backpressure add up their damage
+  if (damage.numRects == 0) {
+    mFbDamageFull = true;
+  } else if (!mFbDamageFull) {
+    for (size_t i = 0; i < damage.numRects; i++) {
+      auto& r = damage.rects[i];
+      mFbDamage.push_back({r.left, r.top, r.right, r.bottom});
     }
-    if (isNew) {
-      mFbtBuffers.push_back(mFbTarget);
-      mRemoteDisplay->createBuffer(mFbTarget);
+    if (mFbDamage.size() > kMaxFbDamageRects) {
+      mFbDamage.clear();
+      mFbDamageFull = true;
     }
   }
+
+  std::unique_lock<std::mutex> lk(mRemoteMutex);
+  mFbtRefs.use(mFbTarget);
   return Error::None;
 }
 
+Error Hwc2Display::setLayerBuffer(hwc2_layer_t layer,
+                                  buffer_handle_t buffer,
+                                  int32_t acquireFence) {
+  std::unique_lock<std::mutex> lk(mRemoteMutex);
+  return mLayers.at(layer).setBuffer(buffer, acquireFence);
+}
+
 Error Hwc2Display::setColorMode(int32_t mode) {
   ALOGV("Hwc2Display(%" PRIu64 ")::%s", mDisplayID, __func__);
 
@@ -530,6 +810,28 @@ Error Hwc2Display::validate(uint32_t* numTypes, uint32_t* numRequests) {
         break;
     }
   }
+
+  // every layer is composed by the client, it's what remotes which can't
+  // compose the layers themselves are shown
+  std::unique_lock<std::mutex> lk(mRemoteMutex);
+  bool fallback = false;
+  if (mMode == 1) {
+    for (auto& sink : mSinks) {
+      // a routed remote never gets the client target, it has all tasks
+      if (sink.tasks.empty() && !_layersFit(sink.remote)) {
+        fallback = true;
+        break;
+      }
+    }
+  }
+  if (fallback != mLayersFallback) {
+    ALOGD("Hwc2Display(%" PRIu64 ")::%s %s client target to remotes",
+          mDisplayID, __func__, fallback ? "start" : "stop");
+    mLayersFallback = fallback;
+    // damage since a client target was last sent is unknown
+    mFbDamageFull = true;
+  }
+  lk.unlock();
 #ifdef ENABLE_HWC_UIO
   checkRotation();
 #endif
@@ -579,6 +881,242 @@ int Hwc2Display::checkRotation() {
 }
 #endif
 
+// remote rotation for a layer transform
+static int rotationOf(uint32_t tr) {
+  return (tr == 0) ? 0 : (tr == 4) ? 1 : (tr == 3) ? 2 : 3;
+}
+
+bool Hwc2Display::_sinkReady(RemoteDisplay* rd) {
+  // backpressure of the primary comes by onBackpressure()
+  bool primary = rd == mRemoteDisplay;
+  if (primary ? mBackpressure.load() : rd->congested())
+    return false;
+  if (mMailbox)
+    return !rd->frameUnacked();
+  return rd->waitFrameCredit(0);
+}
+
+Hwc2Display::Sink* Hwc2Display::_stallForCredit(
+    std::unique_lock<std::mutex>& lk) {
+  // not under mRemoteMutex, the socket thread needs it to attach and
+  // detach remotes. detach() holds off until rd isn't waited for.
+  RemoteDisplay* rd = mRemoteDisplay;
+  mCreditWaiter = rd;
+  lk.unlock();
+  bool ready = rd->waitFrameCredit(mFrameCreditWaitMs);
+  lk.lock();
+  mCreditWaiter = nullptr;
+  mRemoteCond.notify_all();
+
+  // mirrors may have come and gone, rd is still the primary
+  Sink& sink = mSinks.front();
+  sink.ready = ready;
+  return &sink;
+}
+
+const FrameCommit* Hwc2Display::_commitSink(Sink& sink, bool takeFences) {
+  if (!sink.ready) {
+    sink.resync = true;
+    return nullptr;
+  }
+  if (!sink.tasks.empty()) {
+    _commitRouted(sink, sink.resync ? mFullFrame : mFrame, takeFences);
+    return &mRoutedFrame;
+  }
+  if (sink.resync) {
+    _resync(sink, takeFences);
+    return &mFullFrame;
+  }
+  sink.remote->commitFrame(mFrame, nullptr, takeFences);
+  sink.layers.insert(mFrame.createdLayers.begin(), mFrame.createdLayers.end());
+  for (auto id : mFrame.removedLayers) {
+    sink.layers.erase(id);
+  }
+  return &mFrame;
+}
+
+bool Hwc2Display::_layersFit(RemoteDisplay* rd) {
+  uint32_t maxLayers = rd->remoteCaps().maxLayers;
+  if (maxLayers && mLayers.size() > maxLayers)
+    return false;
+  for (auto& layer : mLayers) {
+    int32_t format = layer.second.format();
+    if (format && !rd->supportsFormat(format))
+      return false;
+  }
+  return true;
+}
+
+void Hwc2Display::_sortZOrder(std::vector<uint64_t>* zOrder) {
+  for (auto& layer : mLayers) {
+    zOrder->push_back(layer.first);
+  }
+  std::stable_sort(zOrder->begin(), zOrder->end(),
+                   [this](uint64_t a, uint64_t b) {
+                     return mLayers.at(a).info().z < mLayers.at(b).info().z;
+                   });
+}
+
+void Hwc2Display::_buildFullFrame() {
+  FrameCommit& full = mFullFrame;
+  full.clear();
+  full.frameSeq = mFrame.frameSeq;
+  full.fbTarget = mFrame.fbTarget;
+  full.fbFence = mFrame.fbFence;
+  full.rotationChanged = true;
+  full.rotation = rotationOf(mTransform);
+  if (mMode > 0) {
+    for (auto& layer : mLayers) {
+      layer_info_t info = layer.second.info();
+      info.changed = LAYER_CHANGED_ALL;
+      full.layers.push_back(info);
+      if (layer.second.layerBuffer().bufferId) {
+        full.layerBuffers.push_back(layer.second.layerBuffer());
+      }
+    }
+    _sortZOrder(&full.zOrder);
+  }
+}
+
+void Hwc2Display::_resync(Sink& sink, bool takeFences) {
+  FrameCommit& full = mFullFrame;
+  full.createdLayers.clear();
+  full.removedLayers.clear();
+  if (mMode > 0) {
+    for (auto& layer : mLayers) {
+      if (!sink.layers.count(layer.first)) {
+        full.createdLayers.push_back(layer.first);
+      }
+    }
+    for (auto id : sink.layers) {
+      if (!mLayers.count(id)) {
+        full.removedLayers.push_back(id);
+      }
+    }
+  }
+  ALOGD("Hwc2Display(%" PRIu64 ")::%s remote %p at frame %d", mDisplayID,
+        __func__, sink.remote, mFrameNum);
+  if (sink.remote->commitFrame(full, nullptr, takeFences) < 0)
+    return;
+
+  sink.layers.clear();
+  if (mMode > 0) {
+    for (auto& layer : mLayers) {
+      sink.layers.insert(layer.first);
+    }
+  }
+  sink.resync = false;
+}
+
+void Hwc2Display::_updateRoute(Sink& sink) {
+  std::vector<uint32_t> tasks;
+  if (mMode == 0 || !sink.remote->takeTasks(&tasks))
+    return;
+
+  RemoteDisplay* rd = sink.remote;
+  bool routed = !sink.tasks.empty();
+  sink.tasks = std::set<uint32_t>(tasks.begin(), tasks.end());
+  ALOGD("Hwc2Display(%" PRIu64 ")::%s remote %p routed to %zd tasks",
+        mDisplayID, __func__, rd, sink.tasks.size());
+
+  if (!routed && !sink.tasks.empty()) {
+    // the framebuffer target has every task composed in, it stays local.
+    // Layers of other tasks are dropped by the next routed frame.
+    mFbtRefs.removeRemote(rd, true);
+  } else if (routed && sink.tasks.empty()) {
+    // back to every layer, remote gets the whole state again
+    mFbtRefs.addRemote(rd, mFbTarget);
+    for (auto& layer : mLayers) {
+      layer.second.addRemote(rd);
+    }
+    sink.resync = true;
+  }
+}
+
+void Hwc2Display::_commitRouted(Sink& sink,
+                                const FrameCommit& frame,
+                                bool takeFences) {
+  RemoteDisplay* rd = sink.remote;
+  FrameCommit& routed = mRoutedFrame;
+  routed.clear();
+  routed.frameSeq = frame.frameSeq;
+  routed.rotationChanged = frame.rotationChanged;
+  routed.rotation = frame.rotation;
+
+  // layers joining the tasks are new to remote and go with all fields,
+  // the changes of the others are filtered from frame
+  std::set<hwc2_layer_t> visible;
+  for (auto& layer : mLayers) {
+    if (!sink.tasks.count(layer.second.info().taskId))
+      continue;
+    visible.insert(layer.first);
+    if (sink.layers.count(layer.first))
+      continue;
+
+    layer.second.addRemote(rd);
+    routed.createdLayers.push_back(layer.first);
+    layer_info_t info = layer.second.info();
+    info.changed = LAYER_CHANGED_ALL;
+    routed.layers.push_back(info);
+    if (layer.second.layerBuffer().bufferId) {
+      routed.layerBuffers.push_back(layer.second.layerBuffer());
+    }
+  }
+  for (auto id : sink.layers) {
+    if (!visible.count(id)) {
+      routed.removedLayers.push_back(id);
+    }
+  }
+  for (auto& info : frame.layers) {
+    if (visible.count(info.layerId) && sink.layers.count(info.layerId)) {
+      routed.layers.push_back(info);
+    }
+  }
+  for (auto& lb : frame.layerBuffers) {
+    if (visible.count(lb.layerId) && sink.layers.count(lb.layerId)) {
+      routed.layerBuffers.push_back(lb);
+    }
+  }
+  if (!frame.zOrder.empty() || !routed.createdLayers.empty() ||
+      !routed.removedLayers.empty()) {
+    std::vector<uint64_t> zOrder(frame.zOrder);
+    if (zOrder.empty()) {
+      _sortZOrder(&zOrder);
+    }
+    for (auto id : zOrder) {
+      if (visible.count(id)) {
+        routed.zOrder.push_back(id);
+      }
+    }
+  }
+
+  if (rd->commitFrame(routed, nullptr, takeFences) < 0) {
+    sink.resync = true;
+    return;
+  }
+  sink.layers.swap(visible);
+  sink.resync = false;
+
+  // buffers of layers remote doesn't show are released on it
+  for (auto& layer : mLayers) {
+    if (!sink.layers.count(layer.first)) {
+      layer.second.removeRemote(rd, true);
+    }
+  }
+}
+
+void Hwc2Display::_dropFences(const FrameCommit& frame) {
+  if (frame.fbFence >= 0 && frame.fbFence == mFbAcquireFenceFd) {
+    mFbAcquireFenceFd = -1;
+  }
+  for (auto& lb : frame.layerBuffers) {
+    auto it = mLayers.find(lb.layerId);
+    if (it != mLayers.end()) {
+      it->second.dropAcquireFence(lb.fence);
+    }
+  }
+}
+
 int Hwc2Display::updateRotation() {
   ALOGV("Hwc2Display(%" PRIu64 ")::%s", mDisplayID, __func__);
 
@@ -593,12 +1131,13 @@ int Hwc2Display::updateRotation() {
       break;
   }
   if (tr != mTransform) {
-    int rot = (tr == 0) ? 0 : (tr == 4) ? 1 : (tr == 3) ? 2 : 3;
+    int rot = rotationOf(tr);
 
     ALOGD("Hwc2Display(%" PRIu64 ")::%s, setRotation to %d, tr=%d", mDisplayID,
           __func__, rot, tr);
 
-    mRemoteDisplay->setRotation(rot);
+    mFrame.rotationChanged = true;
+    mFrame.rotation = rot;
     mTransform = tr;
 
 #ifdef ENABLE_LAYER_DUMP
@@ -28,22 +28,27 @@ Date: 2021.06.09
 #ifndef __HWC2_DISPLAY_H__
 #define __HWC2_DISPLAY_H__
 
+#include <atomic>
+#include <condition_variable>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <vector>
 
 #include <hardware/hwcomposer2.h>
 
+#include "BufferRefs.h"
 #include "Hwc2Layer.h"
 #include "IRemoteDevice.h"
+#include "RemoteDisplay.h"
+#include "SyncTimeline.h"
 #include "display_protocol.h"
 
 #ifdef ENABLE_HWC_UIO
 #include "UioDisplay.h"
 #endif
 
-class RemoteDisplay;
-
 class Hwc2Display : public DisplayEventListener {
  public:
   Hwc2Display(hwc2_display_t id);
@@ -53,12 +58,18 @@ class Hwc2Display : public DisplayEventListener {
   int height() const { return mHeight; }
   bool attachable() const { return !mRemoteDisplay; }
   int attach(RemoteDisplay* rd);
+  // shows the display on one more remote, it must use the same mode
+  int addMirror(RemoteDisplay* rd);
   int detach(RemoteDisplay* rd);
+  // remotes the display is shown on, mirrors included
+  size_t remoteCount();
 
   // DisplayEventListener
   int onBufferDisplayed(const buffer_info_t& info) override;
   int onPresented(std::vector<layer_buffer_info_t>& layerBuffer,
                   int& fence) override;
+  int onBackpressure(bool congested) override;
+  int onFrameDone(uint32_t frameSeq) override;
 
   hwc2_display_t getDisplayID() const { return mDisplayID; }
   Hwc2Layer& getLayer(hwc2_layer_t l) { return mLayers.at(l); }
@@ -104,6 +115,9 @@ class Hwc2Display : public DisplayEventListener {
                               int32_t dataspace,
                               hwc_region_t damage);
   HWC2::Error setColorMode(int32_t mode);
+  HWC2::Error setLayerBuffer(hwc2_layer_t layer,
+                             buffer_handle_t buffer,
+                             int32_t acquireFence);
   HWC2::Error setColorTransform(const float* matrix, int32_t hint);
   HWC2::Error setOutputBuffer(buffer_handle_t buffer, int32_t release_fence);
   HWC2::Error setPowerMode(int32_t mode);
@@ -121,7 +135,41 @@ class Hwc2Display : public DisplayEventListener {
   HWC2::Error hotplug(bool in);
   HWC2::Error vsync(int64_t timestamp);
   HWC2::Error refresh();
+
+  // Mirrors only take frames, present and release fences follow
+  // mRemoteDisplay.
+  struct Sink {
+    RemoteDisplay* remote = nullptr;
+    bool ready = false;  // takes the frame being presented
+    bool resync = true;  // missed changes, the next frame carries all
+    std::set<hwc2_layer_t> layers;  // layers remote has been told about
+    std::set<uint32_t> tasks;       // only these are routed, empty for all
+  };
+  void _addSink(RemoteDisplay* rd, bool primary);
+  void _setPrimary(RemoteDisplay* rd);
+  bool _sinkReady(RemoteDisplay* rd);
+  // "stall" policy, waits up to mFrameCreditWaitMs for the primary to
+  // return a frame credit, lk is released meanwhile. Returns the sink of
+  // the primary, ready if it got one.
+  Sink* _stallForCredit(std::unique_lock<std::mutex>& lk);
+  // sends the frame to a ready sink, returns the frame it got
+  const FrameCommit* _commitSink(Sink& sink, bool takeFences);
+  // remote takes every layer, within its max layers and formats
+  bool _layersFit(RemoteDisplay* rd);
+  void _sortZOrder(std::vector<uint64_t>* zOrder);
+  void _buildFullFrame();
+  // takeFences hands the fences of the frame committed to remote
+  void _resync(Sink& sink, bool takeFences);
+  void _updateRoute(Sink& sink);
+  void _commitRouted(Sink& sink, const FrameCommit& frame, bool takeFences);
+  // forgets the fences of frame a remote took
+  void _dropFences(const FrameCommit& frame);
   int updateRotation();
+  void applyReleaseFences();
+  // fence remote acked for the layer's buffer, -1 if none. Drops the
+  // fences of its other buffers, mReleaseFenceMutex is held.
+  int _takeReleaseFence(hwc2_layer_t layer, uint64_t bufferId);
+  void clearReleaseFences();
 #ifdef ENABLE_HWC_UIO
   int checkRotation();
 #endif
@@ -143,18 +191,58 @@ class Hwc2Display : public DisplayEventListener {
 
   buffer_handle_t mFbTarget = nullptr;
   int mFbAcquireFenceFd = -1;
-  std::vector<buffer_handle_t> mFbtBuffers;
+  // client target damage since the last frame sent to remote
+  static const size_t kMaxFbDamageRects = 64;
+  std::vector<rect_t> mFbDamage;
+  bool mFbDamageFull = true;
+  // client targets recently set, SurfaceFlinger cycles through up to 3
+  static const size_t kMaxFbtBuffers = 4;
+  BufferRefs mFbtRefs;
 
   buffer_handle_t mOutputBuffer = nullptr;
   int mOutputBufferFenceFd = -1;
 
   int32_t mColorMode = 0;
 
+  // remotes are attached and detached on the socket thread, this guards
+  // them, the set of layers and the buffer references kept for each remote
+  std::mutex mRemoteMutex;
   // remote display
   RemoteDisplay* mRemoteDisplay = nullptr;
+  // remotes frames are sent to, mRemoteDisplay first
+  std::vector<Sink> mSinks;
+  // the whole display state for remotes to resync
+  FrameCommit mFullFrame;
+  // frame of a remote subscribed to tasks, scratch reused for each
+  FrameCommit mRoutedFrame;
   uint32_t mVersion = 0;
   uint32_t mMode = 0;
+  // in mode 1 a remote can't take the layers, frames carry the client
+  // target too until they fit again
+  bool mLayersFallback = false;
   int mReleaseFence = -1;
+  // remote send queue is above its high water mark, frames are skipped
+  std::atomic<bool> mBackpressure{false};
+  // how long present waits for a frame credit before dropping the frame,
+  // 0 drops right away so remote gets the latest frame once it caught up
+  static const int kDefaultFrameCreditStallMs = 50;
+  int mFrameCreditWaitMs = 0;
+  // remote present waits for a credit of, detach() waits on mRemoteCond
+  // until it is done
+  RemoteDisplay* mCreditWaiter = nullptr;
+  std::condition_variable mRemoteCond;
+  // latest wins, at most one frame in flight and newer ones replace a frame
+  // held back meanwhile
+  bool mMailbox = false;
+  // changes collected for the next frame sent to remote
+  FrameCommit mFrame;
+  // release fences acked by remote by layer and remote buffer id, handed
+  // to the layer at the present replacing that buffer
+  typedef std::pair<hwc2_layer_t, uint64_t> LayerBuffer;
+  std::mutex mReleaseFenceMutex;
+  std::map<LayerBuffer, int> mPendingReleaseFences;
+  // present fences, signalled as remote acks frames
+  SyncTimeline mPresentTimeline;
 
   int mFrameNum = 0;
 
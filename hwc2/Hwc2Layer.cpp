@@ -33,30 +33,52 @@ Date: 2021.06.09
 #include <cutils/log.h>
 #include <unistd.h>
 
+#include "BufferMapper.h"
 #include "Hwc2Layer.h"
 
 using namespace HWC2;
 
-Hwc2Layer::Hwc2Layer(hwc2_layer_t idx) {
+Hwc2Layer::Hwc2Layer(hwc2_layer_t idx) : mBufferRefs(kMaxBuffers) {
   mLayerID = idx;
   memset(&mInfo, 0, sizeof(mInfo));
   mInfo.layerId = idx;
-  mInfo.changed = true;
+  mInfo.changed = LAYER_CHANGED_ALL;
   memset(&mLayerBuffer, 0, sizeof(layer_buffer_info_t));
   mLayerBuffer.layerId = idx;
 }
 
 Hwc2Layer::~Hwc2Layer() {
-  // since connection is broken, we can't ask remote to remove buffers
-  //if (mRemoteDisplay) {
-  //  for (auto buffer : mBuffers) {
-  //    mRemoteDisplay->removeBuffer(buffer);
-  //  }
-  //}
   if (mAcquireFence >= 0) {
     close(mAcquireFence);
     mAcquireFence = -1;
   }
+  if (mReleaseFence >= 0) {
+    close(mReleaseFence);
+    mReleaseFence = -1;
+  }
+}
+
+void Hwc2Layer::addRemote(RemoteDisplay* disp) {
+  mBufferRefs.addRemote(disp, mBuffer);
+}
+
+void Hwc2Layer::removeRemote(RemoteDisplay* disp, bool release) {
+  mBufferRefs.removeRemote(disp, release);
+}
+
+void Hwc2Layer::setReleaseFence(int fence) {
+  if (mReleaseFence >= 0) {
+    close(mReleaseFence);
+  }
+  mReleaseFence = fence;
+}
+
+buffer_handle_t Hwc2Layer::takeReleasedBuffer() {
+  // set back to the buffer presented, nothing is released
+  buffer_handle_t released =
+      mReleasePending && mReleasedBuffer != mBuffer ? mReleasedBuffer : nullptr;
+  mReleasePending = false;
+  return released;
 }
 
 Error Hwc2Layer::setCursorPosition(int32_t /*x*/, int32_t /*y*/) {
@@ -68,7 +90,7 @@ Error Hwc2Layer::setBlendMode(int32_t mode) {
   ALOGV("%s", __func__);
   if (mInfo.blendMode != mode) {
     mInfo.blendMode = mode;
-    mInfo.changed = true;
+    mInfo.changed |= LAYER_CHANGED_BLEND;
   }
   return Error::None;
 }
@@ -80,19 +102,21 @@ Error Hwc2Layer::setBuffer(buffer_handle_t buffer, int32_t acquireFence) {
     close(mAcquireFence);
   }
   mAcquireFence = acquireFence;
+  // forwarded to remote by index, never keep a closed fd here
+  mLayerBuffer.fence = acquireFence;
 
   if (mBuffer != buffer) {
-    if (mBuffers.count(buffer) == 0) {
-      mBuffers.insert(buffer);
-      if (mRemoteDisplay) {
-        mRemoteDisplay->createBuffer(buffer);
-      }
+    if (!mReleasePending) {
+      mReleasedBuffer = mBuffer;
+      mReleasePending = true;
     }
-
+    mBufferRefs.use(buffer);
     mBuffer = buffer;
-    mAcquireFence = acquireFence;
+    mFormat = 0;
+    if (mBuffer) {
+      BufferMapper::getMapper().getBufferFormat(mBuffer, mFormat);
+    }
     mLayerBuffer.bufferId = (uint64_t)mBuffer;
-    mLayerBuffer.fence = acquireFence;
     mLayerBuffer.changed = true;
   }
   return Error::None;
@@ -105,7 +129,7 @@ Error Hwc2Layer::setColor(hwc_color_t color) {
       (mColor.a != color.a)) {
     mColor = color;
     mInfo.color = color.r | (color.g << 8) | (color.g << 16) | (color.a << 24);
-    mInfo.changed = true;
+    mInfo.changed |= LAYER_CHANGED_COLOR;
   }
 
   return Error::None;
@@ -136,7 +160,7 @@ Error Hwc2Layer::setDisplayFrame(hwc_rect_t frame) {
     mInfo.dstFrame.top = mDstFrame.top;
     mInfo.dstFrame.right = mDstFrame.right;
     mInfo.dstFrame.bottom = mDstFrame.bottom;
-    mInfo.changed = true;
+    mInfo.changed |= LAYER_CHANGED_DST_FRAME;
   }
   return Error::None;
 }
@@ -148,7 +172,7 @@ Error Hwc2Layer::setPlaneAlpha(float alpha) {
     mAlpha = alpha;
 
     mInfo.planeAlpha = alpha;
-    mInfo.changed = true;
+    mInfo.changed |= LAYER_CHANGED_ALPHA;
   }
   return Error::None;
 }
@@ -169,7 +193,7 @@ Error Hwc2Layer::setSourceCrop(hwc_frect_t crop) {
     mInfo.srcCrop.top = (int)mSrcCrop.top;
     mInfo.srcCrop.right = (int)mSrcCrop.right;
     mInfo.srcCrop.bottom = (int)mSrcCrop.bottom;
-    mInfo.changed = true;
+    mInfo.changed |= LAYER_CHANGED_SRC_CROP;
   }
   return Error::None;
 }
@@ -188,7 +212,7 @@ Error Hwc2Layer::setTransform(int32_t transform) {
     mTransform = transform;
 
     mInfo.transform = transform;
-    mInfo.changed = true;
+    mInfo.changed |= LAYER_CHANGED_TRANSFORM;
   }
   return Error::None;
 }
@@ -203,8 +227,12 @@ Error Hwc2Layer::setVisibleRegion(hwc_region_t visible) {
 Error Hwc2Layer::setZOrder(uint32_t order) {
   ALOGV("%s", __func__);
 
-  mZOrder = order;
-  mInfo.z = order;
+  if (mZOrder != order) {
+    mZOrder = order;
+
+    mInfo.z = order;
+    mInfo.changed |= LAYER_CHANGED_Z;
+  }
   return Error::None;
 }
 
@@ -213,15 +241,19 @@ HWC2::Error Hwc2Layer::setTaskInfo(uint32_t stackId,
                                    uint32_t taskId,
                                    uint32_t userId,
                                    uint32_t index) {
-  mStackId = stackId;
-  mTaskId = taskId;
-  mUserId = userId;
-  mIndex = index;
-
-  mInfo.stackId = stackId;
-  mInfo.taskId = taskId;
-  mInfo.userId = userId;
-  mInfo.index = index;
+  if (mStackId != stackId || mTaskId != taskId || mUserId != userId ||
+      mIndex != index) {
+    mStackId = stackId;
+    mTaskId = taskId;
+    mUserId = userId;
+    mIndex = index;
+
+    mInfo.stackId = stackId;
+    mInfo.taskId = taskId;
+    mInfo.userId = userId;
+    mInfo.index = index;
+    mInfo.changed |= LAYER_CHANGED_TASK;
+  }
   return Error::None;
 }
 #endif
@@ -25,17 +25,18 @@ Date: 2021.06.09
 #define __HWC2_LAYER_H__
 
 #include <hardware/hwcomposer2.h>
+#include "BufferRefs.h"
 #include "RemoteDisplay.h"
 #include "display_protocol.h"
 
-#include <set>
-
 class Hwc2Layer {
  public:
   Hwc2Layer(hwc2_layer_t idx);
   ~Hwc2Layer();
 
-  void setRemoteDisplay(RemoteDisplay* disp) { mRemoteDisplay = disp; }
+  // remotes the layer's buffers are shown on
+  void addRemote(RemoteDisplay* disp);
+  void removeRemote(RemoteDisplay* disp, bool release = false);
   HWC2::Composition type() const { return mType; }
   void setValidatedType(HWC2::Composition t) { mValidatedType = t; }
   HWC2::Composition validatedType() const { return mValidatedType; }
@@ -43,12 +44,32 @@ class Hwc2Layer {
   void acceptTypeChange() { mType = mValidatedType; }
 
   int releaseFence() const { return mReleaseFence; }
+  void setReleaseFence(int fence);
+  // hands the fence over to the caller
+  int takeReleaseFence() {
+    int fence = mReleaseFence;
+    mReleaseFence = -1;
+    return fence;
+  }
+  // buffer replaced since the last present, the present releases it.
+  // nullptr if there is none.
+  buffer_handle_t takeReleasedBuffer();
+  // a remote took the acquire fence, it closes it
+  void dropAcquireFence(int fence) {
+    if (fence >= 0 && fence == mAcquireFence) {
+      mAcquireFence = -1;
+      mLayerBuffer.fence = -1;
+    }
+  }
   bool changed() const { return mInfo.changed; }
+  uint32_t changedFields() const { return mInfo.changed; }
   layer_info_t& info() { return mInfo; }
   bool bufferChanged() const { return mLayerBuffer.changed; }
   layer_buffer_info_t& layerBuffer() { return mLayerBuffer; }
+  // HAL_PIXEL_FORMAT_* of the buffer, 0 without one
+  int32_t format() const { return mFormat; }
   void setUnchanged() {
-    mInfo.changed = false;
+    mInfo.changed = 0;
     mLayerBuffer.changed = false;
   }
   void dump();
@@ -81,8 +102,13 @@ class Hwc2Layer {
   HWC2::Composition mValidatedType = HWC2::Composition::Invalid;
   int mReleaseFence = -1;
 
-  std::set<buffer_handle_t> mBuffers;
+  // buffers recently set, a BufferQueue rarely cycles through more
+  static const size_t kMaxBuffers = 8;
+  BufferRefs mBufferRefs;
   buffer_handle_t mBuffer = nullptr;
+  int32_t mFormat = 0;
+  buffer_handle_t mReleasedBuffer = nullptr;
+  bool mReleasePending = false;
   int mAcquireFence = -1;
 
   int32_t mDataspace = 0;
@@ -101,7 +127,6 @@ class Hwc2Layer {
   uint32_t mUserId = 0;
   uint32_t mIndex = 0;
 
-  RemoteDisplay* mRemoteDisplay = nullptr;
   layer_info_t mInfo;
   layer_buffer_info_t mLayerBuffer;
 };
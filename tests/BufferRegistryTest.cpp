@@ -0,0 +1,114 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+// BufferRegistry with fake handles, those with a fd are identified by it
+// like a gralloc handle by its dma-buf.
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "BufferRegistry.h"
+
+namespace {
+
+class BufferRegistryTest : public ::testing::Test {
+ protected:
+  void TearDown() override {
+    mRegistry.clear();
+    for (auto handle : mHandles) {
+      for (int i = 0; i < handle->numFds; i++) {
+        close(handle->data[i]);
+      }
+      free(handle);
+    }
+  }
+
+  // a handle without fds when fd is -1
+  buffer_handle_t handle(int fd = -1) {
+    native_handle_t* h =
+        (native_handle_t*)calloc(1, sizeof(native_handle_t) + 2 * sizeof(int));
+    h->version = sizeof(native_handle_t);
+    h->numFds = fd >= 0 ? 1 : 0;
+    h->numInts = 1;
+    if (fd >= 0) {
+      h->data[0] = fd;
+    }
+    mHandles.push_back(h);
+    return h;
+  }
+
+  BufferRegistry mRegistry;
+  std::vector<native_handle_t*> mHandles;
+};
+
+// remote may still refer to the old id, a new buffer in the slot must not
+// be taken for it
+TEST_F(BufferRegistryTest, FreedSlotBumpsGeneration) {
+  buffer_handle_t first = handle();
+  bool isNew = false;
+  uint64_t id = mRegistry.acquire(first, &isNew);
+  ASSERT_NE(0u, id);
+  EXPECT_TRUE(isNew);
+  EXPECT_EQ(id, mRegistry.remove(first));
+  EXPECT_EQ(0u, mRegistry.find(first));
+
+  buffer_handle_t second = handle();
+  uint64_t newId = mRegistry.acquire(second, &isNew);
+  EXPECT_TRUE(isNew);
+  EXPECT_NE(id, newId);
+  EXPECT_EQ(BufferRegistry::slotOf(id), BufferRegistry::slotOf(newId));
+  EXPECT_EQ(BufferRegistry::generationOf(id) + 1,
+            BufferRegistry::generationOf(newId));
+
+  // an evicted idle buffer frees its slot the same way
+  mRegistry.release(second, 1);
+  uint64_t freedId = 0;
+  EXPECT_FALSE(mRegistry.evictIdle(0, 1, &freedId));
+  ASSERT_TRUE(mRegistry.evictIdle(0, 2, &freedId));
+  EXPECT_EQ(newId, freedId);
+  uint64_t thirdId = mRegistry.acquire(handle());
+  EXPECT_EQ(BufferRegistry::slotOf(id), BufferRegistry::slotOf(thirdId));
+  EXPECT_NE(newId, thirdId);
+  EXPECT_NE(id, thirdId);
+}
+
+// handles gralloc imported for one dma-buf share its slot, it is freed with
+// the last of them
+TEST_F(BufferRegistryTest, HandlesOfOneBufferShareSlot) {
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+  buffer_handle_t first = handle(fds[0]);
+  buffer_handle_t alias = handle(dup(fds[0]));
+  close(fds[1]);
+
+  bool isNew = false;
+  uint64_t id = mRegistry.acquire(first, &isNew);
+  EXPECT_TRUE(isNew);
+  EXPECT_EQ(id, mRegistry.acquire(alias, &isNew));
+  EXPECT_FALSE(isNew);
+  EXPECT_EQ(0u, mRegistry.remove(first));
+  EXPECT_EQ(id, mRegistry.find(alias));
+  EXPECT_EQ(id, mRegistry.remove(alias));
+}
+
+}  // namespace
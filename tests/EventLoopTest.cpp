@@ -0,0 +1,136 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+// The same cases on every EventLoop backend. Only fresh readiness is
+// checked, the io_uring backend reports a change once where epoll repeats
+// it while it lasts.
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <memory>
+
+#include <gtest/gtest.h>
+
+#include "EventLoop.h"
+
+namespace {
+
+class EventLoopTest : public ::testing::Test {
+ protected:
+  void TearDown() override {
+    for (auto fd : mFds) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+  }
+
+  // false if backend isn't available here and epoll was made instead
+  bool create(const char* backend) {
+    mLoop = EventLoop::create(backend);
+    if (!mLoop)
+      return false;
+    if (strcmp(mLoop->name(), backend)) {
+      printf("%s unavailable, skipped\n", backend);
+      return false;
+    }
+    return true;
+  }
+
+  // events of fd reported within timeoutMs, stops at the first
+  uint32_t eventsOf(int fd, int timeoutMs) {
+    auto end = std::chrono::steady_clock::now() +
+               std::chrono::milliseconds(timeoutMs);
+    uint32_t events = 0;
+    while (!events && std::chrono::steady_clock::now() < end) {
+      EventLoop::Event ev[8];
+      int n = mLoop->wait(ev, 8, 10);
+      for (int i = 0; i < n; i++) {
+        if (ev[i].fd == fd) {
+          events |= ev[i].events;
+        }
+      }
+    }
+    return events;
+  }
+
+  void drain(int fd) {
+    char buf[64];
+    while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+    }
+  }
+
+  void runCases() {
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, mFds));
+    int fd = mFds[0];
+    int peer = mFds[1];
+
+    // register
+    ASSERT_EQ(0, mLoop->add(fd, EPOLLIN));
+    EXPECT_EQ(-1, mLoop->add(fd, EPOLLIN));
+    EXPECT_EQ(0u, eventsOf(fd, 50));
+    ASSERT_EQ(1, write(peer, "a", 1));
+    EXPECT_EQ((uint32_t)EPOLLIN, eventsOf(fd, 1000) & (EPOLLIN | EPOLLOUT));
+    drain(fd);
+
+    // modify, a socket with room is writable right away
+    ASSERT_EQ(0, mLoop->mod(fd, EPOLLIN | EPOLLOUT));
+    EXPECT_TRUE(eventsOf(fd, 1000) & EPOLLOUT);
+    ASSERT_EQ(0, mLoop->mod(fd, EPOLLIN));
+    eventsOf(fd, 50);
+    ASSERT_EQ(1, write(peer, "b", 1));
+    EXPECT_EQ((uint32_t)EPOLLIN, eventsOf(fd, 1000) & (EPOLLIN | EPOLLOUT));
+    drain(fd);
+
+    // unregister, then a new fd with the number of the old one
+    ASSERT_EQ(0, mLoop->del(fd));
+    EXPECT_EQ(-1, mLoop->del(fd));
+    EXPECT_EQ(-1, mLoop->mod(fd, EPOLLIN));
+    ASSERT_EQ(1, write(peer, "c", 1));
+    EXPECT_EQ(0u, eventsOf(fd, 50));
+
+    close(fd);
+    close(peer);
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, mFds));
+    ASSERT_EQ(0, mLoop->add(mFds[0], EPOLLIN));
+    ASSERT_EQ(1, write(mFds[1], "d", 1));
+    EXPECT_TRUE(eventsOf(mFds[0], 1000) & EPOLLIN);
+  }
+
+  std::unique_ptr<EventLoop> mLoop;
+  int mFds[2] = {-1, -1};
+};
+
+TEST_F(EventLoopTest, Epoll) {
+  ASSERT_TRUE(create("epoll"));
+  runCases();
+}
+
+TEST_F(EventLoopTest, Uring) {
+  if (!create("io_uring"))
+    return;
+  runCases();
+}
+
+}  // namespace
@@ -0,0 +1,160 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+// PixelCodec round trips and malformed input.
+
+#include <stdint.h>
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "PixelCodec.h"
+
+namespace {
+
+class PixelCodecTest : public ::testing::Test {
+ protected:
+  // deterministic pixels, few distinct values when colors is small
+  uint32_t next(uint32_t colors = 0) {
+    mSeed = mSeed * 1103515245 + 12345;
+    uint32_t v = mSeed >> 8;
+    return colors ? 0xff000000 | (v % colors) : v;
+  }
+
+  // encodes rect of image and decodes it into a blank image, which then
+  // has to match image inside rect and stay blank outside
+  uint32_t roundTrip(const std::vector<uint32_t>& image,
+                     uint32_t stride,
+                     const rect_t& rect) {
+    std::vector<uint8_t> encoded;
+    uint32_t codec =
+        mCodec.encode((const uint8_t*)image.data(), stride, rect, encoded);
+    std::vector<uint32_t> decoded(image.size(), 0);
+    EXPECT_EQ(0, mCodec.decode(codec, encoded.data(), encoded.size(),
+                               (uint8_t*)decoded.data(), stride, rect));
+    for (size_t i = 0; i < image.size(); i++) {
+      int x = i % stride;
+      int y = i / stride;
+      bool inside = x >= rect.left && x < rect.right && y >= rect.top &&
+                    y < rect.bottom;
+      EXPECT_EQ(inside ? image[i] : 0u, decoded[i]) << "at " << x << "," << y;
+    }
+    mEncodedSize = encoded.size();
+    return codec;
+  }
+
+  PixelCodec mCodec;
+  uint32_t mSeed = 1;
+  size_t mEncodedSize = 0;
+};
+
+TEST_F(PixelCodecTest, RandomPixelsGoRaw) {
+  std::vector<uint32_t> image(64 * 48);
+  for (auto& px : image) {
+    px = next();
+  }
+  rect_t rect = {0, 0, 64, 48};
+  EXPECT_EQ((uint32_t)PIXEL_CODEC_RAW, roundTrip(image, 64, rect));
+  EXPECT_EQ(image.size() * 4, mEncodedSize);
+}
+
+// runs are at most 129 pixels, longer ones take several control bytes
+TEST_F(PixelCodecTest, LongRuns) {
+  std::vector<uint32_t> image(300 * 4, 0xff336699);
+  rect_t rect = {0, 0, 300, 4};
+  EXPECT_EQ((uint32_t)PIXEL_CODEC_RLE32, roundTrip(image, 300, rect));
+  // 1200 pixels in 10 runs of 5 bytes
+  EXPECT_EQ(10u * 5, mEncodedSize);
+
+  // a run of 130 leaves one pixel for a literal
+  std::vector<uint32_t> row(130, 0xff000001);
+  rect_t rowRect = {0, 0, 130, 1};
+  EXPECT_EQ((uint32_t)PIXEL_CODEC_RLE32, roundTrip(row, 130, rowRect));
+  EXPECT_EQ(5u + 5, mEncodedSize);
+}
+
+TEST_F(PixelCodecTest, LiteralsBetweenRuns) {
+  std::vector<uint32_t> image;
+  for (size_t len : {1, 3, 2, 200, 1, 1, 140, 5, 128, 129, 2, 7}) {
+    // a literal stretch of len pixels, then a run of len pixels
+    for (size_t i = 0; i < len; i++) {
+      image.push_back(0xff000000 | (uint32_t)(image.size() + 1));
+    }
+    uint32_t v = next(4);
+    image.insert(image.end(), len, v);
+  }
+  image.resize(image.size() / 8 * 8);
+  uint32_t width = 8;
+  rect_t rect = {0, 0, (int)width, (int)(image.size() / width)};
+  EXPECT_EQ((uint32_t)PIXEL_CODEC_RLE32, roundTrip(image, width, rect));
+}
+
+// only the rect is coded, rows are stride pixels apart
+TEST_F(PixelCodecTest, RectOfWiderImage) {
+  uint32_t stride = 50;
+  std::vector<uint32_t> image(stride * 30);
+  for (auto& px : image) {
+    px = next(3);
+  }
+  rect_t rect = {5, 3, 37, 21};
+  roundTrip(image, stride, rect);
+  rect_t column = {49, 0, 50, 30};
+  roundTrip(image, stride, column);
+}
+
+TEST_F(PixelCodecTest, RejectsMalformedInput) {
+  std::vector<uint32_t> image(10 * 10, 0xff00ff00);
+  for (size_t i = 0; i < image.size(); i += 3) {
+    image[i] = next();
+  }
+  rect_t rect = {0, 0, 10, 10};
+  std::vector<uint8_t> encoded;
+  ASSERT_EQ((uint32_t)PIXEL_CODEC_RLE32,
+            mCodec.encode((const uint8_t*)image.data(), 10, rect, encoded));
+  std::vector<uint32_t> out(image.size());
+  uint8_t* pixels = (uint8_t*)out.data();
+
+  // cut in a pixel, and a whole pixel short
+  EXPECT_EQ(-1, mCodec.decode(PIXEL_CODEC_RLE32, encoded.data(),
+                              encoded.size() - 1, pixels, 10, rect));
+  EXPECT_EQ(-1, mCodec.decode(PIXEL_CODEC_RLE32, encoded.data(),
+                              encoded.size() - 4, pixels, 10, rect));
+  // more pixels than the rect holds, by a run and by literals
+  rect_t small = {0, 0, 10, 1};
+  uint8_t run[] = {255, 1, 2, 3, 4};
+  EXPECT_EQ(-1, mCodec.decode(PIXEL_CODEC_RLE32, run, sizeof(run), pixels,
+                              10, small));
+  std::vector<uint8_t> literals(1 + 11 * 4, 0);
+  literals[0] = 10;
+  EXPECT_EQ(-1, mCodec.decode(PIXEL_CODEC_RLE32, literals.data(),
+                              literals.size(), pixels, 10, small));
+  // too few pixels
+  literals.resize(1 + 9 * 4);
+  literals[0] = 8;
+  EXPECT_EQ(-1, mCodec.decode(PIXEL_CODEC_RLE32, literals.data(),
+                              literals.size(), pixels, 10, small));
+  // raw of the wrong size, unknown codec
+  EXPECT_EQ(-1, mCodec.decode(PIXEL_CODEC_RAW, literals.data(),
+                              literals.size(), pixels, 10, small));
+  EXPECT_EQ(-1, mCodec.decode(0xff, literals.data(), literals.size(), pixels,
+                              10, small));
+}
+
+}  // namespace
@@ -0,0 +1,405 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+// RemoteDisplay against a fake remote on the other end of a socketpair.
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "RemoteDisplay.h"
+
+namespace {
+
+class Listener : public DisplayStatusListener, public DisplayEventListener {
+ public:
+  int onConnect(int fd) override { return 0; }
+  int onDisconnect(int fd) override { return 0; }
+  int onSendPending(int fd, bool pending) override { return 0; }
+  int onChannelCreated(int fd, int channelFd) override { return 0; }
+  int onBufferDisplayed(const buffer_info_t& info) override { return 0; }
+  int onPresented(std::vector<layer_buffer_info_t>& layerBuffer,
+                  int& fence) override {
+    return 0;
+  }
+  int onBackpressure(bool congested) override { return 0; }
+  int onFrameDone(uint32_t frameSeq) override {
+    done.push_back(frameSeq);
+    return 0;
+  }
+
+  std::vector<uint32_t> done;
+};
+
+class RemoteDisplayTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, mFds));
+    mDisplay = new RemoteDisplay(mFds[0]);
+    mDisplay->setDisplayStatusListener(&mListener);
+    mDisplay->setDisplayEventListener(&mListener);
+    mHandle = (native_handle_t*)calloc(1, sizeof(native_handle_t) + 8);
+    mHandle->version = sizeof(native_handle_t);
+    mHandle->numInts = 2;
+  }
+  void TearDown() override {
+    delete mDisplay;
+    close(mFds[1]);
+    for (auto fd : mReceivedFds) {
+      close(fd);
+    }
+    free(mHandle);
+  }
+
+  // acks the display info as a remote with the protocol version and caps,
+  // capsSize is what remote claims to have filled in of display_caps_t
+  void connect(uint32_t version,
+               uint64_t caps,
+               uint32_t capsSize = sizeof(display_caps_t)) {
+    display_info_event_t info;
+    memset(&info, 0, sizeof(info));
+    display_flags flags;
+    flags.value = 0;
+    flags.version = version;
+    flags.mode = 2;
+    info.event.type = DD_EVENT_DISPINFO_ACK;
+    info.event.size = sizeof(info) + sizeof(display_caps_t);
+    info.info.flags = flags.value;
+    info.info.width = 1280;
+    info.info.height = 720;
+
+    display_caps_t remoteCaps;
+    memset(&remoteCaps, 0, sizeof(remoteCaps));
+    remoteCaps.version = DISPLAY_CAPS_VERSION;
+    remoteCaps.size = capsSize;
+    remoteCaps.caps = caps;
+    remoteCaps.maxLayers = 4;
+
+    // the caps follow the info unaligned
+    std::vector<uint8_t> msg(info.event.size);
+    memcpy(msg.data(), &info, sizeof(info));
+    memcpy(msg.data() + sizeof(info), &remoteCaps, sizeof(remoteCaps));
+    ASSERT_EQ((ssize_t)msg.size(), send(mFds[1], msg.data(), msg.size(), 0));
+    mDisplay->onDisplayEvent();
+  }
+
+  // headers of the messages the hal sent since the last call
+  std::vector<display_event_t> received() {
+    std::vector<display_event_t> events;
+    std::vector<uint8_t> data(64 * 1024);
+    ssize_t len;
+    size_t used = 0;
+    for (;;) {
+      struct iovec iov = {data.data() + used, data.size() - used};
+      char cmsgBuf[CMSG_SPACE(sizeof(int) * 8)];
+      struct msghdr hdr;
+      memset(&hdr, 0, sizeof(hdr));
+      hdr.msg_iov = &iov;
+      hdr.msg_iovlen = 1;
+      hdr.msg_control = cmsgBuf;
+      hdr.msg_controllen = sizeof(cmsgBuf);
+      if ((len = recvmsg(mFds[1], &hdr, 0)) <= 0)
+        break;
+      used += len;
+      for (auto cmsg = CMSG_FIRSTHDR(&hdr); cmsg;
+           cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+        if (cmsg->cmsg_type != SCM_RIGHTS)
+          continue;
+        size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int* fds = (int*)CMSG_DATA(cmsg);
+        mReceivedFds.insert(mReceivedFds.end(), fds, fds + n);
+      }
+    }
+    for (size_t offset = 0; offset + sizeof(display_event_t) <= used;) {
+      display_event_t ev;
+      memcpy(&ev, data.data() + offset, sizeof(ev));
+      events.push_back(ev);
+      offset += ev.size;
+    }
+    mReceivedData.assign(data.begin(), data.begin() + used);
+    return events;
+  }
+
+  void ack(uint32_t type, uint32_t id, size_t size) {
+    std::vector<uint8_t> msg(size, 0);
+    display_event_t ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = type;
+    ev.size = size;
+    ev.id = id;
+    memcpy(msg.data(), &ev, sizeof(ev));
+    ASSERT_EQ((ssize_t)size, send(mFds[1], msg.data(), size, 0));
+    mDisplay->onDisplayEvent();
+  }
+
+  int mFds[2];
+  RemoteDisplay* mDisplay = nullptr;
+  Listener mListener;
+  native_handle_t* mHandle = nullptr;
+  // fds the hal sent, closed at the end
+  std::vector<int> mReceivedFds;
+  // the messages received() returned last
+  std::vector<uint8_t> mReceivedData;
+};
+
+typedef std::pair<uint32_t, std::vector<uint8_t>> Section;
+
+// type and payload of the sections of the frame commit at data
+std::vector<Section> sections(const uint8_t* data) {
+  frame_commit_event_t ev;
+  memcpy(&ev, data, sizeof(ev));
+  std::vector<Section> result;
+  size_t offset = sizeof(ev);
+  for (uint32_t i = 0; i < ev.numSections; i++) {
+    frame_section_t section;
+    memcpy(&section, data + offset, sizeof(section));
+    offset += sizeof(section);
+    result.emplace_back(section.type,
+                        std::vector<uint8_t>(data + offset,
+                                             data + offset + section.size));
+    offset += section.size;
+  }
+  return result;
+}
+
+uint32_t lastId(const std::vector<display_event_t>& events, uint32_t type) {
+  uint32_t id = 0;
+  for (auto& ev : events) {
+    if (ev.type == type) {
+      id = ev.id;
+    }
+  }
+  return id;
+}
+
+// legacy frames are completed by the ack echoing the id of their last
+// request, not by the request timeout
+TEST_F(RemoteDisplayTest, LegacyFrameAckedById) {
+  connect(DISPLAY_VERSION_INLINE_FDS,
+          DISPLAY_CAP_INLINE_FDS | DISPLAY_CAP_REQUEST_ID);
+  ASSERT_TRUE(mDisplay->hasCap(DISPLAY_CAP_REQUEST_ID));
+  ASSERT_FALSE(mDisplay->hasCap(DISPLAY_CAP_FRAME_COMMIT));
+  received();
+
+  FrameCommit frame;
+  frame.frameSeq = 1;
+  frame.fbTarget = mHandle;
+  RemoteRequestPtr request;
+  ASSERT_EQ(0, mDisplay->commitFrame(frame, &request));
+  uint32_t id = lastId(received(), DD_EVENT_DISPLAY_REQ);
+  ASSERT_NE(0u, id);
+  ack(DD_EVENT_DISPLAY_ACK, id, sizeof(buffer_info_event_t));
+  EXPECT_TRUE(request->done());
+  EXPECT_EQ(0, request->status());
+  ASSERT_EQ(1u, mListener.done.size());
+  EXPECT_EQ(1u, mListener.done.back());
+
+  layer_buffer_info_t layerBuffer;
+  memset(&layerBuffer, 0, sizeof(layerBuffer));
+  layerBuffer.layerId = 1;
+  layerBuffer.bufferId = (uint64_t)mHandle;
+  layerBuffer.fence = -1;
+  frame.frameSeq = 2;
+  frame.layerBuffers.push_back(layerBuffer);
+  ASSERT_EQ(0, mDisplay->commitFrame(frame, &request));
+  auto events = received();
+  // the display ack of the frame doesn't complete it
+  ack(DD_EVENT_DISPLAY_ACK, lastId(events, DD_EVENT_DISPLAY_REQ),
+      sizeof(buffer_info_event_t));
+  EXPECT_FALSE(request->done());
+  id = lastId(events, DD_EVENT_PRESENT_LAYERS_REQ);
+  ASSERT_NE(0u, id);
+  ack(DD_EVENT_PRESENT_LAYERS_ACK, id, sizeof(present_layers_ack_event_t));
+  EXPECT_TRUE(request->done());
+  ASSERT_EQ(2u, mListener.done.size());
+  EXPECT_EQ(2u, mListener.done.back());
+}
+
+// remotes which echo no id in acks still complete frames by type
+TEST_F(RemoteDisplayTest, LegacyFrameAckedByType) {
+  connect(DISPLAY_VERSION_INLINE_FDS,
+          DISPLAY_CAP_INLINE_FDS | DISPLAY_CAP_REQUEST_ID);
+  received();
+
+  FrameCommit frame;
+  frame.frameSeq = 1;
+  frame.fbTarget = mHandle;
+  ASSERT_EQ(0, mDisplay->commitFrame(frame));
+  received();
+  ack(DD_EVENT_DISPLAY_ACK, 0, sizeof(buffer_info_event_t));
+  ASSERT_EQ(1u, mListener.done.size());
+  EXPECT_EQ(1u, mListener.done.back());
+}
+
+// a frame commit waits for the control message creating its buffers, not
+// for control messages sent after it
+TEST_F(RemoteDisplayTest, FrameChannelBarrierIsItsLastBuffer) {
+  connect(DISPLAY_VERSION_FRAME_COMMIT,
+          DISPLAY_CAP_INLINE_FDS | DISPLAY_CAP_REQUEST_ID |
+              DISPLAY_CAP_FRAME_COMMIT | DISPLAY_CAP_FRAME_CHANNEL);
+  ASSERT_EQ(DD_EVENT_SETUP_FRAME_CHANNEL, received().back().type);
+  ASSERT_EQ(1u, mReceivedFds.size());
+  int channel = mReceivedFds[0];
+
+  auto commitBarrier = [&](buffer_handle_t buffer, uint32_t seq) {
+    FrameCommit frame;
+    frame.frameSeq = seq;
+    frame.fbTarget = buffer;
+    EXPECT_EQ(0, mDisplay->commitFrame(frame));
+    frame_commit_event_t ev;
+    memset(&ev, 0, sizeof(ev));
+    EXPECT_LT(0, recv(channel, &ev, sizeof(ev), MSG_DONTWAIT));
+    EXPECT_EQ(DD_EVENT_FRAME_COMMIT, ev.event.type);
+    return ev.event.pad;
+  };
+
+  uint32_t barrier = commitBarrier(mHandle, 1);
+  EXPECT_NE(0u, barrier);
+  ASSERT_EQ(DD_EVENT_CREATE_BUFFER, received().back().type);
+
+  native_handle_t* other =
+      (native_handle_t*)calloc(1, sizeof(native_handle_t) + 8);
+  other->version = sizeof(native_handle_t);
+  other->numInts = 2;
+  ASSERT_EQ(0, mDisplay->createBuffer(other));
+  ASSERT_EQ(DD_EVENT_CREATE_BUFFER, received().back().type);
+
+  EXPECT_EQ(barrier, commitBarrier(mHandle, 2));
+  EXPECT_GT(commitBarrier(other, 3), barrier);
+  mDisplay->removeBuffer(other);
+  free(other);
+}
+
+// a delta has only the fields of the changed bits, z goes with the order
+TEST_F(RemoteDisplayTest, LayerDeltaCarriesChangedFields) {
+  connect(DISPLAY_VERSION_FRAME_COMMIT,
+          DISPLAY_CAP_INLINE_FDS | DISPLAY_CAP_REQUEST_ID |
+              DISPLAY_CAP_FRAME_COMMIT | DISPLAY_CAP_LAYER_DELTA);
+  received();
+
+  layer_info_t moved;
+  memset(&moved, 0, sizeof(moved));
+  moved.layerId = 1;
+  moved.dstFrame = {1, 2, 3, 4};
+  moved.planeAlpha = 0.5f;
+  moved.z = 7;  // not changed, not sent
+  moved.changed = LAYER_CHANGED_DST_FRAME | LAYER_CHANGED_ALPHA;
+  layer_info_t raised;
+  memset(&raised, 0, sizeof(raised));
+  raised.layerId = 2;
+  raised.z = 3;
+  raised.changed = LAYER_CHANGED_Z;
+
+  FrameCommit frame;
+  frame.frameSeq = 1;
+  frame.layers = {moved, raised};
+  frame.zOrder = {1, 2};
+  ASSERT_EQ(0, mDisplay->commitFrame(frame));
+  auto events = received();
+  ASSERT_EQ(1u, events.size());
+  ASSERT_EQ(DD_EVENT_FRAME_COMMIT, events[0].type);
+  auto parsed = sections(mReceivedData.data());
+  ASSERT_EQ(2u, parsed.size());
+
+  // one record, rect and alpha padded to 8 bytes
+  EXPECT_EQ((uint32_t)FRAME_SECTION_LAYER_DELTAS, parsed[0].first);
+  const std::vector<uint8_t>& deltas = parsed[0].second;
+  ASSERT_EQ(sizeof(layer_delta_t) + 24, deltas.size());
+  layer_delta_t delta;
+  memcpy(&delta, deltas.data(), sizeof(delta));
+  EXPECT_EQ(1u, delta.layerId);
+  EXPECT_EQ((uint32_t)(LAYER_CHANGED_DST_FRAME | LAYER_CHANGED_ALPHA),
+            delta.mask);
+  EXPECT_EQ(24u, delta.size);
+  rect_t dstFrame;
+  memcpy(&dstFrame, deltas.data() + sizeof(delta), sizeof(dstFrame));
+  EXPECT_EQ(0, memcmp(&moved.dstFrame, &dstFrame, sizeof(dstFrame)));
+  float alpha;
+  memcpy(&alpha, deltas.data() + sizeof(delta) + sizeof(dstFrame),
+         sizeof(alpha));
+  EXPECT_EQ(0.5f, alpha);
+
+  EXPECT_EQ((uint32_t)FRAME_SECTION_Z_ORDER, parsed[1].first);
+  ASSERT_EQ(2 * sizeof(uint64_t), parsed[1].second.size());
+  uint64_t zOrder[2];
+  memcpy(zOrder, parsed[1].second.data(), sizeof(zOrder));
+  EXPECT_EQ(1u, zOrder[0]);
+  EXPECT_EQ(2u, zOrder[1]);
+
+  // only moved in z, nothing but the order
+  frame.frameSeq = 2;
+  frame.layers = {raised};
+  frame.zOrder = {2, 1};
+  ASSERT_EQ(0, mDisplay->commitFrame(frame));
+  received();
+  parsed = sections(mReceivedData.data());
+  ASSERT_EQ(1u, parsed.size());
+  EXPECT_EQ((uint32_t)FRAME_SECTION_Z_ORDER, parsed[0].first);
+}
+
+// a connection knows none of the buffers, the first frame using one
+// creates it on remote before the commit
+TEST_F(RemoteDisplayTest, NewConnectionCreatesBufferBeforeFrame) {
+  connect(DISPLAY_VERSION_FRAME_COMMIT,
+          DISPLAY_CAP_INLINE_FDS | DISPLAY_CAP_REQUEST_ID |
+              DISPLAY_CAP_FRAME_COMMIT);
+  received();
+  ASSERT_EQ(0u, mDisplay->bufferId(mHandle));
+
+  layer_buffer_info_t layerBuffer;
+  memset(&layerBuffer, 0, sizeof(layerBuffer));
+  layerBuffer.layerId = 1;
+  layerBuffer.bufferId = (uint64_t)mHandle;
+  layerBuffer.fence = -1;
+  FrameCommit frame;
+  frame.frameSeq = 1;
+  frame.createdLayers.push_back(1);
+  frame.layerBuffers.push_back(layerBuffer);
+  ASSERT_EQ(0, mDisplay->commitFrame(frame));
+  auto events = received();
+  ASSERT_EQ(2u, events.size());
+  EXPECT_EQ(DD_EVENT_CREATE_BUFFER, events[0].type);
+  EXPECT_EQ(DD_EVENT_FRAME_COMMIT, events[1].type);
+  EXPECT_NE(0u, mDisplay->bufferId(mHandle));
+
+  // known from now on
+  frame.frameSeq = 2;
+  frame.createdLayers.clear();
+  ASSERT_EQ(0, mDisplay->commitFrame(frame));
+  events = received();
+  ASSERT_EQ(1u, events.size());
+  EXPECT_EQ(DD_EVENT_FRAME_COMMIT, events[0].type);
+}
+
+}  // namespace
+
+// fields past the size remote sent are not taken from the bytes after it
+TEST_F(RemoteDisplayTest, CapsBeyondSizeAreZero) {
+  connect(DISPLAY_VERSION_INLINE_FDS, DISPLAY_CAP_INLINE_FDS,
+          offsetof(display_caps_t, maxLayers));
+  EXPECT_EQ(DISPLAY_CAP_INLINE_FDS, mDisplay->remoteCaps().caps);
+  EXPECT_EQ(0u, mDisplay->remoteCaps().maxLayers);
+}
@@ -0,0 +1,176 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+// ShmRing with the hal side writing and a remote attached to the same
+// memfd reading. The test maps the memfd too to look at and corrupt the
+// hal to remote ring.
+
+#include <poll.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "ShmRing.h"
+
+namespace {
+
+class ShmRingTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_EQ(0, mHal.create(4096));
+    ASSERT_EQ(4096u, mHal.size());
+    // the remote writes to the eventfd the hal waits on and the other way
+    ASSERT_EQ(0, mRemote.attach(dup(mHal.memFd()), mHal.size(),
+                                dup(mHal.rxEventFd()), dup(mHal.txEventFd())));
+
+    mMapSize = 2 * sizeof(shm_ring_header_t) + 2 * mHal.size();
+    void* base = mmap(nullptr, mMapSize, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      mHal.memFd(), 0);
+    ASSERT_NE(MAP_FAILED, base);
+    mBase = (uint8_t*)base;
+    mHeader = (shm_ring_header_t*)mBase;
+    mData = mBase + 2 * sizeof(shm_ring_header_t);
+  }
+  void TearDown() override {
+    if (mBase) {
+      munmap(mBase, mMapSize);
+    }
+  }
+
+  static std::vector<uint8_t> message(size_t size, uint8_t seed) {
+    std::vector<uint8_t> msg(size);
+    for (size_t i = 0; i < size; i++) {
+      msg[i] = (uint8_t)(seed + i * 7);
+    }
+    return msg;
+  }
+  int write(const std::vector<uint8_t>& msg) {
+    struct iovec iov = {(void*)msg.data(), msg.size()};
+    return mHal.write(&iov, 1, 0, 0);
+  }
+  // the record at byte pos of the hal to remote ring
+  shm_ring_record_t* record(uint32_t pos) {
+    return (shm_ring_record_t*)(mData + (pos & (mHal.size() - 1)));
+  }
+  static bool signalled(int fd) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    return poll(&pfd, 1, 0) == 1;
+  }
+
+  ShmRing mHal;
+  ShmRing mRemote;
+  uint8_t* mBase = nullptr;
+  size_t mMapSize = 0;
+  shm_ring_header_t* mHeader = nullptr;
+  uint8_t* mData = nullptr;
+};
+
+// a record crossing the end of the data is split on write and joined on
+// read
+TEST_F(ShmRingTest, RecordWrapsAroundEnd) {
+  std::vector<uint8_t> buf;
+  shm_ring_record_t rec;
+  auto first = message(3000, 1);
+  ASSERT_EQ(0, write(first));
+  ASSERT_EQ(3000, mRemote.read(buf, &rec));
+  EXPECT_EQ(first, buf);
+
+  auto wrapped = message(2000, 2);
+  ASSERT_GT(mHeader->head + sizeof(rec) + 2000, mHal.size());
+  struct iovec iov[2] = {{wrapped.data(), 500},
+                         {wrapped.data() + 500, wrapped.size() - 500}};
+  ASSERT_EQ(0, mHal.write(iov, 2, 7, SHM_RING_RECORD_FDS));
+  ASSERT_EQ(2000, mRemote.read(buf, &rec));
+  EXPECT_EQ(wrapped, buf);
+  EXPECT_EQ(7u, rec.socketSeq);
+  EXPECT_EQ((uint32_t)SHM_RING_RECORD_FDS, rec.flags);
+  EXPECT_EQ(0, mRemote.read(buf, &rec));
+}
+
+// a producer finding the ring full asks for a wakeup, the read making room
+// gives it
+TEST_F(ShmRingTest, FullRingWakesProducer) {
+  auto msg = message(1000, 3);
+  int written = 0;
+  while (write(msg) == 0) {
+    written++;
+  }
+  ASSERT_EQ(4, written);
+  EXPECT_EQ(1u, mHeader->producerWaiting);
+  EXPECT_FALSE(signalled(mHal.rxEventFd()));
+
+  std::vector<uint8_t> buf;
+  shm_ring_record_t rec;
+  ASSERT_EQ(1000, mRemote.read(buf, &rec));
+  EXPECT_EQ(0u, mHeader->producerWaiting);
+  EXPECT_TRUE(signalled(mHal.rxEventFd()));
+  mHal.clearEvent();
+  EXPECT_EQ(0, write(msg));
+  EXPECT_EQ(0u, mHeader->producerWaiting);
+}
+
+TEST_F(ShmRingTest, RejectsCorruptedHeadAndTail) {
+  std::vector<uint8_t> buf;
+  shm_ring_record_t rec;
+  mHeader->head = mHeader->tail + 2 * mHal.size();
+  EXPECT_EQ(-1, mRemote.read(buf, &rec));
+  EXPECT_EQ(-1, write(message(16, 4)));
+
+  // the tail running ahead of the head is as bad
+  mHeader->head = 0;
+  mHeader->tail = 64;
+  EXPECT_EQ(-1, mRemote.read(buf, &rec));
+  EXPECT_EQ(-1, write(message(16, 4)));
+}
+
+TEST_F(ShmRingTest, RejectsOversizedRecord) {
+  std::vector<uint8_t> buf;
+  shm_ring_record_t rec;
+  ASSERT_EQ(0, write(message(100, 5)));
+  record(mHeader->tail)->size = 4000;
+  EXPECT_EQ(-1, mRemote.read(buf, &rec));
+
+  // nor can the hal write more than a record holds
+  EXPECT_EQ(-1, write(message(mHal.maxMessageSize() + 1, 5)));
+  EXPECT_EQ(-1, write(std::vector<uint8_t>()));
+}
+
+// a record without a message is dropped, the one behind it is read
+TEST_F(ShmRingTest, SkipsEmptyRecord) {
+  uint32_t head = mHeader->head;
+  shm_ring_record_t* empty = record(head);
+  memset(empty, 0, sizeof(*empty));
+  mHeader->head = head + sizeof(*empty);
+
+  auto msg = message(40, 6);
+  ASSERT_EQ(0, write(msg));
+  std::vector<uint8_t> buf;
+  shm_ring_record_t rec;
+  ASSERT_EQ(40, mRemote.read(buf, &rec));
+  EXPECT_EQ(msg, buf);
+  EXPECT_EQ(mHeader->head, mHeader->tail);
+  EXPECT_EQ(0, mRemote.read(buf, &rec));
+}
+
+}  // namespace
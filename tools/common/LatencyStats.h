@@ -0,0 +1,58 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+#ifndef __LATENCY_STATS_H__
+#define __LATENCY_STATS_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <vector>
+
+// Latency samples in ns and their percentiles, for the host tools.
+class LatencyStats {
+ public:
+  void add(int64_t ns) { mSamples.push_back(ns); }
+  size_t count() const { return mSamples.size(); }
+  void clear() { mSamples.clear(); }
+
+  // prints "<name> <count> <unit>, latency ms p50 .. p90 .. p99 .. max .."
+  void report(const char* name, const char* unit) {
+    if (mSamples.empty()) {
+      printf("%-9s no %s\n", name, unit);
+      return;
+    }
+    std::sort(mSamples.begin(), mSamples.end());
+    printf("%-9s %zd %s, latency ms p50 %.2f p90 %.2f p99 %.2f max %.2f\n",
+           name, mSamples.size(), unit, percentile(50), percentile(90),
+           percentile(99), mSamples.back() / 1e6);
+  }
+
+ private:
+  // in ms, samples must be sorted
+  double percentile(size_t p) const {
+    return mSamples[(mSamples.size() - 1) * p / 100] / 1e6;
+  }
+
+ private:
+  std::vector<int64_t> mSamples;
+};
+
+#endif  // __LATENCY_STATS_H__
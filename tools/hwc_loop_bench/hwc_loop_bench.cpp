@@ -0,0 +1,217 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+
+// Compares the EventLoop backends of the hal socket thread on a plain Linux
+// box. A writer thread sends one small message per frame to each of a
+// number of remote sockets, the loop thread drains them like RemoteDisplay
+// and, for a share of messages, asks for EPOLLOUT and drops it again on the
+// next writable event like RemoteDisplayMgr::onSendPending under
+// backpressure.
+//
+// Prints for every backend the waits, the loop thread cpu time per message
+// and the send to handle latency percentiles.
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <thread>
+#include <vector>
+
+#include "EventLoop.h"
+#include "LatencyStats.h"
+
+struct Options {
+  int remotes = 12;
+  int frames = 5000;
+  int fps = 0;
+  int backpressurePercent = 10;
+  const char* backend = nullptr;
+};
+
+struct Message {
+  int64_t sent;
+  uint32_t seq;
+  uint32_t pad;
+};
+
+static int64_t clockNs(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void writeFrames(const std::vector<int>& fds, const Options& opts) {
+  int64_t start = clockNs(CLOCK_MONOTONIC);
+  for (int frame = 0; frame < opts.frames; frame++) {
+    if (opts.fps > 0) {
+      int64_t due = start + frame * 1000000000LL / opts.fps;
+      int64_t wait = due - clockNs(CLOCK_MONOTONIC);
+      if (wait > 0) {
+        struct timespec ts = {(time_t)(wait / 1000000000LL),
+                              (long)(wait % 1000000000LL)};
+        nanosleep(&ts, nullptr);
+      }
+    }
+    for (auto fd : fds) {
+      Message msg = {clockNs(CLOCK_MONOTONIC), (uint32_t)frame, 0};
+      while (send(fd, &msg, sizeof(msg), MSG_NOSIGNAL) < 0 && errno == EINTR) {
+      }
+    }
+  }
+}
+
+static int runBackend(const char* backend, const Options& opts) {
+  std::unique_ptr<EventLoop> loop = EventLoop::create(backend);
+  if (!loop)
+    return -1;
+
+  std::vector<int> local;
+  std::vector<int> peers;
+  for (int i = 0; i < opts.remotes; i++) {
+    int sv[2];
+    // the writer blocks rather than drops when the loop falls behind, the
+    // loop reads with MSG_DONTWAIT
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+      perror("socketpair");
+      return -1;
+    }
+    local.push_back(sv[0]);
+    peers.push_back(sv[1]);
+    loop->add(sv[0], EPOLLIN);
+  }
+
+  const int64_t expected = (int64_t)opts.frames * opts.remotes;
+  int64_t handled = 0;
+  int64_t waits = 0;
+  int64_t wakeups = 0;
+  LatencyStats latency;
+
+  int64_t cpuStart = clockNs(CLOCK_THREAD_CPUTIME_ID);
+  int64_t wallStart = clockNs(CLOCK_MONOTONIC);
+  std::thread writer(writeFrames, std::cref(peers), std::cref(opts));
+
+  const int kMaxEvents = 32;
+  EventLoop::Event events[kMaxEvents];
+  while (handled < expected) {
+    int n = loop->wait(events, kMaxEvents, 1000);
+    waits++;
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("wait");
+      break;
+    }
+    for (int i = 0; i < n; i++) {
+      int fd = events[i].fd;
+      wakeups++;
+      if (events[i].events & EPOLLOUT) {
+        loop->mod(fd, EPOLLIN);
+      }
+      if (!(events[i].events & EPOLLIN))
+        continue;
+      bool backpressure = false;
+      Message msg;
+      while (recv(fd, &msg, sizeof(msg), MSG_DONTWAIT) == sizeof(msg)) {
+        latency.add(clockNs(CLOCK_MONOTONIC) - msg.sent);
+        handled++;
+        if ((int)(msg.seq % 100) < opts.backpressurePercent)
+          backpressure = true;
+      }
+      if (backpressure) {
+        loop->mod(fd, EPOLLIN | EPOLLOUT);
+      }
+    }
+  }
+  int64_t wall = clockNs(CLOCK_MONOTONIC) - wallStart;
+  int64_t cpu = clockNs(CLOCK_THREAD_CPUTIME_ID) - cpuStart;
+  writer.join();
+
+  printf("%-9s %d remotes, %" PRId64 " msgs, %" PRId64 " waits, %" PRId64
+         " wakeups, cpu %.2f us/msg (%.1f%% of %.2f s)\n",
+         loop->name(), opts.remotes, handled, waits, wakeups,
+         handled ? cpu / 1e3 / handled : 0.0, wall ? 100.0 * cpu / wall : 0.0,
+         wall / 1e9);
+  latency.report(loop->name(), "msgs");
+
+  for (int i = 0; i < opts.remotes; i++) {
+    loop->del(local[i]);
+    close(local[i]);
+    close(peers[i]);
+  }
+  return handled == expected ? 0 : -1;
+}
+
+static void usage(const char* name) {
+  fprintf(stderr,
+          "usage: %s [options]\n"
+          "  -b backend epoll or io_uring, default both one after another\n"
+          "  -n remotes number of remote sockets, default 12\n"
+          "  -c frames  messages sent to each remote, default 5000\n"
+          "  -f fps     frame rate of the writer, default as fast as it can\n"
+          "  -p percent messages which ask for EPOLLOUT, default 10\n",
+          name);
+}
+
+int main(int argc, char** argv) {
+  Options opts;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "b:n:c:f:p:h")) != -1) {
+    switch (opt) {
+      case 'b':
+        opts.backend = optarg;
+        break;
+      case 'n':
+        opts.remotes = atoi(optarg);
+        break;
+      case 'c':
+        opts.frames = atoi(optarg);
+        break;
+      case 'f':
+        opts.fps = atoi(optarg);
+        break;
+      case 'p':
+        opts.backpressurePercent = atoi(optarg);
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if (opts.remotes <= 0 || opts.frames <= 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  int ret = 0;
+  if (opts.backend) {
+    ret = runBackend(opts.backend, opts);
+  } else {
+    ret = runBackend("epoll", opts) | runBackend("io_uring", opts);
+  }
+  return ret < 0 ? 1 : 0;
+}
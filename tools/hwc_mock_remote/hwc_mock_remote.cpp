@@ -0,0 +1,591 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+// Stands in for the streamer behind the hal socket on a plain Linux box.
+// Answers DD_EVENT_DISPINFO_REQ with the configured mode and acks every
+// frame (DD_EVENT_DISPLAY_REQ, DD_EVENT_PRESENT_LAYERS_REQ and
+// DD_EVENT_FRAME_COMMIT) after a synthetic latency: frames are "encoded"
+// one after another for the encode time, then held for the network delay.
+// Buffers and fences are closed unused. Connected by TCP (-T) it gets
+// frames as DD_EVENT_DISPLAY_PIXELS and decodes them.
+//
+// Prints the frame rate received and the receive to ack latency
+// percentiles every report interval and for the whole run. This is only
+// the time a frame spends here; the hal logs the present to ack latency
+// it sees when hwc_vhal.latency_report is set to a frame count.
+
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+#include "LatencyStats.h"
+#include "PixelCodec.h"
+#include "display_protocol.h"
+
+struct Options {
+  const char* path = "/ipc/hwc-sock";
+  bool listenMode = false;
+  const char* tcpAddr = nullptr;
+  uint32_t width = 1280;
+  uint32_t height = 720;
+  uint32_t fps = 60;
+  uint32_t version = DISPLAY_VERSION_LAYER_DELTA;
+  uint32_t mode = 0;
+  uint32_t maxFramesInFlight = 0;
+  int64_t encodeNs = 0;
+  int64_t delayNs = 0;
+  int64_t reportNs = 5000000000LL;
+  int64_t durationNs = 0;
+};
+
+struct PendingAck {
+  int64_t due;
+  // when the frame was read off the socket, not when the hal presented it
+  int64_t received;
+  std::vector<uint8_t> msg;
+};
+
+static volatile sig_atomic_t gStop = 0;
+
+static void onSignal(int) {
+  gStop = 1;
+}
+
+static int64_t nowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+class MockRemote {
+ public:
+  MockRemote(int fd, const Options& opts) : mFd(fd), mOpts(opts) {
+    display_flags flags;
+    flags.value = 0;
+    flags.version = opts.version;
+    flags.mode = opts.mode;
+    mFlags = flags.value;
+  }
+
+  int run();
+
+ private:
+  int _recv(int64_t now);
+  int _handle(const display_event_t& ev, const uint8_t* msg, int64_t now);
+  int _sendDisplayInfo(const display_event_t& req);
+  int _decodePixels(const display_event_t& ev, const uint8_t* msg);
+  void _queueFrameAck(uint32_t frameSeq, uint32_t id, int64_t now);
+  void _queueAck(std::vector<uint8_t> msg, int64_t now);
+  int _sendAcks(int64_t now);
+  int _send(const void* data, size_t len);
+  void _report(const char* name, LatencyStats& latency, int64_t frames,
+               int64_t elapsed);
+
+ private:
+  int mFd;
+  const Options& mOpts;
+  uint32_t mFlags;
+  std::vector<uint8_t> mBuf;
+  // legacy remotes get the fds of a buffer in a 16 bytes trailer
+  size_t mSkipBytes = 0;
+  int64_t mEncodeDone = 0;
+  std::deque<PendingAck> mAcks;
+  // framebuffer rebuilt from DD_EVENT_DISPLAY_PIXELS
+  PixelCodec mCodec;
+  std::vector<uint8_t> mCanvas;
+  uint32_t mCanvasWidth = 0;
+  uint32_t mCanvasHeight = 0;
+  int64_t mPixelBytes = 0;
+
+  LatencyStats mLatency;
+  LatencyStats mTotalLatency;
+  int64_t mFrames = 0;
+  int64_t mTotalFrames = 0;
+};
+
+int MockRemote::_send(const void* data, size_t len) {
+  const uint8_t* p = (const uint8_t*)data;
+  while (len > 0) {
+    ssize_t n = send(mFd, p, len, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "send: %s\n", strerror(errno));
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int MockRemote::_sendDisplayInfo(const display_event_t& req) {
+  struct {
+    display_info_event_t ev;
+    display_caps_t caps;
+  } __attribute__((packed)) ack;
+  memset(&ack, 0, sizeof(ack));
+
+  ack.ev.event.type = DD_EVENT_DISPINFO_ACK;
+  ack.ev.event.size = sizeof(ack.ev);
+  ack.ev.info.flags = mFlags;
+  ack.ev.info.width = mOpts.width;
+  ack.ev.info.height = mOpts.height;
+  ack.ev.info.stride = mOpts.width;
+  ack.ev.info.format = 1;  // HAL_PIXEL_FORMAT_RGBA_8888
+  ack.ev.info.xdpi = 240;
+  ack.ev.info.ydpi = 240;
+  ack.ev.info.fps = mOpts.fps;
+  ack.ev.info.minSwapInterval = 1;
+  ack.ev.info.maxSwapInterval = 1;
+  ack.ev.info.numFramebuffers = 2;
+
+  if (req.pad >= 1) {
+    // the ring and the frame channel are not implemented here
+    uint64_t caps = DISPLAY_CAP_REQUEST_ID;
+    if (mOpts.version >= DISPLAY_VERSION_INLINE_FDS)
+      caps |= DISPLAY_CAP_INLINE_FDS;
+    if (mOpts.version >= DISPLAY_VERSION_FRAME_COMMIT)
+      caps |= DISPLAY_CAP_FRAME_COMMIT;
+    if (mOpts.version >= DISPLAY_VERSION_LAYER_DELTA)
+      caps |= DISPLAY_CAP_LAYER_DELTA;
+    ack.caps.version = DISPLAY_CAPS_VERSION;
+    ack.caps.size = sizeof(ack.caps);
+    ack.caps.caps = caps;
+    ack.caps.maxFramesInFlight = mOpts.maxFramesInFlight;
+    ack.ev.event.size = sizeof(ack);
+  }
+  printf("display %ux%u@%u version %u mode %u\n", mOpts.width, mOpts.height,
+         mOpts.fps, mOpts.version, mOpts.mode);
+  return _send(&ack, ack.ev.event.size);
+}
+
+void MockRemote::_queueAck(std::vector<uint8_t> msg, int64_t now) {
+  // one encoder, a frame waits for the ones before it
+  mEncodeDone = std::max(mEncodeDone, now) + mOpts.encodeNs;
+  PendingAck ack;
+  ack.due = mEncodeDone + mOpts.delayNs;
+  ack.received = now;
+  ack.msg = std::move(msg);
+  mAcks.push_back(std::move(ack));
+}
+
+void MockRemote::_queueFrameAck(uint32_t frameSeq, uint32_t id, int64_t now) {
+  frame_commit_ack_event_t ack;
+  memset(&ack, 0, sizeof(ack));
+  ack.event.type = DD_EVENT_FRAME_COMMIT_ACK;
+  ack.event.size = sizeof(ack);
+  ack.event.id = id;
+  ack.frameSeq = frameSeq;
+  ack.flags = mFlags;
+  ack.releaseFence = -1;
+  const uint8_t* p = (const uint8_t*)&ack;
+  _queueAck(std::vector<uint8_t>(p, p + sizeof(ack)), now);
+}
+
+int MockRemote::_decodePixels(const display_event_t& ev, const uint8_t* msg) {
+  display_pixels_event_t pixels;
+  memcpy(&pixels, msg, sizeof(pixels));
+  if (pixels.width != mCanvasWidth || pixels.height != mCanvasHeight) {
+    mCanvasWidth = pixels.width;
+    mCanvasHeight = pixels.height;
+    mCanvas.assign((size_t)mCanvasWidth * mCanvasHeight * 4, 0);
+  }
+
+  size_t offset = sizeof(pixels);
+  for (uint32_t i = 0; i < pixels.numRects; i++) {
+    pixel_rect_t header;
+    if (ev.size - offset < sizeof(header))
+      return -1;
+    memcpy(&header, msg + offset, sizeof(header));
+    offset += sizeof(header);
+    const rect_t& r = header.rect;
+    if (header.size > ev.size - offset || r.left < 0 || r.top < 0 ||
+        r.left >= r.right || r.top >= r.bottom ||
+        (uint32_t)r.right > mCanvasWidth || (uint32_t)r.bottom > mCanvasHeight)
+      return -1;
+    if (mCodec.decode(header.codec, msg + offset, header.size, mCanvas.data(),
+                      mCanvasWidth, r) < 0)
+      return -1;
+    offset += header.size;
+  }
+  mPixelBytes += ev.size;
+  return 0;
+}
+
+int MockRemote::_handle(const display_event_t& ev,
+                        const uint8_t* msg,
+                        int64_t now) {
+  switch (ev.type) {
+    case DD_EVENT_DISPINFO_REQ:
+      return _sendDisplayInfo(ev);
+    case DD_EVENT_CREATE_BUFFER: {
+      // native_handle_t follows buffer_info_t, numFds is its second int
+      int numFds = 0;
+      size_t offset = sizeof(buffer_info_event_t) + sizeof(int);
+      if (ev.size >= offset + sizeof(int)) {
+        memcpy(&numFds, msg + offset, sizeof(int));
+      }
+      if (mOpts.version < DISPLAY_VERSION_INLINE_FDS && numFds > 0) {
+        mSkipBytes = 16;
+      }
+      return 0;
+    }
+    case DD_EVENT_DISPLAY_REQ: {
+      buffer_info_event_t ack;
+      memset(&ack, 0, sizeof(ack));
+      memcpy(&ack, msg, std::min<size_t>(ev.size, sizeof(ack)));
+      ack.event.type = DD_EVENT_DISPLAY_ACK;
+      ack.event.size = sizeof(ack);
+      const uint8_t* p = (const uint8_t*)&ack;
+      _queueAck(std::vector<uint8_t>(p, p + sizeof(ack)), now);
+      return 0;
+    }
+    case DD_EVENT_PRESENT_LAYERS_REQ: {
+      present_layers_ack_event_t ack;
+      memset(&ack, 0, sizeof(ack));
+      ack.event.type = DD_EVENT_PRESENT_LAYERS_ACK;
+      ack.event.size = sizeof(ack);
+      ack.event.id = ev.id;
+      ack.flags = mFlags;
+      ack.releaseFence = -1;
+      const uint8_t* p = (const uint8_t*)&ack;
+      _queueAck(std::vector<uint8_t>(p, p + sizeof(ack)), now);
+      return 0;
+    }
+    case DD_EVENT_FRAME_COMMIT: {
+      frame_commit_event_t commit;
+      if (ev.size < sizeof(commit))
+        return -1;
+      memcpy(&commit, msg, sizeof(commit));
+      _queueFrameAck(commit.frameSeq, ev.id, now);
+      return 0;
+    }
+    case DD_EVENT_DISPLAY_PIXELS: {
+      display_pixels_event_t pixels;
+      if (ev.size < sizeof(pixels) || _decodePixels(ev, msg) < 0)
+        return -1;
+      memcpy(&pixels, msg, sizeof(pixels));
+      _queueFrameAck(pixels.frameSeq, ev.id, now);
+      return 0;
+    }
+    default:
+      return 0;
+  }
+}
+
+int MockRemote::_recv(int64_t now) {
+  uint8_t buf[64 * 1024];
+  char cmsgBuf[CMSG_SPACE(253 * sizeof(int))];
+  while (true) {
+    struct iovec iov = {buf, sizeof(buf)};
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = cmsgBuf;
+    hdr.msg_controllen = sizeof(cmsgBuf);
+    ssize_t len = recvmsg(mFd, &hdr, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    if (len < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 0;
+      fprintf(stderr, "recv: %s\n", strerror(errno));
+      return -1;
+    }
+    if (len == 0) {
+      printf("hal disconnected\n");
+      return -1;
+    }
+
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr); cmsg;
+         cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+      if (cmsg->cmsg_type != SCM_RIGHTS)
+        continue;
+      size_t numFds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      const int* fds = reinterpret_cast<const int*>(CMSG_DATA(cmsg));
+      for (size_t i = 0; i < numFds; i++) {
+        close(fds[i]);
+      }
+    }
+
+    mBuf.insert(mBuf.end(), buf, buf + len);
+    size_t offset = 0;
+    while (true) {
+      if (mSkipBytes) {
+        size_t n = std::min(mSkipBytes, mBuf.size() - offset);
+        offset += n;
+        mSkipBytes -= n;
+        if (mSkipBytes)
+          break;
+      }
+      display_event_t ev;
+      if (mBuf.size() - offset < sizeof(ev))
+        break;
+      memcpy(&ev, mBuf.data() + offset, sizeof(ev));
+      if (ev.size < sizeof(ev)) {
+        fprintf(stderr, "invalid event 0x%x size %u\n", ev.type, ev.size);
+        return -1;
+      }
+      if (mBuf.size() - offset < ev.size)
+        break;
+      if (_handle(ev, mBuf.data() + offset, now) < 0) {
+        fprintf(stderr, "invalid event 0x%x size %u\n", ev.type, ev.size);
+        return -1;
+      }
+      offset += ev.size;
+    }
+    mBuf.erase(mBuf.begin(), mBuf.begin() + offset);
+  }
+}
+
+int MockRemote::_sendAcks(int64_t now) {
+  while (!mAcks.empty() && mAcks.front().due <= now) {
+    auto& ack = mAcks.front();
+    if (_send(ack.msg.data(), ack.msg.size()) < 0)
+      return -1;
+    int64_t latency = nowNs() - ack.received;
+    mLatency.add(latency);
+    mTotalLatency.add(latency);
+    mAcks.pop_front();
+  }
+  return 0;
+}
+
+void MockRemote::_report(const char* name,
+                         LatencyStats& latency,
+                         int64_t frames,
+                         int64_t elapsed) {
+  printf("%-9s %.1f fps received\n", name,
+         elapsed ? frames * 1e9 / elapsed : 0.0);
+  latency.report(name, "frames acked, receive to ack");
+}
+
+int MockRemote::run() {
+  int64_t start = nowNs();
+  int64_t lastReport = start;
+  int ret = 0;
+
+  while (!gStop) {
+    int64_t now = nowNs();
+    if (mOpts.durationNs && now - start >= mOpts.durationNs)
+      break;
+
+    int64_t wake = lastReport + mOpts.reportNs;
+    if (!mAcks.empty()) {
+      wake = std::min(wake, mAcks.front().due);
+    }
+    struct pollfd pfd = {mFd, POLLIN, 0};
+    int timeoutMs = wake > now ? (int)((wake - now + 999999) / 1000000) : 0;
+    if (poll(&pfd, 1, timeoutMs) < 0 && errno != EINTR) {
+      ret = -1;
+      break;
+    }
+
+    now = nowNs();
+    size_t queued = mAcks.size();
+    if ((pfd.revents & (POLLIN | POLLHUP | POLLERR)) && _recv(now) < 0)
+      break;
+    mFrames += mAcks.size() - queued;
+    mTotalFrames += mAcks.size() - queued;
+    if (_sendAcks(now) < 0) {
+      ret = -1;
+      break;
+    }
+
+    if (now - lastReport >= mOpts.reportNs) {
+      _report("interval", mLatency, mFrames, now - lastReport);
+      mLatency.clear();
+      mFrames = 0;
+      lastReport = now;
+    }
+  }
+
+  _report("total", mTotalLatency, mTotalFrames, nowNs() - start);
+  if (mPixelBytes) {
+    printf("%-9s %" PRId64 " bytes of pixels, %.1f KB a frame\n", "total",
+           mPixelBytes, mTotalFrames ? mPixelBytes / 1024.0 / mTotalFrames : 0);
+  }
+  return ret;
+}
+
+static int connectTcp(const char* hostPort) {
+  char host[64];
+  int port = 0;
+  if (sscanf(hostPort, "%63[^:]:%d", host, &port) != 2) {
+    fprintf(stderr, "invalid address %s\n", hostPort);
+    return -1;
+  }
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+    fprintf(stderr, "invalid address %s\n", hostPort);
+    return -1;
+  }
+
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    fprintf(stderr, "connect %s: %s\n", hostPort, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  int on = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  return fd;
+}
+
+static int openSocket(const Options& opts) {
+  if (opts.tcpAddr)
+    return connectTcp(opts.tcpAddr);
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, opts.path, sizeof(addr.sun_path) - 1);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+
+  if (!opts.listenMode) {
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+      fprintf(stderr, "connect %s: %s\n", opts.path, strerror(errno));
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  unlink(opts.path);
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      listen(fd, 1) < 0) {
+    fprintf(stderr, "listen %s: %s\n", opts.path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  printf("waiting for hal on %s\n", opts.path);
+  int client = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+  close(fd);
+  return client;
+}
+
+static void usage(const char* name) {
+  fprintf(stderr,
+          "usage: %s [options]\n"
+          "  -c socket  connect to the hal, default /ipc/hwc-sock\n"
+          "  -l socket  listen for the hal or hwc_replay instead\n"
+          "  -T ip:port connect to the hal by TCP, frames come as pixels\n"
+          "  -s WxH     display size, default 1280x720\n"
+          "  -f fps     display refresh rate, default 60\n"
+          "  -v version DISPLAY_VERSION_* to report, default %d\n"
+          "  -m mode    0 framebuffer, 1 layers, 2 both, default 0\n"
+          "  -n frames  max frames in flight granted to the hal, default 0\n"
+          "  -e ms      encode time of a frame, frames are serialized\n"
+          "  -d ms      delay after encoding until the ack\n"
+          "  -r s       report interval, default 5\n"
+          "  -t s       run time, default until the hal disconnects\n",
+          name, DISPLAY_VERSION_LAYER_DELTA);
+}
+
+int main(int argc, char** argv) {
+  Options opts;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "c:l:T:s:f:v:m:n:e:d:r:t:h")) != -1) {
+    switch (opt) {
+      case 'c':
+      case 'l':
+        opts.path = optarg;
+        opts.listenMode = opt == 'l';
+        break;
+      case 'T':
+        opts.tcpAddr = optarg;
+        break;
+      case 's':
+        if (sscanf(optarg, "%ux%u", &opts.width, &opts.height) != 2) {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'f':
+        opts.fps = atoi(optarg);
+        break;
+      case 'v':
+        opts.version = atoi(optarg);
+        break;
+      case 'm':
+        opts.mode = atoi(optarg);
+        break;
+      case 'n':
+        opts.maxFramesInFlight = atoi(optarg);
+        break;
+      case 'e':
+        opts.encodeNs = (int64_t)(atof(optarg) * 1e6);
+        break;
+      case 'd':
+        opts.delayNs = (int64_t)(atof(optarg) * 1e6);
+        break;
+      case 'r':
+        opts.reportNs = (int64_t)(atof(optarg) * 1e9);
+        break;
+      case 't':
+        opts.durationNs = (int64_t)(atof(optarg) * 1e9);
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if (opts.reportNs <= 0 || opts.mode > 2) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+
+  int fd = openSocket(opts);
+  if (fd < 0)
+    return 1;
+
+  MockRemote remote(fd, opts);
+  int ret = remote.run();
+  close(fd);
+  return ret < 0 ? 1 : 0;
+}
@@ -0,0 +1,447 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+// Replays a capture written by ProtocolRecorder (hwc_vhal.record_dir)
+// against a remote or a mock remote, playing the hal side. Messages the
+// hal sent go out on one socket at their captured times, scaled by the
+// speed factor, and the time until remote acks each frame is reported
+// next to the latency seen when the capture was taken.
+//
+// Frame commits originally sent on a frame channel or a shm ring are sent
+// inline, the setup of those channels is skipped. Buffers and fences are
+// replaced by memfds of the captured size and signalled eventfds, one per
+// captured inode so aliases stay aliases.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <deque>
+#include <map>
+#include <vector>
+
+#include "LatencyStats.h"
+#include "display_protocol.h"
+#include "protocol_capture.h"
+
+struct Record {
+  capture_record_t rec;
+  std::vector<capture_fd_t> fds;
+  std::vector<uint8_t> data;
+};
+
+static int64_t nowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int loadCapture(const char* path, std::vector<Record>& records) {
+  FILE* file = fopen(path, "rb");
+  if (!file) {
+    fprintf(stderr, "open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  capture_header_t header;
+  if (fread(&header, sizeof(header), 1, file) != 1 ||
+      header.magic != CAPTURE_MAGIC || header.version != CAPTURE_VERSION) {
+    fprintf(stderr, "%s is not a capture\n", path);
+    fclose(file);
+    return -1;
+  }
+
+  while (true) {
+    Record r;
+    if (fread(&r.rec, sizeof(r.rec), 1, file) != 1)
+      break;
+    r.fds.resize(r.rec.numFds);
+    r.data.resize(r.rec.size);
+    if ((r.rec.numFds &&
+         fread(r.fds.data(), sizeof(capture_fd_t), r.rec.numFds, file) !=
+             r.rec.numFds) ||
+        (r.rec.size && fread(r.data.data(), r.rec.size, 1, file) != 1)) {
+      fprintf(stderr, "capture truncated after %zd records\n", records.size());
+      break;
+    }
+    records.push_back(std::move(r));
+  }
+  fclose(file);
+  return 0;
+}
+
+static int openSocket(const char* path, bool listenMode) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+
+  if (!listenMode) {
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+      fprintf(stderr, "connect %s: %s\n", path, strerror(errno));
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  unlink(path);
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      listen(fd, 1) < 0) {
+    fprintf(stderr, "listen %s: %s\n", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  printf("waiting for remote on %s\n", path);
+  int client = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+  close(fd);
+  return client;
+}
+
+// stands in for a captured fd, one per inode
+class FdPool {
+ public:
+  ~FdPool() {
+    for (auto& it : mFds) {
+      close(it.second);
+    }
+  }
+
+  int get(const capture_fd_t& info) {
+    auto it = mFds.find(info.ino);
+    if (it != mFds.end())
+      return it->second;
+
+    int fd = -1;
+    if (info.size > 0) {
+      fd = syscall(SYS_memfd_create, "hwc_replay", MFD_CLOEXEC);
+      if (fd >= 0 && ftruncate(fd, info.size) < 0) {
+        close(fd);
+        fd = -1;
+      }
+    } else {
+      // fences, readable means signalled
+      fd = eventfd(1, EFD_CLOEXEC);
+    }
+    if (fd >= 0) {
+      mFds[info.ino] = fd;
+    }
+    return fd;
+  }
+
+ private:
+  std::map<uint64_t, int> mFds;
+};
+
+static bool skipped(const display_event_t& ev) {
+  switch (ev.type) {
+    case DD_EVENT_SETUP_RING:
+    case DD_EVENT_RING_FDS:
+    case DD_EVENT_SETUP_FRAME_CHANNEL:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static int sendRecord(int fd, const Record& r, FdPool& pool) {
+  std::vector<int> fds;
+  for (auto& info : r.fds) {
+    fds.push_back(pool.get(info));
+  }
+
+  struct iovec iov;
+  iov.iov_base = const_cast<uint8_t*>(r.data.data());
+  iov.iov_len = r.data.size();
+
+  struct msghdr hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.msg_iov = &iov;
+  hdr.msg_iovlen = 1;
+
+  std::vector<uint8_t> cmsgBuf;
+  if (fds.size()) {
+    size_t fdlen = fds.size() * sizeof(int);
+    cmsgBuf.resize(CMSG_SPACE(fdlen));
+    hdr.msg_control = cmsgBuf.data();
+    hdr.msg_controllen = cmsgBuf.size();
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(fdlen);
+    memcpy(CMSG_DATA(cmsg), fds.data(), fdlen);
+  }
+
+  // blocking, a remote not keeping up delays the rest of the replay
+  while (iov.iov_len > 0) {
+    ssize_t len = sendmsg(fd, &hdr, MSG_NOSIGNAL);
+    if (len < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "send: %s\n", strerror(errno));
+      return -1;
+    }
+    iov.iov_base = (uint8_t*)iov.iov_base + len;
+    iov.iov_len -= len;
+    hdr.msg_control = nullptr;
+    hdr.msg_controllen = 0;
+  }
+  return 0;
+}
+
+// frames sent and not acked, see RemoteDisplay::_frameAcked
+class FrameTracker {
+ public:
+  void sent(const display_event_t& ev, const uint8_t* data, int64_t time) {
+    if (ev.type == DD_EVENT_FRAME_COMMIT) {
+      frame_commit_event_t commit;
+      memcpy(&commit, data, sizeof(commit));
+      mFrames.push_back({commit.frameSeq, DD_EVENT_FRAME_COMMIT_ACK, time});
+    } else if (ev.type == DD_EVENT_PRESENT_LAYERS_REQ) {
+      mFrames.push_back({0, DD_EVENT_PRESENT_LAYERS_ACK, time});
+    } else if (ev.type == DD_EVENT_DISPLAY_REQ) {
+      mFrames.push_back({0, DD_EVENT_DISPLAY_ACK, time});
+    }
+  }
+
+  void acked(const display_event_t& ev, const uint8_t* data, int64_t time) {
+    uint32_t frameSeq = 0;
+    if (ev.type == DD_EVENT_FRAME_COMMIT_ACK) {
+      if (ev.size < sizeof(frame_commit_ack_event_t))
+        return;
+      frame_commit_ack_event_t ack;
+      memcpy(&ack, data, sizeof(ack));
+      frameSeq = ack.frameSeq;
+    }
+    while (!mFrames.empty()) {
+      auto& frame = mFrames.front();
+      if (ev.type == DD_EVENT_FRAME_COMMIT_ACK) {
+        if (frame.ackType != ev.type ||
+            (int32_t)(frame.frameSeq - frameSeq) > 0)
+          break;
+      } else if (frame.ackType != ev.type) {
+        break;
+      }
+      mLatency.add(time - frame.time);
+      mFrames.pop_front();
+      if (ev.type != DD_EVENT_FRAME_COMMIT_ACK)
+        break;
+    }
+  }
+
+  size_t pending() const { return mFrames.size(); }
+
+  void report(const char* name) { mLatency.report(name, "frames"); }
+
+ private:
+  struct Frame {
+    uint32_t frameSeq;
+    uint32_t ackType;
+    int64_t time;
+  };
+  std::deque<Frame> mFrames;
+  LatencyStats mLatency;
+};
+
+class Receiver {
+ public:
+  explicit Receiver(FrameTracker& tracker) : mTracker(tracker) {}
+
+  // reads what the socket has, -1 once remote is gone
+  int poll(int fd, int64_t time) {
+    uint8_t buf[64 * 1024];
+    char cmsgBuf[CMSG_SPACE(253 * sizeof(int))];
+    while (true) {
+      struct iovec iov = {buf, sizeof(buf)};
+      struct msghdr hdr;
+      memset(&hdr, 0, sizeof(hdr));
+      hdr.msg_iov = &iov;
+      hdr.msg_iovlen = 1;
+      hdr.msg_control = cmsgBuf;
+      hdr.msg_controllen = sizeof(cmsgBuf);
+      ssize_t len = recvmsg(fd, &hdr, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+      if (len < 0) {
+        if (errno == EINTR)
+          continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+          return 0;
+        return -1;
+      }
+      if (len == 0)
+        return -1;
+
+      // release fences are not waited on, only the acks are timed
+      for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr); cmsg;
+           cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+        if (cmsg->cmsg_type != SCM_RIGHTS)
+          continue;
+        size_t numFds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        const int* fds = reinterpret_cast<const int*>(CMSG_DATA(cmsg));
+        for (size_t i = 0; i < numFds; i++) {
+          close(fds[i]);
+        }
+      }
+
+      mBuf.insert(mBuf.end(), buf, buf + len);
+      size_t offset = 0;
+      while (mBuf.size() - offset >= sizeof(display_event_t)) {
+        display_event_t ev;
+        memcpy(&ev, mBuf.data() + offset, sizeof(ev));
+        if (ev.size < sizeof(ev)) {
+          fprintf(stderr, "invalid event 0x%x size %u\n", ev.type, ev.size);
+          return -1;
+        }
+        if (mBuf.size() - offset < ev.size)
+          break;
+        mTracker.acked(ev, mBuf.data() + offset, time);
+        offset += ev.size;
+      }
+      mBuf.erase(mBuf.begin(), mBuf.begin() + offset);
+    }
+  }
+
+ private:
+  FrameTracker& mTracker;
+  std::vector<uint8_t> mBuf;
+};
+
+static void usage(const char* name) {
+  fprintf(stderr,
+          "usage: %s [-l socket | -c socket] [-s speed] capture\n"
+          "  -l socket  listen for the remote like the hal does\n"
+          "  -c socket  connect to a listening remote or mock\n"
+          "  -s speed   time scale, 2 plays twice as fast, 0 back to back\n",
+          name);
+}
+
+int main(int argc, char** argv) {
+  const char* path = nullptr;
+  bool listenMode = true;
+  double speed = 1.0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "l:c:s:h")) != -1) {
+    switch (opt) {
+      case 'l':
+      case 'c':
+        path = optarg;
+        listenMode = opt == 'l';
+        break;
+      case 's':
+        speed = atof(optarg);
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if (!path || optind >= argc || speed < 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  std::vector<Record> records;
+  if (loadCapture(argv[optind], records) < 0)
+    return 1;
+
+  // what the capture itself saw
+  FrameTracker captured;
+  for (auto& r : records) {
+    display_event_t ev;
+    if (r.data.size() < sizeof(ev))
+      continue;
+    memcpy(&ev, r.data.data(), sizeof(ev));
+    if (r.rec.direction == CAPTURE_DIR_SENT) {
+      captured.sent(ev, r.data.data(), r.rec.timestamp);
+    } else {
+      captured.acked(ev, r.data.data(), r.rec.timestamp);
+    }
+  }
+
+  int fd = openSocket(path, listenMode);
+  if (fd < 0)
+    return 1;
+
+  FdPool pool;
+  FrameTracker replayed;
+  Receiver receiver(replayed);
+  size_t sent = 0;
+  int64_t start = nowNs();
+  for (auto& r : records) {
+    display_event_t ev;
+    if (r.rec.direction != CAPTURE_DIR_SENT || r.data.size() < sizeof(ev))
+      continue;
+    memcpy(&ev, r.data.data(), sizeof(ev));
+    if (skipped(ev))
+      continue;
+
+    int64_t due = speed > 0 ? start + (int64_t)(r.rec.timestamp / speed) : 0;
+    while (true) {
+      int64_t now = nowNs();
+      if (receiver.poll(fd, now) < 0) {
+        fprintf(stderr, "remote disconnected after %zd messages\n", sent);
+        close(fd);
+        return 1;
+      }
+      if (now >= due)
+        break;
+      struct pollfd pfd = {fd, POLLIN, 0};
+      int64_t waitMs = (due - now + 999999) / 1000000;
+      ::poll(&pfd, 1, (int)waitMs);
+    }
+
+    replayed.sent(ev, r.data.data(), nowNs());
+    if (sendRecord(fd, r, pool) < 0) {
+      close(fd);
+      return 1;
+    }
+    sent++;
+  }
+
+  // give remote up to a second for the last acks
+  int64_t end = nowNs() + 1000000000LL;
+  for (int64_t now = nowNs(); now < end; now = nowNs()) {
+    if (receiver.poll(fd, now) < 0 || !replayed.pending())
+      break;
+    struct pollfd pfd = {fd, POLLIN, 0};
+    ::poll(&pfd, 1, (int)((end - now) / 1000000) + 1);
+  }
+  close(fd);
+
+  printf("replayed %zd of %zd records in %.3f s\n", sent, records.size(),
+         (nowNs() - start) / 1e9);
+  captured.report("captured");
+  replayed.report("replayed");
+  return 0;
+}